@@ -8,27 +8,55 @@ public:
 	aabb() {}
 	aabb(const point3& min_point_, const point3& max_point_) : min_point(min_point_), max_point(max_point_) {}
 
+	// A box that contains nothing; extending it by any box yields that box
+	static aabb empty() { return aabb(point3(infinity), point3(-infinity)); }
+
+	// Slab test. The ray's direction signs pick the near and far planes directly, so there are no
+	// per-axis swaps or branches. Touching counts as a hit so that flat boxes, like those of disks,
+	// can be hit at all.
 	bool hit(const ray& r, float t_min, float t_max) const
 	{
-		for (int i = 0; i < 3; i++)
-		{
-			const float invD = 1.0 / r.dir[i];
-			const float ta_min = (min_point[i] - r.origin[i]) * invD;
-			const float ta_max = (max_point[i] - r.origin[i]) * invD;
-			const float t0 = min(ta_min, ta_max);
-			const float t1 = max(ta_min, ta_max);
-			t_min = max(t0, t_min);
-			t_max = min(t1, t_max);
-			if(t_max <= t_min)
-				return false;
-		}
-		return true;
+		const point3* bounds = &min_point;
+		const float tx_near = (bounds[r.sign[0]].x - r.origin.x) * r.inv_dir.x;
+		const float tx_far = (bounds[1 - r.sign[0]].x - r.origin.x) * r.inv_dir.x;
+		const float ty_near = (bounds[r.sign[1]].y - r.origin.y) * r.inv_dir.y;
+		const float ty_far = (bounds[1 - r.sign[1]].y - r.origin.y) * r.inv_dir.y;
+		const float tz_near = (bounds[r.sign[2]].z - r.origin.z) * r.inv_dir.z;
+		const float tz_far = (bounds[1 - r.sign[2]].z - r.origin.z) * r.inv_dir.z;
+
+		const float t_entry = max(max(tx_near, ty_near), max(tz_near, t_min));
+		const float t_exit = min(min(tx_far, ty_far), min(tz_far, t_max));
+		return t_entry <= t_exit;
 	}
 
-	point3 min_point, max_point;
+	point3 center() const
+	{
+		return 0.5 * (min_point + max_point);
+	}
+
+	float surface_area() const
+	{
+		const vec3 d = max_point - min_point;
+		if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+		return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+	}
+
+	int longest_axis() const
+	{
+		const vec3 d = max_point - min_point;
+		if (d.x > d.y && d.x > d.z) return 0;
+		return d.y > d.z ? 1 : 2;
+	}
+
+	point3 min_point, max_point;	// hit() relies on these being adjacent
 };
 
 aabb surrounding_box(const aabb& box0, const aabb& box1)
 {
 	return aabb(min(box0.min_point, box1.min_point), max(box0.max_point, box1.max_point));
+}
+
+aabb surrounding_box(const aabb& box, const point3& p)
+{
+	return aabb(min(box.min_point, p), max(box.max_point, p));
 }
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Read-only view of a contiguous array owned elsewhere: a std::vector, or a section of a mapped file
+template<class T>
+class array_view
+{
+public:
+	array_view() {}
+	array_view(const T* items_, size_t count_) : items(items_), count(count_) {}
+	array_view(const std::vector<T>& v) : items(v.data()), count(v.size()) {}
+
+	const T& operator[](size_t i) const { return items[i]; }
+	const T* data() const { return items; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+
+private:
+	const T* items = nullptr;
+	size_t count = 0;
+};
\ No newline at end of file
@@ -0,0 +1,754 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_builder.h"
+#include "camera.h"
+#include "compressed_bvh.h"
+#include "dynamic_bvh.h"
+#include "grid.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "mesh_import.h"
+#include "motion_bvh.h"
+#include "render.h"
+#include "scene_snapshot.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+#include "wide_bvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// The small image most benchmarks render: 400x225 at 8 samples per pixel
+render_settings benchmark_render_settings()
+{
+	render_settings settings;
+	settings.image_width = 400;
+	settings.image_height = 225;
+	settings.samples_per_pixel = 8;
+	return settings;
+}
+
+// Renders world with settings and returns the time it took in milliseconds. The image is written to
+// image when given, resized to fit, and thrown away otherwise.
+double timed_render(const hittable& world, const material_table& materials, const camera& cam, const render_settings& settings,
+	thread_pool& pool, std::vector<color>* image = nullptr, path_stats* stats = nullptr)
+{
+	const size_t num_pixels = static_cast<size_t>(settings.image_width) * settings.image_height;
+	std::vector<color> color_buffer, albedo_buffer(num_pixels);
+	std::vector<color>& output = image ? *image : color_buffer;
+	output.resize(num_pixels);
+
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	render(world, materials, cam, settings, pool, output.data(), albedo_buffer.data(), false, stats);
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+}
+
+// Builds the same BVH with 1, 2, 4... up to all hardware threads and reports the build time of each
+void benchmark_bvh_build(const hittable_list& world, float time0, float time1)
+{
+	std::cout << "BVH build over " << world.objects.size() << " objects\n";
+	const std::vector<aabb> boxes = gather_bounding_boxes(world.objects, time0, time1);
+
+	const unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads))
+	{
+		thread_pool pool(num_threads);
+		bvh_build_settings settings;
+		settings.pool = &pool;
+		const bvh_builder builder(boxes, settings);
+		std::cout << "  " << builder.stats << "\n";
+
+		if (num_threads == max_threads) break;
+	}
+}
+
+// Builds a linear_bvh over the world with each build method, then renders a small image with it,
+// so build time can be weighed against the traversal speed of the resulting tree
+void benchmark_bvh_builders(const hittable_list& world, const material_table& materials, const camera& cam, float time0, float time1, thread_pool& pool)
+{
+	const struct
+	{
+		bvh_build_method method;
+		const char* name;
+	} methods[] = {
+		{ bvh_build_method::median, "median" },
+		{ bvh_build_method::sah, "sah" },
+		{ bvh_build_method::lbvh, "lbvh" },
+		{ bvh_build_method::hlbvh, "hlbvh" },
+	};
+
+	const render_settings settings = benchmark_render_settings();
+
+	std::cout << "BVH builders over " << world.objects.size() << " objects, rendering "
+		<< settings.image_width << "x" << settings.image_height << " at " << settings.samples_per_pixel << "spp\n";
+	for (const auto& m : methods)
+	{
+		bvh_report report;
+		bvh_build_settings build_settings;
+		build_settings.build_method = m.method;
+		build_settings.pool = &pool;
+		build_settings.report = &report;
+		const linear_bvh bvh(world, time0, time1, build_settings);
+
+		const double render_ms = timed_render(bvh, materials, cam, settings, pool);
+
+		std::cout << "  " << m.name << ": " << bvh.build_stats << ", render time: " << render_ms << "ms\n";
+		std::cout << report;
+	}
+}
+
+// Animates a sphere scene through a dynamic_bvh: every frame moves a few spheres, inserts a few
+// more and updates the tree. Compares the update time with rebuilding a linear_bvh from scratch,
+// then traces the same primary rays through the updated tree and a freshly built one. Their hit
+// counts can differ by a grazing ray or two, where the float sphere test is at its limit.
+void benchmark_dynamic_bvh(const hittable_list& world, const camera& cam, thread_pool& pool)
+{
+	const int num_frames = 20, moved_per_frame = 100, inserted_per_frame = 10;
+	hittable_list animated = world;
+	std::vector<shared_ptr<sphere>> spheres;
+	for (const auto& object : animated.objects)
+	{
+		if (const auto s = std::dynamic_pointer_cast<sphere>(object))
+			spheres.push_back(s);
+	}
+	if (spheres.empty())
+		return;
+
+	bvh_build_settings build_settings;
+	build_settings.pool = &pool;
+	dynamic_bvh bvh(animated, 0, 0, build_settings);
+	std::cout << "Dynamic BVH over " << animated.objects.size() << " objects, moving " << moved_per_frame << " and inserting "
+		<< inserted_per_frame << " per frame\n";
+
+	double update_ms = 0;
+	for (int frame = 0; frame < num_frames; frame++)
+	{
+		for (int i = 0; i < moved_per_frame; i++)
+		{
+			const auto& s = spheres[random_int(0, static_cast<int>(spheres.size()) - 1)];
+			s->center += vec3(random_float(-1, 1), 0, random_float(-1, 1));
+			bvh.mark_dirty(s.get());
+		}
+		for (int i = 0; i < inserted_per_frame; i++)
+		{
+			const auto& s = spheres[random_int(0, static_cast<int>(spheres.size()) - 1)];
+			const auto inserted = make_shared<sphere>(s->center + vec3(random_float(-2, 2), 0, random_float(-2, 2)), s->radius, s->material_id);
+			animated.add(inserted);
+			bvh.insert(inserted);
+		}
+		const bvh_update_stats stats = bvh.update();
+		update_ms += stats.update_ms;
+		if (frame == num_frames - 1)
+			std::cout << "  last frame: " << stats << "\n";
+	}
+
+	const linear_bvh rebuilt(animated, 0, 0, build_settings);
+	std::cout << "  average update: " << update_ms / num_frames << "ms, full rebuild: " << rebuilt.build_stats.build_ms << "ms ("
+		<< rebuilt.build_stats.build_ms * num_frames / update_ms << "x)\n";
+
+	const int width = 400, height = 225;
+	std::vector<ray> rays(width * height);
+	for (int i = 0; i < width * height; i++)
+	{
+		rays[i] = cam.get_ray((i % width + random_float()) / (width - 1), (i / width + random_float()) / (height - 1));
+	}
+	const struct
+	{
+		const hittable* accelerator;
+		const char* name;
+	} accelerators[] = {
+		{ &bvh, "updated" },
+		{ &rebuilt, "rebuilt" },
+	};
+	for (const auto& a : accelerators)
+	{
+		size_t hits = 0;
+		const auto start_time = std::chrono::high_resolution_clock::now();
+		for (const ray& r : rays)
+		{
+			primitive_hit hit;
+			hits += a.accelerator->intersect(r, 0.001, infinity, hit);
+		}
+		const double trace_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+		std::cout << "  " << a.name << ": " << hits << " hits, trace time: " << trace_ms << "ms\n";
+	}
+}
+
+// Renders a motion-blurred scene through a linear_bvh over the whole shutter and through a
+// motion_bvh that splits the shutter into time segments
+void benchmark_motion_blur(const hittable_list& world, const material_table& materials, const camera& cam, float time0, float time1, thread_pool& pool)
+{
+	const render_settings settings = benchmark_render_settings();
+
+	bvh_build_settings build_settings;
+	build_settings.pool = &pool;
+	const linear_bvh bvh(world, time0, time1, build_settings);
+	const motion_bvh motion(world, time0, time1, build_settings);
+
+	std::cout << "Motion blur over " << world.objects.size() << " objects, shutter " << time0 << " to " << time1
+		<< ", " << motion.segment_count() << " time segments\n";
+	const struct
+	{
+		const hittable* accelerator;
+		const char* name;
+	} accelerators[] = {
+		{ &bvh, "linear_bvh" },
+		{ &motion, "motion_bvh" },
+	};
+	for (const auto& a : accelerators)
+	{
+		const double render_ms = timed_render(*a.accelerator, materials, cam, settings, pool);
+		std::cout << "  " << a.name << ": render time: " << render_ms << "ms\n";
+	}
+}
+
+// Builds a bvh_node and a uniform_grid over the world and renders a small image with each
+void benchmark_grid(const hittable_list& world, const material_table& materials, const camera& cam, float time0, float time1, thread_pool& pool)
+{
+	const render_settings settings = benchmark_render_settings();
+
+	std::cout << "Grid vs BVH over " << world.objects.size() << " objects\n";
+
+	bvh_build_settings build_settings;
+	build_settings.pool = &pool;
+	const bvh_node bvh(world, time0, time1, build_settings);
+	const uniform_grid grid(world, time0, time1);
+
+	const struct
+	{
+		const hittable* accelerator;
+		const char* name;
+		double build_ms;
+	} accelerators[] = {
+		{ &bvh, "bvh_node", bvh.build_stats.build_ms },
+		{ &grid, "uniform_grid", grid.build_stats.build_ms },
+	};
+	std::cout << "  grid " << grid.build_stats << "\n";
+	for (const auto& a : accelerators)
+	{
+		const double render_ms = timed_render(*a.accelerator, materials, cam, settings, pool);
+		std::cout << "  " << a.name << ": build time: " << a.build_ms << "ms, render time: " << render_ms << "ms\n";
+	}
+}
+
+// Node memory and render time of each BVH layout over the same tree
+void benchmark_bvh_memory(const hittable_list& world, const material_table& materials, const camera& cam, float time0, float time1, thread_pool& pool)
+{
+	const render_settings settings = benchmark_render_settings();
+
+	bvh_build_settings build_settings;
+	build_settings.pool = &pool;
+	const bvh_node tree(world, time0, time1, build_settings);
+	const linear_bvh linear(world, time0, time1, build_settings);
+	const qbvh wide(world, time0, time1, build_settings);
+	const compressed_bvh compressed(world, time0, time1, build_settings);
+
+	std::cout << "BVH memory over " << world.objects.size() << " objects\n";
+	const struct
+	{
+		const hittable* accelerator;
+		const char* name;
+		size_t bytes;
+	} accelerators[] = {
+		// Interior bvh_nodes only; each also has a shared_ptr control block and leaves with several
+		// primitives add a hittable_list
+		{ &tree, "bvh_node", (tree.build_stats.node_count - tree.build_stats.leaf_count) * sizeof(bvh_node) },
+		{ &linear, "linear_bvh", linear.nodes.size() * sizeof(linear_bvh_node) },
+		{ &wide, "qbvh", wide.nodes.size() * sizeof(wide_bvh_node<4>) },
+		{ &compressed, "compressed_bvh", compressed.memory_bytes() },
+	};
+	for (const auto& a : accelerators)
+	{
+		const double render_ms = timed_render(*a.accelerator, materials, cam, settings, pool);
+		std::cout << "  " << a.name << ": node memory: " << a.bytes / 1024 << "KB, render time: " << render_ms << "ms\n";
+	}
+}
+
+// Spheres as separate objects in a linear_bvh against the same spheres in a sphere_batch
+void benchmark_sphere_batch(const hittable_list& world, const material_table& materials, const camera& cam, thread_pool& pool)
+{
+	const render_settings settings = benchmark_render_settings();
+
+	bvh_build_settings build_settings;
+	build_settings.pool = &pool;
+	const linear_bvh linear(world, 0, 0, build_settings);
+
+	sphere_batch batch;
+	for (const auto& object : world.objects)
+	{
+		if (const auto s = std::dynamic_pointer_cast<sphere>(object))
+			batch.add(s->center, s->radius, s->material_id);
+	}
+	bvh_build_settings batch_settings = sphere_batch::default_build_settings();
+	batch_settings.pool = &pool;
+	batch.build(batch_settings);
+
+	std::cout << "Sphere batch over " << batch.size() << " of " << world.objects.size() << " objects\n";
+	const struct
+	{
+		const hittable* accelerator;
+		const char* name;
+		double build_ms;
+	} accelerators[] = {
+		{ &linear, "linear_bvh", linear.build_stats.build_ms },
+		{ &batch, "sphere_batch", batch.build_stats.build_ms },
+	};
+	for (const auto& a : accelerators)
+	{
+		const double render_ms = timed_render(*a.accelerator, materials, cam, settings, pool);
+		std::cout << "  " << a.name << ": build time: " << a.build_ms << "ms, render time: " << render_ms << "ms\n";
+	}
+}
+
+// Renders the same image with 1, 2, 4... up to all hardware threads. Anything shared and written by
+// every thread on the hot path, like a reference count, shows up as speedup falling short of the
+// thread count.
+void benchmark_render_scaling(const hittable_list& world, const material_table& materials, const camera& cam, float time0, float time1)
+{
+	const render_settings settings = benchmark_render_settings();
+
+	const linear_bvh bvh(world, time0, time1);
+
+	std::cout << "Render scaling over " << world.objects.size() << " objects\n";
+	const unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	double single_thread_ms = 0;
+	for (unsigned num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads))
+	{
+		thread_pool pool(num_threads);
+		const double render_ms = timed_render(bvh, materials, cam, settings, pool);
+		if (num_threads == 1)
+			single_thread_ms = render_ms;
+		std::cout << "  " << num_threads << (num_threads == 1 ? " thread" : " threads") << ": render time: " << render_ms
+			<< "ms, speedup " << single_thread_ms / render_ms << "x\n";
+
+		if (num_threads == max_threads) break;
+	}
+}
+
+// Builds mesh without and with early split clipping and traces the same rays through each, cast
+// from around the mesh at random points in its box. Every ray is also tested against all triangles
+// with the scalar intersect_triangle; the SIMD leaf test must find the same closest hit.
+void benchmark_triangle_mesh(triangle_mesh& mesh, thread_pool& pool)
+{
+	const int num_rays = 50000;
+	std::cout << "Triangle mesh of " << mesh.indices.size() / 3 << " triangles\n";
+	mesh.build();
+
+	aabb box;
+	mesh.bounding_box(0, 0, box);
+	const point3 center = box.center();
+	const float radius = (box.max_point - box.min_point).length();
+	std::vector<ray> rays(num_rays);
+	for (ray& r : rays)
+	{
+		const point3 origin = center + radius * random_unit_vector();
+		const point3 target = box.min_point + vec3(random_float(), random_float(), random_float()) * (box.max_point - box.min_point);
+		r = ray(origin, target - origin);
+	}
+
+	std::vector<float> expected(num_rays, infinity);
+	pool.parallel_for(rays.size(), 256, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			const watertight_ray wr(rays[i]);
+			for (uint32_t triangle = 0; triangle < mesh.triangle_count(); triangle++)
+			{
+				float t;
+				if (mesh.intersect_triangle(wr, triangle, 0.001, expected[i], t, nullptr))
+					expected[i] = t;
+			}
+		}
+	});
+
+	for (const float split_ratio : { 0.f, 8.f, 16.f })
+	{
+		triangle_mesh_settings settings;
+		settings.split_ratio = split_ratio;
+		settings.build.pool = &pool;
+		auto start_time = std::chrono::high_resolution_clock::now();
+		mesh.build(settings);
+		const double build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		std::vector<float> found(num_rays, infinity);
+		start_time = std::chrono::high_resolution_clock::now();
+		pool.parallel_for(rays.size(), 1024, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				primitive_hit hit;
+				if (mesh.intersect(rays[i], 0.001, infinity, hit))
+					found[i] = hit.t;
+			}
+		});
+		const double trace_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		// Both tests must agree on hit or miss, then compute the same distance, though fused
+		// multiply-adds may round it differently
+		size_t hits = 0, mismatches = 0;
+		for (int i = 0; i < num_rays; i++)
+		{
+			const bool hit = found[i] < infinity;
+			hits += hit;
+			if (hit != (expected[i] < infinity))
+				mismatches++;
+			else if (hit)
+				mismatches += !(fabs(found[i] - expected[i]) <= 1e-5f * expected[i]);
+		}
+		std::cout << "  split ratio " << split_ratio << ": " << mesh.references.size() << " references, SAH cost " << mesh.build_stats.sah_cost
+			<< ", build " << build_ms << "ms, " << mesh.memory_bytes() / 1024 << "KB\n"
+			<< "    " << hits << " hits, " << mismatches << " mismatches against the scalar test, trace time: " << trace_ms << "ms, "
+			<< num_rays / (trace_ms * 1000) << " Mrays/s\n";
+	}
+}
+
+// Loads a mesh file with 1, 2, 4... up to all hardware threads, then builds its BVH. The first load
+// also pays for reading the file from disk; the later ones find it in the OS cache.
+void benchmark_mesh_import(const char* path)
+{
+	std::cout << "Mesh import of " << path << "\n";
+	triangle_mesh mesh;
+	const unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads))
+	{
+		thread_pool pool(num_threads);
+		mesh_import_stats stats;
+		if (!load_mesh(path, mesh, pool, &stats))
+			return;
+		std::cout << "  " << stats << "\n";
+
+		if (num_threads == max_threads) break;
+	}
+
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	mesh.build();
+	const double build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::cout << "  BVH build: " << build_ms << "ms, " << mesh.nodes.size() << " nodes, "
+		<< mesh.memory_bytes() / (1024.0 * 1024.0) << "MB\n";
+}
+
+// Time to first ray for a scene made from scratch by build_scene, against the same scene loaded from
+// a snapshot at path. key identifies what build_scene makes; a missing or stale snapshot is rewritten.
+template<class F>
+void benchmark_scene_snapshot(const char* path, uint64_t key, const F& build_scene, const camera& cam, thread_pool& pool)
+{
+	const render_settings settings = benchmark_render_settings();
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	material_table built_materials;
+	const hittable_list built = build_scene(built_materials);
+	const double build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::cout << "Scene snapshot " << path << "\n  built from scratch: " << build_ms << "ms\n";
+
+	hittable_list world;
+	material_table materials;
+	scene_snapshot_stats stats;
+	if (!load_scene_snapshot(path, key, world, materials, false, &stats))
+	{
+		start_time = std::chrono::high_resolution_clock::now();
+		if (!save_scene_snapshot(path, key, built, built_materials))
+			return;
+		const double save_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+		std::cout << "  saved: " << save_ms << "ms\n";
+		if (!load_scene_snapshot(path, key, world, materials, false, &stats))
+			return;
+	}
+	std::cout << "  loaded: " << stats << "\n";
+
+	const struct
+	{
+		const hittable_list* world;
+		const material_table* materials;
+		const char* name;
+	} scenes[] = {
+		{ &built, &built_materials, "built" },
+		{ &world, &materials, "loaded" },
+	};
+	for (const auto& scene : scenes)
+	{
+		const double render_ms = timed_render(*scene.world, *scene.materials, cam, settings, pool);
+		std::cout << "  " << scene.name << " render time: " << render_ms << "ms\n";
+	}
+}
+
+// Primary ray throughput traced one at a time against 4x4 and 8x8 packets, on the same rays. Hit
+// counts and the sum of hit distances are printed so the paths can be seen to agree. Then renders
+// a small image with and without packets, where bounces dilute the difference.
+void benchmark_packets(const hittable& world, const material_table& materials, const camera& cam, thread_pool& pool)
+{
+	const int width = 800, height = 448, samples = 4;
+	std::vector<ray> rays(width * height * samples);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			for (int s = 0; s < samples; s++)
+			{
+				rays[(y * width + x) * samples + s] = cam.get_ray((x + random_float()) / (width - 1), (y + random_float()) / (height - 1));
+			}
+		}
+	}
+
+	std::cout << "Primary rays: " << rays.size() << "\n";
+	for (const int packet_size : { 0, 4, 8 })
+	{
+		// One job per band of rows; hit counts and distances are summed per band
+		const int band_height = std::max(packet_size, 1);
+		const int num_bands = height / band_height;
+		std::vector<size_t> band_hits(num_bands, 0);
+		std::vector<double> band_distances(num_bands, 0);
+
+		const auto start_time = std::chrono::high_resolution_clock::now();
+		pool.parallel_for(num_bands, 1, [&](size_t begin, size_t end)
+		{
+			ray_packet packet;
+			float t_max[ray_packet::max_size];
+			primitive_hit hits[ray_packet::max_size];
+			for (size_t band = begin; band < end; band++)
+			{
+				const int y0 = static_cast<int>(band) * band_height;
+				if (packet_size == 0)
+				{
+					for (int x = 0; x < width; x++)
+					{
+						for (int s = 0; s < samples; s++)
+						{
+							primitive_hit hit;
+							if (world.intersect(rays[(y0 * width + x) * samples + s], 0.001, infinity, hit))
+							{
+								band_hits[band]++;
+								band_distances[band] += hit.t;
+							}
+						}
+					}
+					continue;
+				}
+
+				for (int x0 = 0; x0 < width; x0 += packet_size)
+				{
+					for (int s = 0; s < samples; s++)
+					{
+						packet.clear();
+						for (int y = y0; y < y0 + packet_size; y++)
+						{
+							for (int x = x0; x < x0 + packet_size; x++)
+							{
+								packet.add(rays[(y * width + x) * samples + s]);
+							}
+						}
+						packet.finish();
+						std::fill(t_max, t_max + ray_packet::max_size, infinity);
+						const uint64_t found = world.intersect_packet(packet, packet.all(), 0.001, t_max, hits);
+						for (int i = 0; i < packet.size; i++)
+						{
+							if ((found >> i) & 1)
+							{
+								band_hits[band]++;
+								band_distances[band] += t_max[i];
+							}
+						}
+					}
+				}
+			}
+		});
+		const double trace_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+		size_t total_hits = 0;
+		double total_distance = 0;
+		for (int band = 0; band < num_bands; band++)
+		{
+			total_hits += band_hits[band];
+			total_distance += band_distances[band];
+		}
+		std::cout << "  " << (packet_size == 0 ? std::string("single rays") : std::to_string(packet_size) + "x" + std::to_string(packet_size) + " packets")
+			<< ": " << trace_ms << "ms, " << rays.size() / (trace_ms * 1000) << " Mrays/s, " << total_hits << " hits, distance sum " << total_distance << "\n";
+	}
+
+	render_settings settings = benchmark_render_settings();
+	for (const int packet_size : { 0, 8 })
+	{
+		settings.packet_size = packet_size;
+		const double render_ms = timed_render(world, materials, cam, settings, pool);
+		std::cout << "  render with packet size " << packet_size << ": " << render_ms << "ms\n";
+	}
+}
+
+// Renders the scene with render() and with render_wavefront(), with and without sorting paths, at
+// a low and a high sample count. The images should differ only by noise, so their mean values are
+// reported along with the mean difference between them. The wavefront renderer is not expected to
+// be faster; its speed is reported relative to render() with the time each kernel took.
+void benchmark_wavefront(const hittable& world, const material_table& materials, const camera& cam, thread_pool& pool)
+{
+	render_settings settings = benchmark_render_settings();
+	settings.packet_size = 8;
+	const size_t num_pixels = settings.image_width * settings.image_height;
+	std::vector<color> reference_buffer, color_buffer(num_pixels), albedo_buffer(num_pixels);
+
+	const auto mean = [&](const std::vector<color>& buffer)
+	{
+		double sum = 0;
+		for (const color& c : buffer)
+		{
+			sum += c.r + c.g + c.b;
+		}
+		return sum / (3 * num_pixels);
+	};
+
+	for (const int samples : { 8, 64 })
+	{
+		settings.samples_per_pixel = samples;
+		std::cout << "Wavefront at " << samples << " samples per pixel\n";
+
+		const double render_ms = timed_render(world, materials, cam, settings, pool, &reference_buffer);
+		std::cout << "  render: " << render_ms << "ms, mean " << mean(reference_buffer) << "\n";
+
+		for (const bool sort_paths : { false, true })
+		{
+			wavefront_settings wavefront;
+			wavefront.sort_paths = sort_paths;
+			wavefront_stats stats;
+			render_wavefront(world, materials, cam, settings, wavefront, pool, color_buffer.data(), albedo_buffer.data(), &stats);
+
+			double difference = 0;
+			for (size_t i = 0; i < num_pixels; i++)
+			{
+				difference += std::abs(color_buffer[i].r - reference_buffer[i].r) + std::abs(color_buffer[i].g - reference_buffer[i].g)
+					+ std::abs(color_buffer[i].b - reference_buffer[i].b);
+			}
+			std::cout << "  wavefront" << (sort_paths ? ", sorted: " : ", unsorted: ") << stats << "\n"
+				<< "    " << render_ms / stats.total_ms << "x the speed of render(), mean " << mean(color_buffer) << ", mean difference " << difference / (3 * num_pixels) << "\n";
+		}
+	}
+}
+
+// Renders the scene with paths run to max_depth and with Russian roulette from a few depths,
+// reporting the time, average path length and mean pixel value of each. Roulette keeps the image
+// the same up to noise.
+void benchmark_russian_roulette(const hittable& world, const material_table& materials, const camera& cam, thread_pool& pool)
+{
+	render_settings settings = benchmark_render_settings();
+	settings.samples_per_pixel = 32;
+	settings.packet_size = 8;
+	const size_t num_pixels = settings.image_width * settings.image_height;
+	std::vector<color> color_buffer;
+
+	std::cout << "Russian roulette, max depth " << settings.max_depth << "\n";
+	double full_length_ms = 0;
+	for (const int roulette_depth : { -1, 5, 3, 1 })
+	{
+		settings.roulette_depth = roulette_depth;
+		path_stats stats;
+		const double render_ms = timed_render(world, materials, cam, settings, pool, &color_buffer, &stats);
+		if (roulette_depth < 0)
+			full_length_ms = render_ms;
+
+		double sum = 0;
+		for (const color& c : color_buffer)
+		{
+			sum += c.r + c.g + c.b;
+		}
+		std::cout << "  " << (roulette_depth < 0 ? std::string("no roulette") : "roulette from depth " + std::to_string(roulette_depth))
+			<< ": " << render_ms << "ms, speedup " << full_length_ms / render_ms << "x, " << stats << ", mean " << sum / (3 * num_pixels) << "\n";
+	}
+}
+
+// Casts ambient occlusion rays from the surfaces the camera sees: several per point, in random
+// directions about the normal and unbounded in length. Each is tested once with a closest-hit query
+// and once with occluded(), which must agree on every ray.
+void benchmark_occlusion(const hittable& world, const camera& cam, thread_pool& pool)
+{
+	const int width = 400, height = 225, rays_per_point = 8;
+	std::vector<ray> rays;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const ray r = cam.get_ray((x + random_float()) / (width - 1), (y + random_float()) / (height - 1));
+			hit_record rec;
+			if (!world.hit(r, 0.001, infinity, rec))
+				continue;
+			for (int i = 0; i < rays_per_point; i++)
+			{
+				rays.push_back(ray(rec.p, rec.normal + random_unit_vector(), r.time));
+			}
+		}
+	}
+
+	std::vector<uint8_t> closest_hit(rays.size()), any_hit(rays.size());
+	auto start_time = std::chrono::high_resolution_clock::now();
+	pool.parallel_for(rays.size(), 1024, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			primitive_hit hit;
+			closest_hit[i] = world.intersect(rays[i], 0.001, infinity, hit);
+		}
+	});
+	const double closest_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	start_time = std::chrono::high_resolution_clock::now();
+	pool.parallel_for(rays.size(), 1024, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			any_hit[i] = world.occluded(rays[i], 0.001, infinity);
+		}
+	});
+	const double any_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	size_t num_occluded = 0, mismatches = 0;
+	for (size_t i = 0; i < rays.size(); i++)
+	{
+		num_occluded += any_hit[i];
+		mismatches += any_hit[i] != closest_hit[i];
+	}
+	std::cout << "Occlusion rays: " << rays.size() << ", " << num_occluded << " occluded, " << mismatches << " mismatches\n"
+		<< "  closest hit: " << closest_ms << "ms, " << rays.size() / (closest_ms * 1000) << " Mrays/s\n"
+		<< "  occluded: " << any_ms << "ms, " << rays.size() / (any_ms * 1000) << " Mrays/s, speedup " << closest_ms / any_ms << "x\n";
+}
+
+// Renders a scene lit by small emitters with and without sampling its lights directly, at a few
+// sample counts, and compares each image to a reference rendered with light sampling at many
+// samples. Reports the time and the RMS error of each.
+void benchmark_light_sampling(const hittable& world, const material_table& materials, const light_list& lights, const camera& cam, thread_pool& pool)
+{
+	render_settings settings = benchmark_render_settings();
+	settings.image_width = 160;
+	settings.image_height = 90;
+	settings.packet_size = 8;
+	const size_t num_pixels = settings.image_width * settings.image_height;
+	std::vector<color> reference_buffer, color_buffer;
+
+	std::cout << "Light sampling over " << lights.size() << (lights.size() == 1 ? " light\n" : " lights\n");
+	settings.samples_per_pixel = 512;
+	settings.lights = &lights;
+	const double reference_ms = timed_render(world, materials, cam, settings, pool, &reference_buffer);
+	std::cout << "  reference: " << settings.samples_per_pixel << " samples with light sampling, " << reference_ms << "ms\n";
+
+	for (const bool sample_lights : { false, true })
+	{
+		for (const int samples : { 16, 64, 256 })
+		{
+			settings.samples_per_pixel = samples;
+			settings.lights = sample_lights ? &lights : nullptr;
+			path_stats stats;
+			const double render_ms = timed_render(world, materials, cam, settings, pool, &color_buffer, &stats);
+
+			double squared_error = 0;
+			for (size_t i = 0; i < num_pixels; i++)
+			{
+				const color difference = color_buffer[i] - reference_buffer[i];
+				squared_error += difference.length_squared();
+			}
+			std::cout << "  " << (sample_lights ? "light sampling" : "scattering only") << ", " << samples << " samples: " << render_ms << "ms, "
+				<< stats.shadow_rays << " shadow rays, RMS error " << sqrt(squared_error / (3 * num_pixels)) << "\n";
+		}
+	}
+}
\ No newline at end of file
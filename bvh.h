@@ -1,10 +1,10 @@
 #pragma once
 
+#include "bvh_builder.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "rtweekend.h"
 
-#include <algorithm>
 #include <cassert>
 
 class bvh_node : public hittable
@@ -12,88 +12,106 @@ class bvh_node : public hittable
 public:
 	bvh_node() {}
 
-	bvh_node(const hittable_list& list, float time0, float time1)
-		: bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+	bvh_node(const hittable_list& list, float time0, float time1, const bvh_build_settings& settings = bvh_build_settings())
+		: bvh_node(list.objects, 0, list.objects.size(), time0, time1, settings)
 	{}
 
-	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1);
+	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1,
+		const bvh_build_settings& settings = bvh_build_settings());
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
 	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
 
 	shared_ptr<hittable> left, right;
 	aabb box;
-};
+	int axis = 0;	// split axis; the child on the ray's side of it is visited first
 
-inline bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis)
-{
-	aabb box_a, box_b;
+	// Only filled in on the root node
+	bvh_build_stats build_stats;
 
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-	{
-		assert(a_has_box && b_has_box);
-	}
+private:
+	bvh_node(const bvh_builder& builder, const shared_ptr<hittable>* objects, uint32_t node_index);
 
-	return box_a.min[axis] < box_b.min[axis];
-}
-bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) { return box_compare(a, b, 0); }
-bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) { return box_compare(a, b, 1); }
-bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) { return box_compare(a, b, 2); }
+	static shared_ptr<hittable> make_child(const bvh_builder& builder, const shared_ptr<hittable>* objects, uint32_t node_index);
+};
 
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1)
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1,
+	const bvh_build_settings& settings)
 {
-	auto objects = src_objects;
-	const int axis = random_int(0, 2);
-	const auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
+	const shared_ptr<hittable>* objects = src_objects.data() + start;
+	const bvh_builder builder(gather_bounding_boxes(objects, end - start, time0, time1, settings.report), settings);
+	assert(!builder.nodes.empty());
 
-	const size_t object_span = end-start;
-
-	if (object_span == 1)
-	{
-		left = right = objects[start];
-	}
-	else if (object_span == 2)
+	const bvh_build_node& root = builder.nodes[0];
+	if (root.is_leaf())
 	{
-		if (comparator(objects[start], objects[start + 1]))
-		{
-			left = objects[start];
-			right = objects[start+1];
-		}
-		else
-		{
-			left = objects[start+1];
-			right = objects[start];
-		}
+		left = right = make_child(builder, objects, 0);
+		box = root.box;
 	}
 	else
 	{
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
-		auto mid = start + object_span/2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		*this = bvh_node(builder, objects, 0);
 	}
+	build_stats = builder.stats;
 
-	aabb box_left, box_right;
+	// Interior nodes only; their shared_ptr control blocks and multi-primitive leaf lists come on top
+	if (settings.report)
+		settings.report->memory_bytes = (builder.stats.node_count - builder.stats.leaf_count) * sizeof(bvh_node);
+}
 
-	if (!left->bounding_box(time0, time1, box_left)
-		|| !right->bounding_box(time0, time1, box_right))
+bvh_node::bvh_node(const bvh_builder& builder, const shared_ptr<hittable>* objects, uint32_t node_index)
+{
+	const bvh_build_node& node = builder.nodes[node_index];
+	left = make_child(builder, objects, node.left);
+	right = make_child(builder, objects, node.right);
+	box = node.box;
+	axis = node.axis;
+}
+
+shared_ptr<hittable> bvh_node::make_child(const bvh_builder& builder, const shared_ptr<hittable>* objects, uint32_t node_index)
+{
+	const bvh_build_node& node = builder.nodes[node_index];
+	if (!node.is_leaf())
+		return shared_ptr<bvh_node>(new bvh_node(builder, objects, node_index));
+
+	if (node.count == 1)
+		return objects[builder.primitive_indices[node.first]];
+
+	auto leaf = make_shared<hittable_list>();
+	for (uint32_t i = node.first; i < node.first + node.count; i++)
 	{
-		assert(false);
+		leaf->add(objects[builder.primitive_indices[i]]);
 	}
-
-	box = surrounding_box(box_left, box_right);
+	return leaf;
 }
 
-bool bvh_node::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
+bool bvh_node::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
 {
 	if(!box.hit(r, t_min, t_max))
 		return false;
 
-	const bool hit_left = left->hit(r, t_min, t_max, rec);
-	t_max = hit_left ? rec.t : t_max;
-	const bool hit_right = right->hit(r, t_min, t_max, rec);
+	// Front-to-back: a hit in the near child shrinks t_max, so the far child's box test culls it
+	// whenever that hit is closer than the far box's entry
+	const hittable* near_child = r.sign[axis] ? right.get() : left.get();
+	const hittable* far_child = r.sign[axis] ? left.get() : right.get();
+
+	const bool hit_near = near_child->intersect(r, t_min, t_max, hit);
+	t_max = hit_near ? hit.t : t_max;
+	const bool hit_far = far_child->intersect(r, t_min, t_max, hit);
+
+	return hit_near || hit_far;
+}
+
+bool bvh_node::occluded(const ray& r, float t_min, float t_max) const
+{
+	if (!box.hit(r, t_min, t_max))
+		return false;
 
-	return hit_left || hit_right;
+	// With no closest hit to shrink t_max, the order only decides which occluder is found first
+	const hittable* near_child = r.sign[axis] ? right.get() : left.get();
+	const hittable* far_child = r.sign[axis] ? left.get() : right.get();
+	return near_child->occluded(r, t_min, t_max) || far_child->occluded(r, t_min, t_max);
 }
 
 bool bvh_node::bounding_box(float time0, float time1, aabb& output_box) const
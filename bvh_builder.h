@@ -0,0 +1,834 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_report.h"
+#include "hittable.h"
+#include "morton.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+enum class bvh_build_method
+{
+	sah,	// binned surface area heuristic
+	median,	// object median on a random axis (the original builder)
+	lbvh,	// linear BVH from Morton-sorted centroids; fastest to build
+	hlbvh,	// lbvh treelets joined by an SAH-built top level
+};
+
+// Deepest a leaf of any built tree can be. Traversal stacks are sized from this, so the builder
+// forces median splits wherever a tree would otherwise grow deeper.
+const int bvh_max_depth = 64;
+
+struct bvh_build_settings
+{
+	bvh_build_method build_method = bvh_build_method::sah;
+	int max_leaf_size = 4;
+	int bin_count = 16;
+	float traversal_cost = 1.0;		// relative cost of visiting an interior node
+	float intersection_cost = 1.0;	// relative cost of testing one primitive
+	int morton_bits = 30;			// Morton code length for lbvh/hlbvh, 30 or 63
+	int max_depth = bvh_max_depth;	// lower for trees spliced in below the root of another
+	thread_pool* pool = nullptr;	// build in parallel on this pool when set
+	bvh_report* report = nullptr;	// filled in with tree statistics when set
+};
+
+struct bvh_build_stats
+{
+	double build_ms = 0;
+	float sah_cost = 0;
+	size_t node_count = 0;
+	size_t leaf_count = 0;
+	unsigned num_threads = 1;
+};
+
+std::ostream& operator<<(std::ostream& out, const bvh_build_stats& stats)
+{
+	return out << "nodes: " << stats.node_count
+		<< ", leaves: " << stats.leaf_count
+		<< ", SAH cost: " << stats.sah_cost
+		<< ", build time: " << stats.build_ms << "ms on " << stats.num_threads << (stats.num_threads == 1 ? " thread" : " threads");
+}
+
+// Node of the intermediate tree produced by bvh_builder. Nodes are stored depth-first, so an
+// interior node's left child always directly follows it.
+struct bvh_build_node
+{
+	aabb box;
+	uint32_t left = 0, right = 0;	// child node indices, interior nodes only
+	uint32_t first = 0, count = 0;	// range in primitive_indices, leaves only
+	int axis = 0;					// split axis, interior nodes only
+
+	bool is_leaf() const { return count > 0; }
+};
+
+// Builds a BVH over a set of primitive bounding boxes. Works in place on an array of primitive
+// indices, which is partitioned so that every leaf refers to a contiguous range of it.
+//
+// With a thread pool, large ranges are binned and partitioned in parallel chunks and subtrees are
+// built as separate tasks. Chunking depends only on the range size and the subtrees are spliced
+// back in depth-first order, so the tree is identical whatever the number of threads.
+class bvh_builder
+{
+public:
+	// Leaves never hold more primitives than this, whatever max_leaf_size asks for, so that every
+	// node layout can store their counts
+	static const int max_leaf_limit = UINT8_MAX;
+
+	bvh_builder(std::vector<aabb> primitive_boxes_, const bvh_build_settings& settings_ = bvh_build_settings());
+
+	const std::vector<aabb> primitive_boxes;
+	const bvh_build_settings settings;
+
+	std::vector<bvh_build_node> nodes;
+	std::vector<uint32_t> primitive_indices;
+	bvh_build_stats stats;
+
+private:
+	// Ranges at least this big are processed in chunks of this size
+	static const uint32_t chunk_size = 1 << 14;
+	// Subtrees at least this big are built as separate tasks
+	static const uint32_t task_size = 1 << 10;
+
+	struct bin
+	{
+		aabb box = aabb::empty();
+		uint32_t count = 0;
+	};
+
+	// Top Morton code bits that select an hlbvh treelet
+	static const int treelet_bits = 12;
+
+	static bvh_build_settings limit_settings(bvh_build_settings settings);
+
+	uint32_t build(uint32_t start, uint32_t end, int depth, std::vector<bvh_build_node>& out);
+	void build_morton();
+	uint32_t emit_lbvh(uint32_t start, uint32_t end, int bit, int depth, std::vector<bvh_build_node>& out);
+	uint32_t build_upper_sah(std::vector<uint32_t>& treelets, uint32_t start, uint32_t end, int depth, int treelet_depth,
+		const std::vector<uint32_t>& treelet_starts, const std::vector<std::vector<bvh_build_node>>& treelet_nodes,
+		std::vector<bvh_build_node>& out);
+	uint32_t append_subtree(const std::vector<bvh_build_node>& subtree, std::vector<bvh_build_node>& out);
+	uint32_t make_leaf(std::vector<bvh_build_node>& out, uint32_t node_index, uint32_t start, uint32_t end);
+	void compute_bounds(uint32_t start, uint32_t end, aabb& box, aabb& centroid_box);
+	bool find_sah_split(uint32_t start, uint32_t end, const aabb& box, const aabb& centroid_box, uint32_t& mid, int& split_axis);
+	uint32_t partition(uint32_t start, uint32_t end, int axis, float cmin, float to_bin, int split_bin);
+	uint32_t median_split(uint32_t start, uint32_t end, int axis);
+	float compute_sah_cost() const;
+	void fill_report(bvh_report& report) const;
+
+	// Calls task(first_chunk, last_chunk) over the chunks of a range, in parallel if possible
+	template<class F>
+	void for_each_chunk(uint32_t num_chunks, const F& task);
+
+	// Whether a node at depth must split its primitives in half (or become a leaf) for the tree to
+	// stay within max_depth. Halving reaches single primitives after ceil(log2(count)) more levels,
+	// so any split is safe until that would go past the limit.
+	bool must_halve(int depth, uint32_t count, int max_depth) const
+	{
+		int levels = 0;
+		while ((1ull << levels) < count)
+			levels++;
+		return depth + levels >= max_depth;
+	}
+
+	int bin_index(uint32_t prim, int axis, float cmin, float to_bin) const
+	{
+		return std::min(settings.bin_count - 1, static_cast<int>((centroids[prim][axis] - cmin) * to_bin));
+	}
+
+	std::vector<point3> centroids;
+	std::vector<uint64_t> morton_codes;	// sorted, parallel to primitive_indices (lbvh/hlbvh only)
+	thread_pool* pool = nullptr;
+};
+
+// Bounding boxes over the shutter of every object. With a report, also measures how much motion
+// grows the boxes of moving objects.
+std::vector<aabb> gather_bounding_boxes(const shared_ptr<hittable>* objects, size_t count, float time0, float time1, bvh_report* report = nullptr)
+{
+	std::vector<aabb> boxes(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!objects[i]->bounding_box(time0, time1, boxes[i]))
+		{
+			assert(false);
+		}
+	}
+
+	if (report)
+	{
+		double total_expansion = 0;
+		report->moving_count = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			aabb start_box;
+			objects[i]->bounding_box(time0, time0, start_box);
+			const float start_area = start_box.surface_area();
+			const float area = boxes[i].surface_area();
+			if (area > start_area && start_area > 0)
+			{
+				report->moving_count++;
+				total_expansion += area / start_area;
+			}
+		}
+		report->motion_expansion = report->moving_count > 0 ? static_cast<float>(total_expansion / report->moving_count) : 1.f;
+	}
+	return boxes;
+}
+
+std::vector<aabb> gather_bounding_boxes(const std::vector<shared_ptr<hittable>>& objects, float time0, float time1, bvh_report* report = nullptr)
+{
+	return gather_bounding_boxes(objects.data(), objects.size(), time0, time1, report);
+}
+
+// Flags primitives whose box diagonal is more than factor times the median one. Such primitives
+// (a ground sphere of radius 1000, say) overlap most of the scene and are better tested directly
+// than put in an acceleration structure.
+std::vector<bool> find_large_primitives(const std::vector<aabb>& boxes, float factor)
+{
+	std::vector<float> diagonals(boxes.size());
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		diagonals[i] = (boxes[i].max_point - boxes[i].min_point).length();
+	}
+	std::vector<float> sorted_diagonals = diagonals;
+	std::nth_element(sorted_diagonals.begin(), sorted_diagonals.begin() + sorted_diagonals.size() / 2, sorted_diagonals.end());
+
+	std::vector<bool> large(boxes.size(), false);
+	if (boxes.empty())
+		return large;
+
+	const float max_diagonal = factor * sorted_diagonals[sorted_diagonals.size() / 2];
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		large[i] = diagonals[i] > max_diagonal;
+	}
+	return large;
+}
+
+bvh_builder::bvh_builder(std::vector<aabb> primitive_boxes_, const bvh_build_settings& settings_)
+	: primitive_boxes(std::move(primitive_boxes_)), settings(limit_settings(settings_))
+{
+	const auto start_time = std::chrono::high_resolution_clock::now();
+
+	// The median split picks random axes from the thread-local generator, so it stays serial to
+	// remain deterministic
+	if (settings.build_method != bvh_build_method::median)
+		pool = settings.pool;
+
+	const auto num_primitives = static_cast<uint32_t>(primitive_boxes.size());
+	centroids.resize(num_primitives);
+	primitive_indices.resize(num_primitives);
+	for_each_chunk((num_primitives + chunk_size - 1) / chunk_size, [&](uint32_t first_chunk, uint32_t last_chunk)
+	{
+		for (uint32_t i = first_chunk * chunk_size; i < std::min(last_chunk * chunk_size, num_primitives); i++)
+		{
+			centroids[i] = primitive_boxes[i].center();
+			primitive_indices[i] = i;
+		}
+	});
+
+	nodes.reserve(2 * num_primitives);
+	if (num_primitives > 0)
+	{
+		if (settings.build_method == bvh_build_method::lbvh || settings.build_method == bvh_build_method::hlbvh)
+			build_morton();
+		else
+			build(0, num_primitives, 0, nodes);
+	}
+
+	stats.node_count = nodes.size();
+	stats.leaf_count = std::count_if(nodes.begin(), nodes.end(), [](const bvh_build_node& n) { return n.is_leaf(); });
+	stats.sah_cost = compute_sah_cost();
+	stats.num_threads = pool ? pool->num_threads() : 1;
+	stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	if (settings.report)
+		fill_report(*settings.report);
+}
+
+bvh_build_settings bvh_builder::limit_settings(bvh_build_settings settings)
+{
+	if (settings.max_leaf_size < 1)
+		settings.max_leaf_size = 1;
+	if (settings.max_leaf_size > max_leaf_limit)
+		settings.max_leaf_size = max_leaf_limit;
+	if (settings.max_depth > bvh_max_depth)
+		settings.max_depth = bvh_max_depth;
+	return settings;
+}
+
+template<class F>
+void bvh_builder::for_each_chunk(uint32_t num_chunks, const F& task)
+{
+	if (pool && num_chunks > 1)
+	{
+		pool->parallel_for(num_chunks, 1, [&](size_t begin, size_t end)
+		{
+			task(static_cast<uint32_t>(begin), static_cast<uint32_t>(end));
+		});
+	}
+	else
+	{
+		task(0, num_chunks);
+	}
+}
+
+uint32_t bvh_builder::build(uint32_t start, uint32_t end, int depth, std::vector<bvh_build_node>& out)
+{
+	const auto node_index = static_cast<uint32_t>(out.size());
+	out.emplace_back();
+
+	aabb box, centroid_box;
+	compute_bounds(start, end, box, centroid_box);
+	out[node_index].box = box;
+
+	const uint32_t count = end - start;
+	if (count == 1)
+		return make_leaf(out, node_index, start, end);
+
+	uint32_t mid;
+	int axis;
+	if (settings.build_method == bvh_build_method::median)
+	{
+		if (count <= static_cast<uint32_t>(settings.max_leaf_size))
+			return make_leaf(out, node_index, start, end);
+		axis = random_int(0, 2);
+		mid = median_split(start, end, axis);
+	}
+	else if (must_halve(depth, count, settings.max_depth))
+	{
+		// Skewed splits, say over exponentially spaced primitives, would go past the depth limit
+		if (count <= static_cast<uint32_t>(settings.max_leaf_size))
+			return make_leaf(out, node_index, start, end);
+		axis = centroid_box.longest_axis();
+		mid = median_split(start, end, axis);
+	}
+	else if (!find_sah_split(start, end, box, centroid_box, mid, axis))
+	{
+		if (count <= static_cast<uint32_t>(settings.max_leaf_size))
+			return make_leaf(out, node_index, start, end);
+
+		// Too many primitives for a leaf but no useful split (e.g. coincident centroids)
+		axis = centroid_box.longest_axis();
+		mid = median_split(start, end, axis);
+	}
+	out[node_index].axis = axis;
+
+	uint32_t left, right;
+	if (pool && count >= task_size)
+	{
+		// Build the right subtree into its own array on another thread, then append it after the
+		// left subtree so the layout matches a serial build
+		std::vector<bvh_build_node> right_nodes;
+		task_group group(*pool);
+		group.run([&]() { build(mid, end, depth + 1, right_nodes); });
+		left = build(start, mid, depth + 1, out);
+		group.wait();
+
+		right = append_subtree(right_nodes, out);
+	}
+	else
+	{
+		left = build(start, mid, depth + 1, out);
+		right = build(mid, end, depth + 1, out);
+	}
+
+	out[node_index].left = left;
+	out[node_index].right = right;
+	return node_index;
+}
+
+uint32_t bvh_builder::append_subtree(const std::vector<bvh_build_node>& subtree, std::vector<bvh_build_node>& out)
+{
+	// Copies a subtree built in its own array to the end of out, rebasing its child indices
+	const auto offset = static_cast<uint32_t>(out.size());
+	for (bvh_build_node node : subtree)
+	{
+		if (!node.is_leaf())
+		{
+			node.left += offset;
+			node.right += offset;
+		}
+		out.push_back(node);
+	}
+	return offset;
+}
+
+void bvh_builder::build_morton()
+{
+	const auto num_primitives = static_cast<uint32_t>(primitive_indices.size());
+	aabb box, centroid_box;
+	compute_bounds(0, num_primitives, box, centroid_box);
+
+	// Quantize centroids within their bounds and sort by the resulting Morton codes
+	const int bits_per_axis = settings.morton_bits > 30 ? 21 : 10;
+	const int total_bits = 3 * bits_per_axis;
+	const float scale = static_cast<float>((1 << bits_per_axis) - 1);
+	std::vector<morton_primitive> morton(num_primitives);
+	for_each_chunk((num_primitives + chunk_size - 1) / chunk_size, [&](uint32_t first_chunk, uint32_t last_chunk)
+	{
+		for (uint32_t i = first_chunk * chunk_size; i < std::min(last_chunk * chunk_size, num_primitives); i++)
+		{
+			uint32_t q[3];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const float extent = centroid_box.max_point[axis] - centroid_box.min_point[axis];
+				const float t = extent > 0 ? (centroids[i][axis] - centroid_box.min_point[axis]) / extent : 0;
+				q[axis] = static_cast<uint32_t>(t * scale);
+			}
+			morton[i].code = encode_morton3(q[0], q[1], q[2], bits_per_axis);
+			morton[i].index = i;
+		}
+	});
+	radix_sort(morton, total_bits, pool);
+
+	morton_codes.resize(num_primitives);
+	for (uint32_t i = 0; i < num_primitives; i++)
+	{
+		primitive_indices[i] = morton[i].index;
+		morton_codes[i] = morton[i].code;
+	}
+
+	if (settings.build_method == bvh_build_method::lbvh)
+	{
+		emit_lbvh(0, num_primitives, total_bits - 1, 0, nodes);
+		return;
+	}
+
+	// hlbvh: primitives sharing their top Morton bits form a treelet. Treelets are emitted
+	// independently, then joined by an SAH build over their bounds, which is where the quality of
+	// an LBVH suffers most.
+	std::vector<uint32_t> treelet_starts;
+	const int treelet_shift = total_bits - treelet_bits;
+	for (uint32_t i = 0; i < num_primitives; i++)
+	{
+		if (i == 0 || (morton_codes[i] >> treelet_shift) != (morton_codes[i - 1] >> treelet_shift))
+			treelet_starts.push_back(i);
+	}
+	treelet_starts.push_back(num_primitives);
+
+	// The top level is kept within treelet_depth levels, so treelets can be built as if they were
+	// rooted there
+	const auto num_treelets = static_cast<uint32_t>(treelet_starts.size() - 1);
+	const int treelet_depth = std::min(2 * treelet_bits, settings.max_depth / 2);
+	std::vector<std::vector<bvh_build_node>> treelet_nodes(num_treelets);
+	const auto build_treelet = [&](uint32_t t)
+	{
+		emit_lbvh(treelet_starts[t], treelet_starts[t + 1], treelet_shift - 1, treelet_depth, treelet_nodes[t]);
+	};
+	if (pool)
+	{
+		pool->parallel_for(num_treelets, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t t = begin; t < end; t++) build_treelet(static_cast<uint32_t>(t));
+		});
+	}
+	else
+	{
+		for (uint32_t t = 0; t < num_treelets; t++) build_treelet(t);
+	}
+
+	std::vector<uint32_t> treelets(num_treelets);
+	for (uint32_t t = 0; t < num_treelets; t++)
+	{
+		treelets[t] = t;
+	}
+	build_upper_sah(treelets, 0, num_treelets, 0, treelet_depth, treelet_starts, treelet_nodes, nodes);
+}
+
+uint32_t bvh_builder::emit_lbvh(uint32_t start, uint32_t end, int bit, int depth, std::vector<bvh_build_node>& out)
+{
+	// Skip bits that every code in the range shares
+	while (bit >= 0 && ((morton_codes[start] ^ morton_codes[end - 1]) >> bit & 1) == 0)
+		bit--;
+
+	const auto node_index = static_cast<uint32_t>(out.size());
+	out.emplace_back();
+
+	const uint32_t count = end - start;
+	if (count <= static_cast<uint32_t>(settings.max_leaf_size))
+	{
+		aabb box = aabb::empty();
+		for (uint32_t i = start; i < end; i++)
+		{
+			box = surrounding_box(box, primitive_boxes[primitive_indices[i]]);
+		}
+		out[node_index].box = box;
+		return make_leaf(out, node_index, start, end);
+	}
+
+	// The codes are sorted, so the split is the first one with this bit set. If all the codes
+	// are identical there's nothing to split on, so just halve the range to keep leaves small.
+	// Halving at the depth limit leaves both halves differing at bit at most, so they start from it.
+	uint32_t mid = start + count / 2;
+	int child_bit = bit;
+	if (bit >= 0 && !must_halve(depth, count, settings.max_depth))
+	{
+		const uint64_t mask = 1ull << bit;
+		mid = static_cast<uint32_t>(std::partition_point(morton_codes.begin() + start, morton_codes.begin() + end,
+			[mask](uint64_t code) { return (code & mask) == 0; }) - morton_codes.begin());
+		child_bit = bit - 1;
+	}
+
+	uint32_t left, right;
+	if (pool && count >= task_size)
+	{
+		std::vector<bvh_build_node> right_nodes;
+		task_group group(*pool);
+		group.run([&]() { emit_lbvh(mid, end, child_bit, depth + 1, right_nodes); });
+		left = emit_lbvh(start, mid, child_bit, depth + 1, out);
+		group.wait();
+		right = append_subtree(right_nodes, out);
+	}
+	else
+	{
+		left = emit_lbvh(start, mid, child_bit, depth + 1, out);
+		right = emit_lbvh(mid, end, child_bit, depth + 1, out);
+	}
+
+	// Codes interleave x, y, z from the most significant bit down
+	out[node_index].axis = bit >= 0 ? 2 - bit % 3 : 0;
+	out[node_index].box = surrounding_box(out[left].box, out[right].box);
+	out[node_index].left = left;
+	out[node_index].right = right;
+	return node_index;
+}
+
+uint32_t bvh_builder::build_upper_sah(std::vector<uint32_t>& treelets, uint32_t start, uint32_t end, int depth, int treelet_depth,
+	const std::vector<uint32_t>& treelet_starts, const std::vector<std::vector<bvh_build_node>>& treelet_nodes,
+	std::vector<bvh_build_node>& out)
+{
+	if (end - start == 1)
+		return append_subtree(treelet_nodes[treelets[start]], out);
+
+	const auto treelet_box = [&](uint32_t t) -> const aabb& { return treelet_nodes[t][0].box; };
+	const auto treelet_count = [&](uint32_t t) { return static_cast<float>(treelet_starts[t + 1] - treelet_starts[t]); };
+
+	const auto node_index = static_cast<uint32_t>(out.size());
+	out.emplace_back();
+
+	aabb box = aabb::empty();
+	aabb centroid_box = aabb::empty();
+	for (uint32_t i = start; i < end; i++)
+	{
+		box = surrounding_box(box, treelet_box(treelets[i]));
+		centroid_box = surrounding_box(centroid_box, treelet_box(treelets[i]).center());
+	}
+
+	// There are at most 2^treelet_bits treelets, so sorting and sweeping every candidate split
+	// is affordable here
+	float best_cost = infinity;
+	int best_axis = -1;
+	uint32_t best_mid = start + (end - start) / 2;
+	std::vector<float> right_costs(end - start);
+	const bool halve = must_halve(depth, end - start, treelet_depth);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (centroid_box.max_point[axis] <= centroid_box.min_point[axis])
+			continue;
+		if (halve)
+		{
+			// Split the treelets in half, sorted along the longest axis below
+			best_axis = centroid_box.longest_axis();
+			break;
+		}
+
+		std::sort(treelets.begin() + start, treelets.begin() + end, [&](uint32_t a, uint32_t b)
+		{
+			return treelet_box(a).center()[axis] < treelet_box(b).center()[axis];
+		});
+
+		aabb right_box = aabb::empty();
+		float right_count = 0;
+		for (uint32_t i = end - 1; i > start; i--)
+		{
+			right_box = surrounding_box(right_box, treelet_box(treelets[i]));
+			right_count += treelet_count(treelets[i]);
+			right_costs[i - start] = right_box.surface_area() * right_count;
+		}
+
+		aabb left_box = aabb::empty();
+		float left_count = 0;
+		for (uint32_t i = start + 1; i < end; i++)
+		{
+			left_box = surrounding_box(left_box, treelet_box(treelets[i - 1]));
+			left_count += treelet_count(treelets[i - 1]);
+			const float cost = left_box.surface_area() * left_count + right_costs[i - start];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_mid = i;
+			}
+		}
+	}
+
+	if (best_axis >= 0)
+	{
+		// Leave the treelets sorted along the winning axis
+		std::sort(treelets.begin() + start, treelets.begin() + end, [&](uint32_t a, uint32_t b)
+		{
+			return treelet_box(a).center()[best_axis] < treelet_box(b).center()[best_axis];
+		});
+	}
+
+	const uint32_t left = build_upper_sah(treelets, start, best_mid, depth + 1, treelet_depth, treelet_starts, treelet_nodes, out);
+	const uint32_t right = build_upper_sah(treelets, best_mid, end, depth + 1, treelet_depth, treelet_starts, treelet_nodes, out);
+	out[node_index].box = box;
+	out[node_index].axis = std::max(best_axis, 0);
+	out[node_index].left = left;
+	out[node_index].right = right;
+	return node_index;
+}
+
+uint32_t bvh_builder::make_leaf(std::vector<bvh_build_node>& out, uint32_t node_index, uint32_t start, uint32_t end)
+{
+	out[node_index].first = start;
+	out[node_index].count = end - start;
+	return node_index;
+}
+
+void bvh_builder::compute_bounds(uint32_t start, uint32_t end, aabb& box, aabb& centroid_box)
+{
+	box = aabb::empty();
+	centroid_box = aabb::empty();
+	std::mutex merge_mutex;
+	const uint32_t num_chunks = (end - start + chunk_size - 1) / chunk_size;
+	for_each_chunk(num_chunks, [&](uint32_t first_chunk, uint32_t last_chunk)
+	{
+		aabb chunk_box = aabb::empty();
+		aabb chunk_centroid_box = aabb::empty();
+		for (uint32_t i = start + first_chunk * chunk_size; i < std::min(start + last_chunk * chunk_size, end); i++)
+		{
+			chunk_box = surrounding_box(chunk_box, primitive_boxes[primitive_indices[i]]);
+			chunk_centroid_box = surrounding_box(chunk_centroid_box, centroids[primitive_indices[i]]);
+		}
+
+		// min/max are exact, so the merge order doesn't affect the result
+		std::unique_lock<std::mutex> lock(merge_mutex);
+		box = surrounding_box(box, chunk_box);
+		centroid_box = surrounding_box(centroid_box, chunk_centroid_box);
+	});
+}
+
+bool bvh_builder::find_sah_split(uint32_t start, uint32_t end, const aabb& box, const aabb& centroid_box, uint32_t& mid, int& split_axis)
+{
+	// Returns false if making a leaf is cheaper than the best split found
+	const int bin_count = settings.bin_count;
+	float cmin[3], to_bin[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float extent = centroid_box.max_point[axis] - centroid_box.min_point[axis];
+		cmin[axis] = centroid_box.min_point[axis];
+		// Subnormal extents would overflow the scale and send centroids outside the bins
+		to_bin[axis] = extent > 0 && std::isfinite(bin_count / extent) ? bin_count / extent : 0;
+	}
+
+	// Bin all three axes in a single pass over the primitives
+	std::vector<bin> bins(3 * bin_count);
+	std::mutex merge_mutex;
+	const uint32_t num_chunks = (end - start + chunk_size - 1) / chunk_size;
+	for_each_chunk(num_chunks, [&](uint32_t first_chunk, uint32_t last_chunk)
+	{
+		std::vector<bin> chunk_bins(3 * bin_count);
+		for (uint32_t i = start + first_chunk * chunk_size; i < std::min(start + last_chunk * chunk_size, end); i++)
+		{
+			const uint32_t prim = primitive_indices[i];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				bin& b = chunk_bins[axis * bin_count + bin_index(prim, axis, cmin[axis], to_bin[axis])];
+				b.box = surrounding_box(b.box, primitive_boxes[prim]);
+				b.count++;
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(merge_mutex);
+		for (size_t b = 0; b < bins.size(); b++)
+		{
+			bins[b].box = surrounding_box(bins[b].box, chunk_bins[b].box);
+			bins[b].count += chunk_bins[b].count;
+		}
+	});
+
+	const float leaf_cost = settings.intersection_cost * (end - start);
+	const float inv_parent_area = 1.0 / box.surface_area();
+	float best_cost = infinity;
+	int best_axis = -1;
+	int best_bin = 0;
+	std::vector<float> right_areas(bin_count);
+	std::vector<uint32_t> right_counts(bin_count);
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (to_bin[axis] == 0)
+			continue;
+		const bin* axis_bins = &bins[axis * bin_count];
+
+		// Sweep from the right to get the cost of everything above each split plane...
+		aabb right_box = aabb::empty();
+		uint32_t right_count = 0;
+		for (int b = bin_count - 1; b > 0; b--)
+		{
+			right_box = surrounding_box(right_box, axis_bins[b].box);
+			right_count += axis_bins[b].count;
+			right_areas[b] = right_box.surface_area();
+			right_counts[b] = right_count;
+		}
+
+		// ...then from the left to evaluate each plane
+		aabb left_box = aabb::empty();
+		uint32_t left_count = 0;
+		for (int b = 1; b < bin_count; b++)
+		{
+			left_box = surrounding_box(left_box, axis_bins[b - 1].box);
+			left_count += axis_bins[b - 1].count;
+			if (left_count == 0 || right_counts[b] == 0)
+				continue;
+
+			const float cost = settings.traversal_cost + settings.intersection_cost * inv_parent_area
+				* (left_box.surface_area() * left_count + right_areas[b] * right_counts[b]);
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	if (best_axis < 0)
+		return false;
+	if (end - start <= static_cast<uint32_t>(settings.max_leaf_size) && leaf_cost <= best_cost)
+		return false;
+
+	mid = partition(start, end, best_axis, cmin[best_axis], to_bin[best_axis], best_bin);
+	split_axis = best_axis;
+	return true;
+}
+
+uint32_t bvh_builder::partition(uint32_t start, uint32_t end, int axis, float cmin, float to_bin, int split_bin)
+{
+	const auto goes_left = [&](uint32_t prim) { return bin_index(prim, axis, cmin, to_bin) < split_bin; };
+
+	if (end - start < chunk_size)
+	{
+		const auto split = std::partition(primitive_indices.begin() + start, primitive_indices.begin() + end, goes_left);
+		return static_cast<uint32_t>(split - primitive_indices.begin());
+	}
+
+	// Large ranges use a stable chunked partition: count each chunk's left side, then scatter
+	// every chunk to its own offsets
+	const uint32_t num_chunks = (end - start + chunk_size - 1) / chunk_size;
+	std::vector<uint32_t> left_offsets(num_chunks + 1, 0);
+	for_each_chunk(num_chunks, [&](uint32_t first_chunk, uint32_t last_chunk)
+	{
+		for (uint32_t chunk = first_chunk; chunk < last_chunk; chunk++)
+		{
+			const uint32_t chunk_end = std::min(start + (chunk + 1) * chunk_size, end);
+			left_offsets[chunk + 1] = static_cast<uint32_t>(std::count_if(
+				primitive_indices.begin() + start + chunk * chunk_size, primitive_indices.begin() + chunk_end, goes_left));
+		}
+	});
+	for (uint32_t chunk = 0; chunk < num_chunks; chunk++)
+	{
+		left_offsets[chunk + 1] += left_offsets[chunk];
+	}
+	const uint32_t num_left = left_offsets[num_chunks];
+
+	std::vector<uint32_t> partitioned(end - start);
+	for_each_chunk(num_chunks, [&](uint32_t first_chunk, uint32_t last_chunk)
+	{
+		for (uint32_t chunk = first_chunk; chunk < last_chunk; chunk++)
+		{
+			uint32_t left = left_offsets[chunk];
+			uint32_t right = num_left + chunk * chunk_size - left_offsets[chunk];
+			for (uint32_t i = start + chunk * chunk_size; i < std::min(start + (chunk + 1) * chunk_size, end); i++)
+			{
+				const uint32_t prim = primitive_indices[i];
+				partitioned[goes_left(prim) ? left++ : right++] = prim;
+			}
+		}
+	});
+	std::copy(partitioned.begin(), partitioned.end(), primitive_indices.begin() + start);
+
+	return start + num_left;
+}
+
+uint32_t bvh_builder::median_split(uint32_t start, uint32_t end, int axis)
+{
+	const uint32_t mid = start + (end - start) / 2;
+	std::nth_element(primitive_indices.begin() + start, primitive_indices.begin() + mid, primitive_indices.begin() + end,
+		[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+	return mid;
+}
+
+float bvh_builder::compute_sah_cost() const
+{
+	if (nodes.empty())
+		return 0;
+
+	const float root_area = nodes[0].box.surface_area();
+	if (root_area <= 0)
+		return settings.intersection_cost * primitive_indices.size();
+
+	float cost = 0;
+	for (const auto& node : nodes)
+	{
+		const float node_cost = node.is_leaf() ? settings.intersection_cost * node.count : settings.traversal_cost;
+		cost += node_cost * node.box.surface_area() / root_area;
+	}
+	return cost;
+}
+
+void bvh_builder::fill_report(bvh_report& report) const
+{
+	report.node_count = stats.node_count;
+	report.leaf_count = stats.leaf_count;
+	report.primitive_count = primitive_indices.size();
+	report.sah_cost = stats.sah_cost;
+	report.build_ms = stats.build_ms;
+	report.num_threads = stats.num_threads;
+	report.memory_bytes = nodes.size() * sizeof(bvh_build_node) + primitive_indices.size() * sizeof(uint32_t);
+
+	report.max_depth = 0;
+	report.max_leaf_size = settings.max_leaf_size;
+	report.largest_leaf = 0;
+	report.leaf_sizes.assign(1, 0);
+	double total_leaf_depth = 0;
+	double overlap_area = 0, parent_area = 0;
+	std::vector<int> depths(nodes.size(), 0);
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		const bvh_build_node& node = nodes[i];
+		report.max_depth = std::max(report.max_depth, depths[i]);
+		if (node.is_leaf())
+		{
+			total_leaf_depth += depths[i];
+			report.largest_leaf = std::max<size_t>(report.largest_leaf, node.count);
+			const size_t bucket = std::min<size_t>(node.count, bvh_report::max_histogram_size);
+			if (report.leaf_sizes.size() <= bucket)
+				report.leaf_sizes.resize(bucket + 1, 0);
+			report.leaf_sizes[bucket]++;
+		}
+		else
+		{
+			depths[node.left] = depths[node.right] = depths[i] + 1;
+
+			const aabb& left = nodes[node.left].box;
+			const aabb& right = nodes[node.right].box;
+			const aabb overlap(max(left.min_point, right.min_point), min(left.max_point, right.max_point));
+			overlap_area += overlap.surface_area();
+			parent_area += node.box.surface_area();
+		}
+	}
+	report.average_depth = stats.leaf_count > 0 ? static_cast<float>(total_leaf_depth / stats.leaf_count) : 0.f;
+	report.sibling_overlap = parent_area > 0 ? static_cast<float>(overlap_area / parent_area) : 0.f;
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Quality report on a built BVH. Opt in by pointing bvh_build_settings::report at one: the builder
+// fills in the tree statistics, gather_bounding_boxes the motion statistics, and the acceleration
+// structure its own memory use.
+struct bvh_report
+{
+	// Leaves with this many primitives or more share the last histogram bucket
+	static const int max_histogram_size = 32;
+
+	size_t node_count = 0;
+	size_t leaf_count = 0;
+	size_t primitive_count = 0;
+	int max_depth = 0;
+	float average_depth = 0;				// over leaves
+	std::vector<size_t> leaf_sizes;			// leaf_sizes[n] is the number of leaves with n primitives
+	size_t largest_leaf = 0;
+	int max_leaf_size = 0;					// the build setting, which leaves exceed only when they can't be split
+	float sah_cost = 0;
+	float sibling_overlap = 0;				// area of sibling box overlaps over area of their parents
+	size_t moving_count = 0;				// primitives whose box grows over the shutter
+	float motion_expansion = 1;				// average shutter box area over start box area for those
+	double build_ms = 0;
+	size_t memory_bytes = 0;				// nodes of the acceleration structure
+	unsigned num_threads = 1;
+
+	// Signs of a tree that will render slowly
+	std::vector<std::string> warnings() const;
+
+	void write_json(std::ostream& out) const;
+};
+
+std::vector<std::string> bvh_report::warnings() const
+{
+	std::vector<std::string> result;
+	if (max_depth > 48)
+		result.push_back("tree is " + std::to_string(max_depth) + " levels deep, close to the limit past which splits are forced to the median");
+	if (largest_leaf > 2 * static_cast<size_t>(max_leaf_size))
+		result.push_back("a leaf holds " + std::to_string(largest_leaf) + " primitives, more than twice max_leaf_size");
+	if (sibling_overlap > 0.5f)
+		result.push_back("siblings overlap heavily (" + std::to_string(sibling_overlap) + ")");
+	if (motion_expansion > 4)
+		result.push_back("moving primitives have boxes " + std::to_string(motion_expansion) + "x their static size; consider motion_bvh");
+	return result;
+}
+
+std::ostream& operator<<(std::ostream& out, const bvh_report& report)
+{
+	out << "BVH report\n"
+		<< "  nodes: " << report.node_count << ", leaves: " << report.leaf_count << ", primitives: " << report.primitive_count << "\n"
+		<< "  depth: max " << report.max_depth << ", average " << report.average_depth << "\n"
+		<< "  leaf sizes:";
+	for (size_t size = 1; size < report.leaf_sizes.size(); size++)
+	{
+		if (report.leaf_sizes[size] > 0)
+			out << " " << size << (size == bvh_report::max_histogram_size ? "+" : "") << ":" << report.leaf_sizes[size];
+	}
+	out << " (largest " << report.largest_leaf << ")\n"
+		<< "  SAH cost: " << report.sah_cost << ", sibling overlap: " << report.sibling_overlap << "\n"
+		<< "  moving primitives: " << report.moving_count << ", motion expansion: " << report.motion_expansion << "\n"
+		<< "  build time: " << report.build_ms << "ms on " << report.num_threads << (report.num_threads == 1 ? " thread" : " threads")
+		<< ", memory: " << report.memory_bytes / 1024 << "KB\n";
+	for (const std::string& warning : report.warnings())
+	{
+		out << "  warning: " << warning << "\n";
+	}
+	return out;
+}
+
+void bvh_report::write_json(std::ostream& out) const
+{
+	out << "{\n"
+		<< "  \"node_count\": " << node_count << ",\n"
+		<< "  \"leaf_count\": " << leaf_count << ",\n"
+		<< "  \"primitive_count\": " << primitive_count << ",\n"
+		<< "  \"max_depth\": " << max_depth << ",\n"
+		<< "  \"average_depth\": " << average_depth << ",\n"
+		<< "  \"largest_leaf\": " << largest_leaf << ",\n"
+		<< "  \"max_leaf_size\": " << max_leaf_size << ",\n"
+		<< "  \"leaf_sizes\": [";
+	for (size_t size = 0; size < leaf_sizes.size(); size++)
+	{
+		out << (size > 0 ? ", " : "") << leaf_sizes[size];
+	}
+	out << "],\n"
+		<< "  \"sah_cost\": " << sah_cost << ",\n"
+		<< "  \"sibling_overlap\": " << sibling_overlap << ",\n"
+		<< "  \"moving_count\": " << moving_count << ",\n"
+		<< "  \"motion_expansion\": " << motion_expansion << ",\n"
+		<< "  \"build_ms\": " << build_ms << ",\n"
+		<< "  \"memory_bytes\": " << memory_bytes << ",\n"
+		<< "  \"num_threads\": " << num_threads << ",\n"
+		<< "  \"warnings\": [";
+	const std::vector<std::string> messages = warnings();
+	for (size_t i = 0; i < messages.size(); i++)
+	{
+		// Warnings are built from fixed text and numbers, so they need no escaping
+		out << (i > 0 ? ", " : "") << "\"" << messages[i] << "\"";
+	}
+	out << "]\n"
+		<< "}\n";
+}
\ No newline at end of file
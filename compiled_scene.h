@@ -0,0 +1,237 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_builder.h"
+#include "bvh_report.h"
+#include "compressed_bvh.h"
+#include "grid.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "light.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "motion_bvh.h"
+#include "rtweekend.h"
+#include "wide_bvh.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+enum class scene_accelerator
+{
+	automatic,	// linear_bvh, or motion_bvh when motion blows up the boxes
+	none,		// test objects one by one; only sensible for a handful of them
+	bvh_node,
+	linear_bvh,
+	qbvh,
+	compressed_bvh,
+	uniform_grid,
+	motion_bvh,
+};
+
+const char* scene_accelerator_name(scene_accelerator accelerator)
+{
+	const char* names[] = { "automatic", "none", "bvh_node", "linear_bvh", "qbvh", "compressed_bvh", "uniform_grid", "motion_bvh" };
+	return names[static_cast<int>(accelerator)];
+}
+
+struct scene_compile_settings
+{
+	scene_accelerator accelerator = scene_accelerator::automatic;
+	bvh_build_settings build;
+	float time0 = 0, time1 = 0;		// shutter interval of the camera
+	bool print_log = true;
+	// Looked up to find the emissive objects for the light list; none are gathered without it
+	const material_table* materials = nullptr;
+};
+
+// The world as the render loop sees it: an acceleration structure over the bulk of the objects,
+// plus a few that every ray tests directly. Those are the unbounded ones (like a plane), which can't
+// go in a hierarchy, and the huge ones (like a ground sphere), whose box would overlap every subtree.
+// Built once between scene construction and rendering and read-only afterwards.
+class compiled_scene : public hittable
+{
+public:
+	// Automatic selection leaves scenes up to this size unaccelerated
+	static const size_t min_accelerated_objects = 4;
+	// Automatic selection picks motion_bvh once motion grows boxes by this much on average
+	static constexpr float motion_bvh_expansion = 2;
+	// Objects with a box diagonal above this multiple of the median one are tested directly
+	static constexpr float large_object_factor = 32;
+
+	compiled_scene(const hittable_list& world, const scene_compile_settings& settings = scene_compile_settings());
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual uint64_t intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	scene_accelerator accelerator = scene_accelerator::none;
+	shared_ptr<hittable> accelerated;
+	std::vector<shared_ptr<hittable>> always_tested;	// unbounded or huge objects
+	bvh_report report;			// tree statistics for the BVH accelerators
+	double compile_ms = 0;
+	float expected_speedup = 1;	// primitive tests per ray without acceleration over the SAH cost with it
+	light_list lights;			// emitters to sample directly, for render_settings::lights
+};
+
+compiled_scene::compiled_scene(const hittable_list& world, const scene_compile_settings& settings)
+{
+	const auto start_time = std::chrono::high_resolution_clock::now();
+
+	std::vector<shared_ptr<hittable>> candidates;
+	std::vector<aabb> boxes;
+	for (const auto& object : world.objects)
+	{
+		aabb box;
+		if (object->bounding_box(settings.time0, settings.time1, box))
+		{
+			candidates.push_back(object);
+			boxes.push_back(box);
+		}
+		else
+		{
+			always_tested.push_back(object);
+		}
+	}
+
+	hittable_list bounded;
+	const std::vector<bool> large = find_large_primitives(boxes, large_object_factor);
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (large[i])
+			always_tested.push_back(candidates[i]);
+		else
+			bounded.add(candidates[i]);
+	}
+
+	accelerator = settings.accelerator;
+	if (accelerator == scene_accelerator::automatic)
+	{
+		if (bounded.objects.size() <= min_accelerated_objects)
+		{
+			accelerator = scene_accelerator::none;
+		}
+		else
+		{
+			// Only the motion statistics are needed here
+			bvh_report motion;
+			gather_bounding_boxes(bounded.objects, settings.time0, settings.time1, &motion);
+			accelerator = motion.motion_expansion > motion_bvh_expansion ? scene_accelerator::motion_bvh : scene_accelerator::linear_bvh;
+		}
+	}
+
+	bvh_build_settings build_settings = settings.build;
+	build_settings.report = &report;
+	const float time0 = settings.time0, time1 = settings.time1;
+	switch (accelerator)
+	{
+		case scene_accelerator::automatic:
+		case scene_accelerator::none:
+			accelerated = make_shared<hittable_list>(bounded);
+			break;
+		case scene_accelerator::bvh_node:
+			accelerated = make_shared<bvh_node>(bounded, time0, time1, build_settings);
+			break;
+		case scene_accelerator::linear_bvh:
+			accelerated = make_shared<linear_bvh>(bounded, time0, time1, build_settings);
+			break;
+		case scene_accelerator::qbvh:
+			accelerated = make_shared<qbvh>(bounded, time0, time1, build_settings);
+			break;
+		case scene_accelerator::compressed_bvh:
+			accelerated = make_shared<compressed_bvh>(bounded, time0, time1, build_settings);
+			break;
+		case scene_accelerator::uniform_grid:
+			accelerated = make_shared<uniform_grid>(bounded, time0, time1);
+			break;
+		case scene_accelerator::motion_bvh:
+			accelerated = make_shared<motion_bvh>(bounded, time0, time1, build_settings);
+			break;
+	}
+	if (bounded.objects.empty())
+		accelerated = nullptr;
+
+	// The SAH cost is the expected number of primitive tests (plus weighted node visits) for a ray
+	// hitting the scene box; without acceleration that ray tests every primitive
+	if (report.sah_cost > 0)
+		expected_speedup = settings.build.intersection_cost * bounded.objects.size() / report.sah_cost;
+
+	if (settings.materials)
+		lights.gather(world, *settings.materials);
+
+	compile_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	if (settings.print_log)
+	{
+		std::cout << "Compiled scene: " << bounded.objects.size() << " objects in " << scene_accelerator_name(accelerator)
+			<< ", " << always_tested.size() << " unbounded or huge, " << compile_ms << "ms";
+		if (!lights.empty())
+			std::cout << ", " << lights.size() << (lights.size() == 1 ? " light" : " lights");
+		if (report.sah_cost > 0)
+			std::cout << ", expected speedup " << expected_speedup << "x";
+		std::cout << "\n";
+		for (const std::string& warning : report.warnings())
+		{
+			std::cout << "  warning: " << warning << "\n";
+		}
+	}
+}
+
+bool compiled_scene::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	bool hit_anything = false;
+	for (const auto& object : always_tested)
+	{
+		if (object->intersect(r, t_min, t_max, hit))
+		{
+			hit_anything = true;
+			t_max = hit.t;
+		}
+	}
+
+	if (accelerated && accelerated->intersect(r, t_min, t_max, hit))
+		hit_anything = true;
+	return hit_anything;
+}
+
+uint64_t compiled_scene::intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const
+{
+	uint64_t found = 0;
+	for (const auto& object : always_tested)
+	{
+		found |= object->intersect_packet(packet, active, t_min, t_max, hits);
+	}
+
+	if (accelerated)
+		found |= accelerated->intersect_packet(packet, active, t_min, t_max, hits);
+	return found;
+}
+
+bool compiled_scene::occluded(const ray& r, float t_min, float t_max) const
+{
+	for (const auto& object : always_tested)
+	{
+		if (object->occluded(r, t_min, t_max))
+			return true;
+	}
+	return accelerated && accelerated->occluded(r, t_min, t_max);
+}
+
+bool compiled_scene::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (!accelerated)
+		return false;
+	if (!accelerated->bounding_box(time0, time1, output_box))
+		return false;
+
+	for (const auto& object : always_tested)
+	{
+		aabb box;
+		if (!object->bounding_box(time0, time1, box))
+			return false;
+		output_box = surrounding_box(output_box, box);
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,314 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "wide_bvh.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// 4-wide BVH node with child boxes quantized to 8 bits per plane. The node stores its own box as
+// an origin plus a power-of-two scale per axis, and every child plane is an integer multiple of
+// that scale, rounded outwards so the decoded box always contains the child. Interior children are
+// stored next to each other starting at child_base, and the primitives of leaf children next to
+// each other starting at primitive_base, so one index of each is enough.
+struct compressed_bvh_node
+{
+	float origin[3];
+	int8_t exponent[3];		// scale along each axis is 2^exponent
+	uint8_t interior_mask;	// bit i set when child i is a node
+	uint32_t child_base;
+	uint32_t primitive_base;
+	uint8_t meta[4];		// interior children: node offset from child_base; leaves: primitive count
+	uint8_t lo[3][4];		// quantized child boxes, per axis then per child
+	uint8_t hi[3][4];
+};
+
+static_assert(sizeof(compressed_bvh_node) == 52, "compressed_bvh_node should be 52 bytes");
+static_assert(bvh_builder::max_leaf_limit <= UINT8_MAX, "leaf sizes must fit compressed_bvh_node::meta");
+
+// 2^exponent built directly from the float's bits; exponent must be a normal float exponent
+inline float exponent_to_scale(int exponent)
+{
+	const uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return scale;
+}
+
+// Tests a ray against the four quantized child boxes of a node, like intersect_children does for
+// full-precision nodes
+int intersect_children(const compressed_bvh_node& node, const wide_ray& wr, float t_min, float t_max, float* dist)
+{
+#if RT_SSE
+	__m128 t_near = _mm_set1_ps(t_min);
+	__m128 t_far = _mm_set1_ps(t_max);
+	const __m128i zero = _mm_setzero_si128();
+	for (int axis = 0; axis < 3; axis++)
+	{
+		int32_t packed_lo, packed_hi;
+		memcpy(&packed_lo, node.lo[axis], 4);
+		memcpy(&packed_hi, node.hi[axis], 4);
+		const __m128 q_lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_lo), zero), zero));
+		const __m128 q_hi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_hi), zero), zero));
+
+		const __m128 origin = _mm_set1_ps(node.origin[axis]);
+		const __m128 scale = _mm_set1_ps(exponent_to_scale(node.exponent[axis]));
+		const __m128 plane_lo = _mm_add_ps(origin, _mm_mul_ps(q_lo, scale));
+		const __m128 plane_hi = _mm_add_ps(origin, _mm_mul_ps(q_hi, scale));
+
+		const __m128 ray_origin = _mm_set1_ps(wr.origin[axis]);
+		const __m128 inv_dir = _mm_set1_ps(wr.inv_dir[axis]);
+		const __m128 near_plane = wr.neg[axis] ? plane_hi : plane_lo;
+		const __m128 far_plane = wr.neg[axis] ? plane_lo : plane_hi;
+		t_near = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, ray_origin), inv_dir), t_near);
+		t_far = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, ray_origin), inv_dir), t_far);
+	}
+	_mm_storeu_ps(dist, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		float t_near = t_min;
+		float t_far = t_max;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float scale = exponent_to_scale(node.exponent[axis]);
+			const float plane_lo = node.origin[axis] + node.lo[axis][i] * scale;
+			const float plane_hi = node.origin[axis] + node.hi[axis][i] * scale;
+			const float near_plane = wr.neg[axis] ? plane_hi : plane_lo;
+			const float far_plane = wr.neg[axis] ? plane_lo : plane_hi;
+			t_near = max(t_near, (near_plane - wr.origin[axis]) * wr.inv_dir[axis]);
+			t_far = min(t_far, (far_plane - wr.origin[axis]) * wr.inv_dir[axis]);
+		}
+		dist[i] = t_near;
+		mask |= (t_near <= t_far) << i;
+	}
+	return mask;
+#endif
+}
+
+// 4-wide BVH made of compressed_bvh_nodes: 52 bytes per node against 128 for qbvh, with no
+// pointers, virtual calls or per-node allocations in the tree itself.
+class compressed_bvh : public hittable
+{
+public:
+	static const int max_stack_depth = bvh_max_depth * 3;
+
+	compressed_bvh() {}
+	compressed_bvh(const hittable_list& list, float time0, float time1, const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	size_t memory_bytes() const { return nodes.size() * sizeof(compressed_bvh_node); }
+
+	std::vector<compressed_bvh_node> nodes;
+	std::vector<shared_ptr<hittable>> primitives;
+	aabb box;
+	bvh_build_stats build_stats;
+
+private:
+	void emit(const bvh_builder& builder, const std::vector<shared_ptr<hittable>>& objects, uint32_t build_index, uint32_t node_index, int depth);
+	static void quantize(compressed_bvh_node& node, const aabb& box, const aabb* child_boxes, int num_children);
+};
+
+compressed_bvh::compressed_bvh(const hittable_list& list, float time0, float time1, const bvh_build_settings& settings)
+{
+	const bvh_builder builder(gather_bounding_boxes(list.objects, time0, time1, settings.report), settings);
+	build_stats = builder.stats;
+	if (builder.nodes.empty())
+		return;
+
+	box = builder.nodes[0].box;
+	nodes.reserve(builder.nodes.size() / 3 + 1);
+	primitives.reserve(builder.primitive_indices.size());
+	nodes.emplace_back();
+	emit(builder, list.objects, 0, 0, 0);
+	if (settings.report)
+		settings.report->memory_bytes = memory_bytes();
+}
+
+void compressed_bvh::emit(const bvh_builder& builder, const std::vector<shared_ptr<hittable>>& objects, uint32_t build_index, uint32_t node_index, int depth)
+{
+	assert(depth <= bvh_max_depth);
+
+	uint32_t children[4];
+	const int num_children = gather_wide_children<4>(builder, build_index, children);
+
+	aabb child_boxes[4];
+	int num_interior = 0;
+	compressed_bvh_node node = {};
+	node.primitive_base = static_cast<uint32_t>(primitives.size());
+	for (int i = 0; i < num_children; i++)
+	{
+		const bvh_build_node& child = builder.nodes[children[i]];
+		child_boxes[i] = child.box;
+		if (child.is_leaf())
+		{
+			node.meta[i] = static_cast<uint8_t>(child.count);
+			for (uint32_t p = child.first; p < child.first + child.count; p++)
+			{
+				primitives.push_back(objects[builder.primitive_indices[p]]);
+			}
+		}
+		else
+		{
+			node.interior_mask |= 1 << i;
+			node.meta[i] = static_cast<uint8_t>(num_interior++);
+		}
+	}
+	quantize(node, builder.nodes[build_index].box, child_boxes, num_children);
+
+	// Interior children get consecutive slots, then each is filled in depth-first
+	node.child_base = static_cast<uint32_t>(nodes.size());
+	nodes.resize(nodes.size() + num_interior);
+	nodes[node_index] = node;
+	for (int i = 0; i < num_children; i++)
+	{
+		if (node.interior_mask & (1 << i))
+			emit(builder, objects, children[i], node.child_base + node.meta[i], depth + 1);
+	}
+}
+
+void compressed_bvh::quantize(compressed_bvh_node& node, const aabb& box, const aabb* child_boxes, int num_children)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float origin = box.min_point[axis];
+		const float extent = box.max_point[axis] - origin;
+
+		// Smallest power of two scale whose 255 steps still reach the far side of the box
+		int exponent = extent > 0 ? std::max(static_cast<int>(std::ceil(std::log2(extent / 255))), -126) : -126;
+		while (origin + 255 * exponent_to_scale(exponent) < box.max_point[axis])
+			exponent++;
+		assert(exponent >= -126 && exponent <= INT8_MAX);
+		const float scale = exponent_to_scale(exponent);
+
+		node.origin[axis] = origin;
+		node.exponent[axis] = static_cast<int8_t>(exponent);
+		for (int i = 0; i < 4; i++)
+		{
+			if (i >= num_children)
+			{
+				// Inverted, so it is never hit
+				node.lo[axis][i] = 255;
+				node.hi[axis][i] = 0;
+				continue;
+			}
+
+			// Round outwards, then step further out if float rounding left the plane inside the child
+			int lo = static_cast<int>(std::floor((child_boxes[i].min_point[axis] - origin) / scale));
+			lo = std::min(std::max(lo, 0), 255);
+			while (lo > 0 && origin + lo * scale > child_boxes[i].min_point[axis])
+				lo--;
+			int hi = static_cast<int>(std::ceil((child_boxes[i].max_point[axis] - origin) / scale));
+			hi = std::min(std::max(hi, 0), 255);
+			while (hi < 255 && origin + hi * scale < child_boxes[i].max_point[axis])
+				hi++;
+
+			node.lo[axis][i] = static_cast<uint8_t>(lo);
+			node.hi[axis][i] = static_cast<uint8_t>(hi);
+		}
+	}
+}
+
+bool compressed_bvh::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	if (nodes.empty())
+		return false;
+
+	struct stack_entry
+	{
+		uint32_t index;	// node index, or first primitive for leaves
+		uint32_t count;	// primitive count for leaves, 0 for nodes
+		float t;		// distance at which the ray enters the box
+	};
+
+	const wide_ray wr(r);
+	stack_entry stack[max_stack_depth];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, t_min };
+	bool hit_anything = false;
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+		if (entry.t > t_max)
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.count; i++)
+			{
+				if (primitives[i]->intersect(r, t_min, t_max, hit))
+				{
+					hit_anything = true;
+					t_max = hit.t;
+				}
+			}
+			continue;
+		}
+
+		const compressed_bvh_node& node = nodes[entry.index];
+		float dist[4];
+		const int mask = intersect_children(node, wr, t_min, t_max, dist);
+		if (mask == 0)
+			continue;
+
+		// Push hit children farthest first so the nearest is popped next. Leaf primitives follow
+		// each other in child order, so their offsets are a running sum of the leaf counts.
+		stack_entry hits[4];
+		int num_hits = 0;
+		uint32_t next_primitive = node.primitive_base;
+		for (int i = 0; i < 4; i++)
+		{
+			const bool interior = (node.interior_mask >> i) & 1;
+			stack_entry child;
+			if (interior)
+			{
+				child = { node.child_base + node.meta[i], 0, dist[i] };
+			}
+			else
+			{
+				child = { next_primitive, node.meta[i], dist[i] };
+				next_primitive += node.meta[i];
+			}
+			if (!(mask & (1 << i)) || (!interior && child.count == 0))
+				continue;
+
+			int j = num_hits++;
+			while (j > 0 && hits[j - 1].t < child.t)
+			{
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = child;
+		}
+
+		assert(stack_size + num_hits <= max_stack_depth);
+		for (int i = 0; i < num_hits; i++)
+		{
+			stack[stack_size++] = hits[i];
+		}
+	}
+
+	return hit_anything;
+}
+
+bool compressed_bvh::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (nodes.empty())
+		return false;
+
+	output_box = box;
+	return true;
+}
\ No newline at end of file
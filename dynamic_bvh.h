@@ -0,0 +1,626 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+enum class bvh_update_action
+{
+	none,			// nothing was dirty
+	refit,			// bounds refit, topology unchanged
+	partial_rebuild,// some degraded subtrees rebuilt
+	full_rebuild,
+};
+
+struct bvh_update_stats
+{
+	bvh_update_action action = bvh_update_action::none;
+	size_t nodes_refit = 0;
+	size_t subtrees_rebuilt = 0;
+	size_t objects_inserted = 0;
+	double update_ms = 0;
+};
+
+std::ostream& operator<<(std::ostream& out, const bvh_update_stats& stats)
+{
+	const char* actions[] = { "none", "refit", "partial rebuild", "full rebuild" };
+	return out << actions[static_cast<int>(stats.action)]
+		<< ", nodes refit: " << stats.nodes_refit
+		<< ", subtrees rebuilt: " << stats.subtrees_rebuilt
+		<< ", objects inserted: " << stats.objects_inserted
+		<< ", update time: " << stats.update_ms << "ms";
+}
+
+// linear_bvh for animated scenes. After objects move, mark them dirty and call update(): dirty nodes
+// are refit bottom-up (one tree level at a time, in parallel on settings.pool) without changing the
+// topology. Subtrees whose SAH cost has grown too far since they were built are rebuilt in place,
+// as are those that inserted objects join, and the whole tree is rebuilt once most of it has
+// degraded or too many objects were inserted or removed.
+class dynamic_bvh : public hittable
+{
+public:
+	// Subtrees rooted at this depth are the unit of partial rebuilds
+	static const int partial_rebuild_depth = 4;
+
+	dynamic_bvh() {}
+	dynamic_bvh(const hittable_list& list, float time0_, float time1_, const bvh_build_settings& settings_ = bvh_build_settings());
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	void mark_dirty(const hittable* object);
+	// Marks everything under node dirty, for a group of objects that moved together. leaf_of() and
+	// parent_of() find the node of a group from one of its objects.
+	void mark_subtree_dirty(uint32_t node);
+	void mark_all_dirty();
+
+	// Node of the leaf holding object, or UINT32_MAX if it isn't in the tree
+	uint32_t leaf_of(const hittable* object) const;
+	uint32_t parent_of(uint32_t node) const { return parents[node]; }
+
+	// Inserted objects are tested linearly until the next update(), which adds each to the nearest
+	// subtree of at most insert_subtree_size primitives and rebuilds that. Removed ones are left as
+	// placeholders that never hit until the next full rebuild.
+	void insert(const shared_ptr<hittable>& object);
+	bool remove(const hittable* object);
+
+	bvh_update_stats update();
+
+	// Rebuild a subtree once its SAH cost exceeds its cost at build time by this factor
+	float rebuild_threshold = 1.5;
+	// Rebuild everything once this fraction of primitives has been inserted or removed
+	float max_changed_fraction = 0.1;
+	// Inserted objects go down the tree, into the child their box enlarges least, until reaching a
+	// subtree this small
+	uint32_t insert_subtree_size = 64;
+
+	linear_bvh bvh;
+	std::vector<shared_ptr<hittable>> pending;
+	float time0 = 0, time1 = 0;
+	bvh_build_settings settings;
+
+private:
+	class removed_object : public hittable
+	{
+	public:
+		virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override { return false; }
+		virtual bool bounding_box(float time0, float time1, aabb& output_box) const override { return false; }
+	};
+
+	// A rebuilt subtree, with its primitives and their ids in leaf order and offsets relative to
+	// the first
+	struct subtree
+	{
+		std::vector<linear_bvh_node> nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+		std::vector<uint32_t> ids;
+	};
+
+	void full_rebuild();
+	void rebuild_subtrees(const std::vector<uint32_t>& roots, const std::unordered_map<uint32_t, std::vector<shared_ptr<hittable>>>& additions);
+	bool splice(uint32_t old_index, std::unordered_map<uint32_t, subtree>& replacements, std::vector<linear_bvh_node>& nodes_out,
+		std::vector<shared_ptr<hittable>>& primitives_out, std::vector<uint32_t>& ids_out);
+	uint32_t slot_of(const hittable* object) const;
+	uint32_t insertion_subtree(const hittable& object) const;
+	void subtree_primitives(uint32_t index, uint32_t& first, uint32_t& last) const;
+	int depth_of(uint32_t index) const;
+	void assign_ids();
+	void index_tree();
+	void refit_node(uint32_t index);
+	float subtree_cost(uint32_t index) const;
+	uint32_t subtree_end(uint32_t index) const;
+
+	std::vector<uint32_t> parents;
+	std::vector<std::vector<uint32_t>> levels;	// node indices by depth
+	std::vector<uint8_t> dirty;
+	std::vector<uint32_t> leaf_of_primitive;
+	// Objects keep their ids while partial rebuilds move them between slots, so only the small
+	// arrays below are redone after one, not the map
+	std::unordered_map<const hittable*, uint32_t> object_ids;
+	std::vector<uint32_t> primitive_ids;	// id of each primitive slot, UINT32_MAX for removed ones
+	std::vector<uint32_t> id_slots;			// slot of each id
+	std::vector<uint32_t> partial_roots;
+	std::vector<float> partial_build_costs;
+	size_t num_inserted = 0;	// since the last full rebuild
+	size_t num_removed = 0;
+	shared_ptr<hittable> removed = make_shared<removed_object>();
+};
+
+dynamic_bvh::dynamic_bvh(const hittable_list& list, float time0_, float time1_, const bvh_build_settings& settings_)
+	: time0(time0_), time1(time1_), settings(settings_)
+{
+	bvh = linear_bvh(list.objects, time0, time1, settings);
+	assign_ids();
+	index_tree();
+}
+
+bool dynamic_bvh::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	bool hit_anything = bvh.intersect(r, t_min, t_max, hit);
+	if (hit_anything)
+		t_max = hit.t;
+
+	for (const auto& object : pending)
+	{
+		if (object->intersect(r, t_min, t_max, hit))
+		{
+			hit_anything = true;
+			t_max = hit.t;
+		}
+	}
+	return hit_anything;
+}
+
+bool dynamic_bvh::bounding_box(float t0, float t1, aabb& output_box) const
+{
+	bool has_box = bvh.bounding_box(t0, t1, output_box);
+	for (const auto& object : pending)
+	{
+		aabb box;
+		if (!object->bounding_box(t0, t1, box))
+			return false;
+		output_box = has_box ? surrounding_box(output_box, box) : box;
+		has_box = true;
+	}
+	return has_box;
+}
+
+uint32_t dynamic_bvh::slot_of(const hittable* object) const
+{
+	const auto id = object_ids.find(object);
+	return id == object_ids.end() ? UINT32_MAX : id_slots[id->second];
+}
+
+void dynamic_bvh::mark_dirty(const hittable* object)
+{
+	const uint32_t slot = slot_of(object);
+	if (slot == UINT32_MAX)
+		return;
+
+	// Walk up until reaching a node that is already dirty, so marking many objects stays linear
+	uint32_t node = leaf_of_primitive[slot];
+	while (!dirty[node])
+	{
+		dirty[node] = 1;
+		if (node == 0) break;
+		node = parents[node];
+	}
+}
+
+void dynamic_bvh::mark_subtree_dirty(uint32_t node)
+{
+	std::fill(dirty.begin() + node, dirty.begin() + subtree_end(node), 1);
+	while (node != 0)
+	{
+		node = parents[node];
+		if (dirty[node]) break;
+		dirty[node] = 1;
+	}
+}
+
+void dynamic_bvh::mark_all_dirty()
+{
+	std::fill(dirty.begin(), dirty.end(), 1);
+}
+
+uint32_t dynamic_bvh::leaf_of(const hittable* object) const
+{
+	const uint32_t slot = slot_of(object);
+	return slot == UINT32_MAX ? UINT32_MAX : leaf_of_primitive[slot];
+}
+
+void dynamic_bvh::insert(const shared_ptr<hittable>& object)
+{
+	pending.push_back(object);
+}
+
+bool dynamic_bvh::remove(const hittable* object)
+{
+	const auto pending_object = std::find_if(pending.begin(), pending.end(),
+		[object](const shared_ptr<hittable>& p) { return p.get() == object; });
+	if (pending_object != pending.end())
+	{
+		pending.erase(pending_object);
+		return true;
+	}
+
+	const uint32_t slot = slot_of(object);
+	if (slot == UINT32_MAX)
+		return false;
+
+	mark_dirty(object);
+	bvh.primitives[slot] = removed;
+	primitive_ids[slot] = UINT32_MAX;
+	object_ids.erase(object);
+	num_removed++;
+	return true;
+}
+
+bvh_update_stats dynamic_bvh::update()
+{
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	bvh_update_stats stats;
+
+	const size_t num_changed = pending.size() + num_inserted + num_removed;
+	bool rebuild_all = num_changed > max_changed_fraction * std::max<size_t>(bvh.primitives.size(), 1) || bvh.nodes.empty();
+	std::vector<uint32_t> degraded;
+	if (!rebuild_all && dirty[0])
+	{
+		// Note which partial rebuild subtrees are about to change before refitting clears the flags
+		std::vector<uint32_t> changed_subtrees;
+		for (size_t i = 0; i < partial_roots.size(); i++)
+		{
+			if (dirty[partial_roots[i]])
+				changed_subtrees.push_back(static_cast<uint32_t>(i));
+		}
+
+		// Bottom-up refit: every node on a level only depends on the level below
+		for (int depth = static_cast<int>(levels.size()) - 1; depth >= 0; depth--)
+		{
+			const std::vector<uint32_t>& level = levels[depth];
+			const auto refit_range = [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					if (dirty[level[i]])
+						refit_node(level[i]);
+				}
+			};
+			if (settings.pool)
+				settings.pool->parallel_for(level.size(), 1024, refit_range);
+			else
+				refit_range(0, level.size());
+		}
+		stats.nodes_refit = std::count(dirty.begin(), dirty.end(), 2);
+		std::fill(dirty.begin(), dirty.end(), 0);
+		stats.action = bvh_update_action::refit;
+
+		for (const uint32_t subtree : changed_subtrees)
+		{
+			if (subtree_cost(partial_roots[subtree]) > rebuild_threshold * partial_build_costs[subtree])
+				degraded.push_back(partial_roots[subtree]);
+		}
+		rebuild_all = !degraded.empty() && degraded.size() * 2 >= partial_roots.size();
+	}
+
+	if (rebuild_all)
+	{
+		if (!bvh.nodes.empty() || !pending.empty())
+		{
+			stats.objects_inserted = pending.size();
+			full_rebuild();
+			stats.action = bvh_update_action::full_rebuild;
+		}
+	}
+	else if (!degraded.empty() || !pending.empty())
+	{
+		// Inserted objects find their subtrees against the refit bounds
+		std::unordered_map<uint32_t, std::vector<shared_ptr<hittable>>> additions;
+		std::vector<uint32_t> candidates = degraded;
+		for (const auto& object : pending)
+		{
+			const uint32_t root = insertion_subtree(*object);
+			if (additions.find(root) == additions.end())
+				candidates.push_back(root);
+			additions[root].push_back(object);
+		}
+
+		// Subtrees are contiguous in depth-first order, so one holding another comes first once
+		// sorted. A subtree inside one rebuilt anyway hands its objects over to that one.
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		std::vector<uint32_t> roots;
+		for (const uint32_t candidate : candidates)
+		{
+			if (!roots.empty() && candidate < subtree_end(roots.back()))
+			{
+				const auto added = additions.find(candidate);
+				if (added != additions.end())
+				{
+					std::vector<shared_ptr<hittable>>& outer = additions[roots.back()];
+					outer.insert(outer.end(), added->second.begin(), added->second.end());
+				}
+				continue;
+			}
+			roots.push_back(candidate);
+		}
+
+		rebuild_subtrees(roots, additions);
+		stats.action = bvh_update_action::partial_rebuild;
+		stats.subtrees_rebuilt = roots.size();
+		stats.objects_inserted = pending.size();
+		num_inserted += pending.size();
+		pending.clear();
+	}
+
+	stats.update_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	return stats;
+}
+
+uint32_t dynamic_bvh::insertion_subtree(const hittable& object) const
+{
+	aabb box;
+	if (!object.bounding_box(time0, time1, box))
+		return 0;
+
+	uint32_t index = 0;
+	uint32_t first, last;
+	subtree_primitives(index, first, last);
+	while (!bvh.nodes[index].is_leaf() && last - first > insert_subtree_size)
+	{
+		const uint32_t left = index + 1, right = bvh.nodes[index].second_child_offset;
+		const aabb& left_box = bvh.nodes[left].box;
+		const aabb& right_box = bvh.nodes[right].box;
+		const float left_growth = surrounding_box(left_box, box).surface_area() - left_box.surface_area();
+		const float right_growth = surrounding_box(right_box, box).surface_area() - right_box.surface_area();
+		index = left_growth <= right_growth ? left : right;
+		subtree_primitives(index, first, last);
+	}
+	return index;
+}
+
+void dynamic_bvh::refit_node(uint32_t index)
+{
+	linear_bvh_node& node = bvh.nodes[index];
+	if (node.is_leaf())
+	{
+		aabb box = aabb::empty();
+		for (uint32_t i = node.primitives_offset; i < node.primitives_offset + node.primitive_count; i++)
+		{
+			aabb primitive_box;
+			if (bvh.primitives[i]->bounding_box(time0, time1, primitive_box))
+				box = surrounding_box(box, primitive_box);
+		}
+		node.box = box;
+	}
+	else
+	{
+		node.box = surrounding_box(bvh.nodes[index + 1].box, bvh.nodes[node.second_child_offset].box);
+	}
+	// Refit nodes are flagged 2 so update() can count them
+	dirty[index] = 2;
+}
+
+void dynamic_bvh::full_rebuild()
+{
+	std::vector<shared_ptr<hittable>> objects;
+	objects.reserve(bvh.primitives.size() + pending.size());
+	for (const auto& object : bvh.primitives)
+	{
+		if (object != removed)
+			objects.push_back(object);
+	}
+	objects.insert(objects.end(), pending.begin(), pending.end());
+	pending.clear();
+	num_inserted = 0;
+	num_removed = 0;
+
+	bvh = linear_bvh(objects, time0, time1, settings);
+	assign_ids();
+	index_tree();
+}
+
+void dynamic_bvh::rebuild_subtrees(const std::vector<uint32_t>& roots, const std::unordered_map<uint32_t, std::vector<shared_ptr<hittable>>>& additions)
+{
+	// Each subtree covers a contiguous range of primitives, which is rebuilt along with the objects
+	// joining it. Node and primitive counts can both change, so both arrays are spliced together.
+	std::unordered_map<uint32_t, subtree> replacements;
+	for (const uint32_t root : roots)
+	{
+		// The subtree goes back in below its root's depth, so it must stay that much shallower
+		bvh_build_settings subtree_settings = settings;
+		subtree_settings.max_depth = settings.max_depth - depth_of(root);
+		subtree_settings.report = nullptr;
+
+		uint32_t first, last;
+		subtree_primitives(root, first, last);
+		std::vector<shared_ptr<hittable>> objects(bvh.primitives.begin() + first, bvh.primitives.begin() + last);
+		std::vector<uint32_t> ids(primitive_ids.begin() + first, primitive_ids.begin() + last);
+		const auto added = additions.find(root);
+		if (added != additions.end())
+		{
+			for (const auto& object : added->second)
+			{
+				objects.push_back(object);
+				ids.push_back(static_cast<uint32_t>(id_slots.size()));
+				object_ids[object.get()] = ids.back();
+				id_slots.push_back(UINT32_MAX);
+			}
+		}
+
+		// Removed placeholders have no bounds, so give them a point box inside the subtree
+		std::vector<aabb> boxes(objects.size());
+		const point3 fallback = bvh.nodes[root].box.center();
+		for (size_t i = 0; i < objects.size(); i++)
+		{
+			if (!objects[i]->bounding_box(time0, time1, boxes[i]))
+				boxes[i] = aabb(fallback, fallback);
+		}
+
+		const bvh_builder builder(std::move(boxes), subtree_settings);
+		subtree& replacement = replacements[root];
+		linear_bvh::flatten(builder, 0, replacement.nodes);
+		replacement.primitives.reserve(objects.size());
+		replacement.ids.reserve(objects.size());
+		for (const uint32_t index : builder.primitive_indices)
+		{
+			replacement.primitives.push_back(std::move(objects[index]));
+			replacement.ids.push_back(ids[index]);
+		}
+	}
+
+	// Every inserted object adds at most two nodes
+	std::vector<linear_bvh_node> new_nodes;
+	std::vector<shared_ptr<hittable>> new_primitives;
+	std::vector<uint32_t> new_ids;
+	new_nodes.reserve(bvh.nodes.size() + 2 * pending.size());
+	new_primitives.reserve(bvh.primitives.size() + pending.size());
+	new_ids.reserve(bvh.primitives.size() + pending.size());
+	splice(0, replacements, new_nodes, new_primitives, new_ids);
+	bvh.nodes.swap(new_nodes);
+	bvh.primitives.swap(new_primitives);
+	primitive_ids.swap(new_ids);
+	index_tree();
+}
+
+bool dynamic_bvh::splice(uint32_t old_index, std::unordered_map<uint32_t, subtree>& replacements, std::vector<linear_bvh_node>& nodes_out,
+	std::vector<shared_ptr<hittable>>& primitives_out, std::vector<uint32_t>& ids_out)
+{
+	// Appends the subtree at old_index, depth-first, so leaves are reached in primitive order and
+	// each moves its own primitives over. Returns whether a replacement was spliced in below, whose
+	// ancestors are refit on the way back up as it may have taken in objects.
+	const auto new_index = static_cast<uint32_t>(nodes_out.size());
+	const auto replacement = replacements.find(old_index);
+	if (replacement != replacements.end())
+	{
+		const auto primitive_offset = static_cast<uint32_t>(primitives_out.size());
+		for (linear_bvh_node node : replacement->second.nodes)
+		{
+			if (node.is_leaf())
+				node.primitives_offset += primitive_offset;
+			else
+				node.second_child_offset += new_index;
+			nodes_out.push_back(node);
+		}
+		std::move(replacement->second.primitives.begin(), replacement->second.primitives.end(), std::back_inserter(primitives_out));
+		ids_out.insert(ids_out.end(), replacement->second.ids.begin(), replacement->second.ids.end());
+		return true;
+	}
+
+	const linear_bvh_node old_node = bvh.nodes[old_index];
+	nodes_out.push_back(old_node);
+	if (old_node.is_leaf())
+	{
+		nodes_out[new_index].primitives_offset = static_cast<uint32_t>(primitives_out.size());
+		const uint32_t first = old_node.primitives_offset, last = old_node.primitives_offset + old_node.primitive_count;
+		std::move(bvh.primitives.begin() + first, bvh.primitives.begin() + last, std::back_inserter(primitives_out));
+		ids_out.insert(ids_out.end(), primitive_ids.begin() + first, primitive_ids.begin() + last);
+		return false;
+	}
+
+	const bool left_replaced = splice(old_index + 1, replacements, nodes_out, primitives_out, ids_out);
+	const auto second_child = static_cast<uint32_t>(nodes_out.size());
+	const bool right_replaced = splice(old_node.second_child_offset, replacements, nodes_out, primitives_out, ids_out);
+	nodes_out[new_index].second_child_offset = second_child;
+	if (left_replaced || right_replaced)
+		nodes_out[new_index].box = surrounding_box(nodes_out[new_index + 1].box, nodes_out[second_child].box);
+	return left_replaced || right_replaced;
+}
+
+void dynamic_bvh::assign_ids()
+{
+	// After a full build, ids start over as the primitives' slots
+	object_ids.clear();
+	primitive_ids.resize(bvh.primitives.size());
+	for (uint32_t i = 0; i < bvh.primitives.size(); i++)
+	{
+		object_ids[bvh.primitives[i].get()] = i;
+		primitive_ids[i] = i;
+	}
+	id_slots.assign(bvh.primitives.size(), 0);
+}
+
+void dynamic_bvh::index_tree()
+{
+	// Rebuilds the side tables that map ids to primitives, primitives to leaves and nodes to parents
+	// and levels
+	const size_t num_nodes = bvh.nodes.size();
+	parents.assign(num_nodes, 0);
+	dirty.assign(num_nodes, 0);
+	levels.clear();
+	leaf_of_primitive.assign(bvh.primitives.size(), 0);
+	partial_roots.clear();
+
+	std::vector<int> depths(num_nodes, 0);
+	for (uint32_t i = 0; i < num_nodes; i++)
+	{
+		const linear_bvh_node& node = bvh.nodes[i];
+		if (levels.size() <= static_cast<size_t>(depths[i]))
+			levels.resize(depths[i] + 1);
+		levels[depths[i]].push_back(i);
+
+		if (node.is_leaf())
+		{
+			for (uint32_t p = node.primitives_offset; p < node.primitives_offset + node.primitive_count; p++)
+				leaf_of_primitive[p] = i;
+			if (depths[i] < partial_rebuild_depth)
+				partial_roots.push_back(i);
+		}
+		else
+		{
+			parents[i + 1] = parents[node.second_child_offset] = i;
+			depths[i + 1] = depths[node.second_child_offset] = depths[i] + 1;
+			if (depths[i] == partial_rebuild_depth)
+				partial_roots.push_back(i);
+		}
+	}
+
+	partial_build_costs.resize(partial_roots.size());
+	for (size_t i = 0; i < partial_roots.size(); i++)
+	{
+		partial_build_costs[i] = subtree_cost(partial_roots[i]);
+	}
+
+	for (uint32_t i = 0; i < primitive_ids.size(); i++)
+	{
+		if (primitive_ids[i] != UINT32_MAX)
+			id_slots[primitive_ids[i]] = i;
+	}
+}
+
+float dynamic_bvh::subtree_cost(uint32_t index) const
+{
+	// Unnormalized SAH cost, comparable between calls on the same subtree
+	float cost = 0;
+	const uint32_t end = subtree_end(index);
+	for (uint32_t i = index; i < end; i++)
+	{
+		const linear_bvh_node& node = bvh.nodes[i];
+		const float node_cost = node.is_leaf() ? settings.intersection_cost * node.primitive_count : settings.traversal_cost;
+		cost += node_cost * node.box.surface_area();
+	}
+	return cost;
+}
+
+uint32_t dynamic_bvh::subtree_end(uint32_t index) const
+{
+	// Depth-first layout keeps every subtree contiguous; it ends after its rightmost leaf
+	while (!bvh.nodes[index].is_leaf())
+	{
+		index = bvh.nodes[index].second_child_offset;
+	}
+	return index + 1;
+}
+
+void dynamic_bvh::subtree_primitives(uint32_t index, uint32_t& first, uint32_t& last) const
+{
+	// From the first primitive of its leftmost leaf to the last of its rightmost
+	uint32_t leftmost = index;
+	while (!bvh.nodes[leftmost].is_leaf())
+	{
+		leftmost++;
+	}
+	const linear_bvh_node& rightmost = bvh.nodes[subtree_end(index) - 1];
+	first = bvh.nodes[leftmost].primitives_offset;
+	last = rightmost.primitives_offset + rightmost.primitive_count;
+}
+
+int dynamic_bvh::depth_of(uint32_t index) const
+{
+	int depth = 0;
+	for (; index != 0; index = parents[index])
+	{
+		depth++;
+	}
+	return depth;
+}
\ No newline at end of file
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+struct grid_build_stats
+{
+	double build_ms = 0;
+	int resolution[3] = { 0, 0, 0 };
+	size_t cell_count = 0;
+	size_t reference_count = 0;	// primitive references summed over all cells
+	size_t large_count = 0;		// primitives kept out of the grid
+};
+
+std::ostream& operator<<(std::ostream& out, const grid_build_stats& stats)
+{
+	return out << "resolution: " << stats.resolution[0] << "x" << stats.resolution[1] << "x" << stats.resolution[2]
+		<< ", references: " << stats.reference_count
+		<< ", large primitives: " << stats.large_count
+		<< ", build time: " << stats.build_ms << "ms";
+}
+
+// Uniform grid traversed with a 3D-DDA. Suits many similarly sized primitives spread evenly over
+// the scene, where it builds faster than a BVH and steps through cells in order along the ray.
+// The resolution follows primitive density. Primitives much bigger than the typical one (like a
+// ground sphere) would land in most cells, so they are kept in a separate list tested by every ray.
+class uniform_grid : public hittable
+{
+public:
+	// Cells per axis are capped at this
+	static const int max_resolution = 512;
+	// Primitives with a box diagonal above this multiple of the median one are not gridded
+	static constexpr float large_primitive_factor = 32;
+
+	uniform_grid() {}
+	// density is the target number of cells per primitive
+	uniform_grid(const hittable_list& list, float time0, float time1, float density = 4);
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	std::vector<shared_ptr<hittable>> primitives;
+	std::vector<shared_ptr<hittable>> large_primitives;
+	std::vector<uint32_t> cell_offsets;		// cell i holds cell_primitives[cell_offsets[i], cell_offsets[i + 1])
+	std::vector<uint32_t> cell_primitives;	// indices into primitives
+	aabb grid_box;
+	aabb box;
+	vec3 cell_size;
+	int resolution[3] = { 0, 0, 0 };
+	grid_build_stats build_stats;
+
+private:
+	// Recently tested primitives, hashed by index. Collisions just evict, so a primitive is at worst
+	// tested again; a hit found in one cell is kept as the closest hit until the ray reaches it.
+	struct mailbox
+	{
+		static const int size = 16;
+		uint32_t entries[size];
+
+		mailbox() { std::fill(entries, entries + size, UINT32_MAX); }
+
+		bool check_and_add(uint32_t index)
+		{
+			uint32_t& entry = entries[index & (size - 1)];
+			if (entry == index)
+				return true;
+			entry = index;
+			return false;
+		}
+	};
+
+	int cell_coordinate(float p, int axis) const
+	{
+		const int c = static_cast<int>((p - grid_box.min_point[axis]) / cell_size[axis]);
+		return std::min(std::max(c, 0), resolution[axis] - 1);
+	}
+};
+
+uniform_grid::uniform_grid(const hittable_list& list, float time0, float time1, float density)
+{
+	const auto start_time = std::chrono::high_resolution_clock::now();
+
+	const std::vector<aabb> all_boxes = gather_bounding_boxes(list.objects, time0, time1);
+	box = aabb::empty();
+	for (const aabb& b : all_boxes)
+	{
+		box = surrounding_box(box, b);
+	}
+
+	const std::vector<bool> large = find_large_primitives(all_boxes, large_primitive_factor);
+	std::vector<aabb> boxes;
+	grid_box = aabb::empty();
+	for (size_t i = 0; i < all_boxes.size(); i++)
+	{
+		if (large[i])
+		{
+			large_primitives.push_back(list.objects[i]);
+		}
+		else
+		{
+			primitives.push_back(list.objects[i]);
+			boxes.push_back(all_boxes[i]);
+			grid_box = surrounding_box(grid_box, all_boxes[i]);
+		}
+	}
+
+	if (!primitives.empty())
+	{
+		// Pad flat axes so every cell has some thickness
+		const vec3 d = grid_box.max_point - grid_box.min_point;
+		const vec3 padding(1e-4f * std::max({ d.x, d.y, d.z, 1e-3f }));
+		grid_box = aabb(grid_box.min_point - padding, grid_box.max_point + padding);
+		const vec3 extent = grid_box.max_point - grid_box.min_point;
+
+		// Aim for density cells per primitive with roughly cubic cells. Axes that would get less than
+		// one cell are fixed at one and the cell budget is spread over the rest.
+		bool fixed[3] = { false, false, false };
+		for (int pass = 0; pass < 3; pass++)
+		{
+			float free_volume = 1;
+			int num_free = 0;
+			float cells = density * primitives.size();
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (fixed[axis])
+				{
+					cells /= resolution[axis];
+				}
+				else
+				{
+					free_volume *= extent[axis];
+					num_free++;
+				}
+			}
+			if (num_free == 0)
+				break;
+
+			const float cells_per_unit = std::pow(cells / free_volume, 1.f / num_free);
+			bool changed = false;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (fixed[axis])
+					continue;
+				resolution[axis] = std::min(static_cast<int>(extent[axis] * cells_per_unit), max_resolution);
+				if (resolution[axis] < 1)
+				{
+					resolution[axis] = 1;
+					fixed[axis] = changed = true;
+				}
+			}
+			if (!changed)
+				break;
+		}
+		cell_size = vec3(extent.x / resolution[0], extent.y / resolution[1], extent.z / resolution[2]);
+
+		// Count references per cell, prefix sum, then fill in primitive order
+		const size_t num_cells = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+		cell_offsets.assign(num_cells + 1, 0);
+		const auto for_each_cell = [&](const aabb& b, auto&& f)
+		{
+			const int x0 = cell_coordinate(b.min_point.x, 0), x1 = cell_coordinate(b.max_point.x, 0);
+			const int y0 = cell_coordinate(b.min_point.y, 1), y1 = cell_coordinate(b.max_point.y, 1);
+			const int z0 = cell_coordinate(b.min_point.z, 2), z1 = cell_coordinate(b.max_point.z, 2);
+			for (int z = z0; z <= z1; z++)
+				for (int y = y0; y <= y1; y++)
+					for (int x = x0; x <= x1; x++)
+						f((static_cast<size_t>(z) * resolution[1] + y) * resolution[0] + x);
+		};
+		for (const aabb& b : boxes)
+		{
+			for_each_cell(b, [&](size_t cell) { cell_offsets[cell + 1]++; });
+		}
+		for (size_t i = 0; i < num_cells; i++)
+		{
+			cell_offsets[i + 1] += cell_offsets[i];
+		}
+		cell_primitives.resize(cell_offsets[num_cells]);
+		std::vector<uint32_t> fill(cell_offsets.begin(), cell_offsets.end() - 1);
+		for (uint32_t i = 0; i < boxes.size(); i++)
+		{
+			for_each_cell(boxes[i], [&](size_t cell) { cell_primitives[fill[cell]++] = i; });
+		}
+	}
+
+	build_stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::copy(resolution, resolution + 3, build_stats.resolution);
+	build_stats.cell_count = cell_offsets.empty() ? 0 : cell_offsets.size() - 1;
+	build_stats.reference_count = cell_primitives.size();
+	build_stats.large_count = large_primitives.size();
+}
+
+bool uniform_grid::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	bool hit_anything = false;
+	for (const auto& object : large_primitives)
+	{
+		if (object->intersect(r, t_min, t_max, hit))
+		{
+			hit_anything = true;
+			t_max = hit.t;
+		}
+	}
+
+	if (primitives.empty())
+		return hit_anything;
+
+	// Clip the ray to the grid
+	float t_enter = t_min, t_exit = t_max;
+	const vec3& inv_dir = r.inv_dir;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float t0 = (grid_box.min_point[axis] - r.origin[axis]) * inv_dir[axis];
+		const float t1 = (grid_box.max_point[axis] - r.origin[axis]) * inv_dir[axis];
+		t_enter = std::max(t_enter, std::min(t0, t1));
+		t_exit = std::min(t_exit, std::max(t0, t1));
+	}
+	if (t_enter > t_exit)
+		return hit_anything;
+
+	// Set up the DDA: next_t is where the ray crosses into the next cell along each axis
+	const point3 entry = r.at(t_enter);
+	int cell[3], step[3], out[3];
+	float next_t[3], delta_t[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		cell[axis] = cell_coordinate(entry[axis], axis);
+		if (r.dir[axis] > 0)
+		{
+			step[axis] = 1;
+			out[axis] = resolution[axis];
+			next_t[axis] = (grid_box.min_point[axis] + (cell[axis] + 1) * cell_size[axis] - r.origin[axis]) * inv_dir[axis];
+			delta_t[axis] = cell_size[axis] * inv_dir[axis];
+		}
+		else if (r.dir[axis] < 0)
+		{
+			step[axis] = -1;
+			out[axis] = -1;
+			next_t[axis] = (grid_box.min_point[axis] + cell[axis] * cell_size[axis] - r.origin[axis]) * inv_dir[axis];
+			delta_t[axis] = -cell_size[axis] * inv_dir[axis];
+		}
+		else
+		{
+			step[axis] = 0;
+			out[axis] = -1;
+			next_t[axis] = infinity;
+			delta_t[axis] = infinity;
+		}
+	}
+
+	mailbox tested;
+	while (true)
+	{
+		const size_t cell_index = (static_cast<size_t>(cell[2]) * resolution[1] + cell[1]) * resolution[0] + cell[0];
+		for (uint32_t i = cell_offsets[cell_index]; i < cell_offsets[cell_index + 1]; i++)
+		{
+			const uint32_t index = cell_primitives[i];
+			if (tested.check_and_add(index))
+				continue;
+			if (primitives[index]->intersect(r, t_min, t_max, hit))
+			{
+				hit_anything = true;
+				t_max = hit.t;
+			}
+		}
+
+		// Any hit before the ray leaves this cell is the closest; later cells are further away
+		const int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+		if (t_max <= next_t[axis])
+			break;
+		cell[axis] += step[axis];
+		if (cell[axis] == out[axis])
+			break;
+		next_t[axis] += delta_t[axis];
+	}
+
+	return hit_anything;
+}
+
+bool uniform_grid::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (primitives.empty() && large_primitives.empty())
+		return false;
+
+	output_box = box;
+	return true;
+}
\ No newline at end of file
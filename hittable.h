@@ -1,15 +1,21 @@
 #pragma once
 
 #include "aabb.h"
+#include "ray_packet.h"
 #include "rtweekend.h"
 
-class material;
+#include <cstdint>
+
+class hittable;
+
+// Index of a material in the scene's material_table
+using material_handle = uint32_t;
 
 struct hit_record
 {
 	point3 p;
 	vec3 normal;
-	shared_ptr<material> mat_ptr;
+	material_handle material_id;
 	float t, u, v;
 	bool front_face;
 
@@ -20,9 +26,103 @@ struct hit_record
 	}
 };
 
+// What traversal keeps for the closest hit so far: its distance and which primitive it is. The
+// point, normal, UVs and material are only worked out once per ray, for the final closest hit.
+struct primitive_hit
+{
+	// Instances a primitive can be nested in
+	static const int max_instance_depth = 4;
+
+	float t;
+	const hittable* object;		// primitive that was hit
+	uint32_t primitive;			// index within object, for objects holding several primitives
+	int instance_count;
+	const hittable* instances[max_instance_depth];	// innermost first
+
+	// Called by primitives when they find a closer hit; instances add themselves on the way out
+	void set(float t_, const hittable* object_, uint32_t primitive_ = 0)
+	{
+		t = t_;
+		object = object_;
+		primitive = primitive_;
+		instance_count = 0;
+	}
+
+	// Returns false, leaving the hit as it was, when it is already max_instance_depth instances deep
+	bool add_instance(const hittable* instance)
+	{
+		if (instance_count == max_instance_depth)
+			return false;
+		instances[instance_count++] = instance;
+		return true;
+	}
+
+	// Fills in rec for this hit; r is the ray in world space
+	void resolve(const ray& r, hit_record& rec) const;
+	// Just the material resolve() would give, for sorting hits before shading them
+	material_handle material() const;
+};
+
 class hittable
 {
 public:
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+	// Closest hit within [t_min, t_max], finding only its distance and primitive. Overwrites hit and
+	// returns true when there is one.
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const = 0;
+	// Surface attributes of a hit this object reported from intersect(). Objects made of other
+	// hittables never receive one, because hits name the primitive inside them.
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const {}
+	// Material of a hit this object reported from intersect(), without the rest of resolve(). It only
+	// serves to group hits before shading them, so objects that can't tell cheaply may answer 0.
+	virtual material_handle hit_material(const primitive_hit& hit) const { return 0; }
+	// Whether anything hits r within [t_min, t_max]. Shadow and visibility rays need nothing more, so
+	// overrides stop at the first hit they come across, whichever it is, and fill in no hit.
+	virtual bool occluded(const ray& r, float t_min, float t_max) const
+	{
+		primitive_hit hit;
+		return intersect(r, t_min, t_max, hit);
+	}
 	virtual bool bounding_box(float time0, float time1, aabb& output_box) const = 0;
-};
\ No newline at end of file
+	// intersect() for each ray i in active, with t_max[i] as its upper bound; t_max[i] and hits[i]
+	// are updated for the rays that hit something closer, whose bits are returned. Hierarchies
+	// override this to visit each node once for the whole packet.
+	virtual uint64_t intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const
+	{
+		uint64_t found = 0;
+		for (int i = 0; i < packet.size; i++)
+		{
+			if (((active >> i) & 1) && intersect(packet.rays[i], t_min, t_max[i], hits[i]))
+			{
+				t_max[i] = hits[i].t;
+				found |= 1ull << i;
+			}
+		}
+		return found;
+	}
+
+	// intersect() and resolve() together
+	bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const
+	{
+		primitive_hit closest;
+		if (!intersect(r, t_min, t_max, closest))
+			return false;
+
+		closest.resolve(r, rec);
+		return true;
+	}
+};
+
+void primitive_hit::resolve(const ray& r, hit_record& rec) const
+{
+	// The outermost instance takes the ray into object space and hands it inwards
+	if (instance_count > 0)
+		instances[instance_count - 1]->resolve(r, *this, rec);
+	else
+		object->resolve(r, *this, rec);
+}
+
+material_handle primitive_hit::material() const
+{
+	// Instances move primitives around but keep their materials
+	return object->hit_material(*this);
+}
\ No newline at end of file
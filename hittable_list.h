@@ -17,31 +17,53 @@ public:
 	void clear() { objects.clear(); }
 	void add(const shared_ptr<hittable>& object) { objects.push_back(object); }
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual uint64_t intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
 	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
 
 	std::vector<shared_ptr<hittable>> objects;
 };
 
-bool hittable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
+bool hittable_list::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
 {
-	hit_record temp_rec;
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
 
+	// Objects only overwrite hit when they find a closer one, so no temporary is needed
 	for (const auto& object : objects)
 	{
-		if (object->hit(r, t_min, closest_so_far, temp_rec))
+		if (object->intersect(r, t_min, closest_so_far, hit))
 		{
 			hit_anything = true;
-			closest_so_far = temp_rec.t;
-			rec = temp_rec;
+			closest_so_far = hit.t;
 		}
 	}
 
 	return hit_anything;
 }
 
+uint64_t hittable_list::intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const
+{
+	// Object by object, so the hierarchies among them see the whole packet
+	uint64_t found = 0;
+	for (const auto& object : objects)
+	{
+		found |= object->intersect_packet(packet, active, t_min, t_max, hits);
+	}
+	return found;
+}
+
+bool hittable_list::occluded(const ray& r, float t_min, float t_max) const
+{
+	for (const auto& object : objects)
+	{
+		if (object->occluded(r, t_min, t_max))
+			return true;
+	}
+	return false;
+}
+
 bool hittable_list::bounding_box(float time0, float time1, aabb& output_box) const
 {
 	if(objects.empty()) return false;
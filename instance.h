@@ -0,0 +1,83 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "rtweekend.h"
+#include "transform.h"
+
+#include <atomic>
+#include <iostream>
+
+// Places a shared bottom-level object (usually a linear_bvh over a group of primitives) in the
+// world with an affine transform. Many instances can reference the same object, so memory and build
+// time scale with the unique geometry; a top-level BVH over the instances ties the scene together.
+// Instances can be nested up to primitive_hit::max_instance_depth deep. Hits inside deeper ones
+// can't be recorded, so they are dropped, with an error the first time.
+class instance : public hittable
+{
+public:
+	instance() {}
+	instance(const shared_ptr<hittable>& object_, const transform& object_to_world_)
+		: object(object_), object_to_world(object_to_world_), world_to_object(object_to_world_.inverse())
+	{}
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	shared_ptr<hittable> object;
+	transform object_to_world;
+	transform world_to_object;
+};
+
+bool instance::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	// The transform is affine, so distances along the ray are the same in both spaces. The hit is
+	// found apart, so that hit keeps the closest one so far if this one can't be recorded.
+	primitive_hit object_hit;
+	if (!object->intersect(world_to_object.apply_ray(r), t_min, t_max, object_hit))
+		return false;
+
+	if (!object_hit.add_instance(this))
+	{
+		static std::atomic<bool> reported(false);
+		if (!reported.exchange(true))
+			std::cerr << "Instances are nested more than " << primitive_hit::max_instance_depth << " deep; hits inside the deeper ones are ignored\n";
+		return false;
+	}
+	hit = object_hit;
+	return true;
+}
+
+bool instance::occluded(const ray& r, float t_min, float t_max) const
+{
+	return object->occluded(world_to_object.apply_ray(r), t_min, t_max);
+}
+
+void instance::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	// Hand the object space ray to the next instance in, or to the primitive itself
+	int depth = 0;
+	while (hit.instances[depth] != this)
+		depth++;
+	const ray object_ray = world_to_object.apply_ray(r);
+	if (depth > 0)
+		hit.instances[depth - 1]->resolve(object_ray, hit, rec);
+	else
+		hit.object->resolve(object_ray, hit, rec);
+
+	// The object space normal already faces the ray, and transforming both keeps it that way
+	rec.p = object_to_world.apply_point(rec.p);
+	rec.normal = normalize(world_to_object.apply_transposed_vector(rec.normal));
+}
+
+bool instance::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	aabb object_box;
+	if (!object->bounding_box(time0, time1, object_box))
+		return false;
+
+	output_box = object_to_world.apply_box(object_box);
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "light_shape.h"
+#include "material.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <vector>
+
+// The emitters of a scene that can be sampled directly: the light_shapes of the world made of an
+// emissive material. Other emitters, like meshes, are still found by paths that happen to hit them.
+// Lights compare equal to the hittable they are, so primitive_hit::object can be looked up here.
+class light_list
+{
+public:
+	void gather(const hittable_list& world, const material_table& materials);
+
+	bool empty() const { return objects.empty(); }
+	size_t size() const { return objects.size(); }
+	bool contains(const hittable* object) const { return std::find(objects.begin(), objects.end(), object) != objects.end(); }
+
+	// Picks a light uniformly, and a direction from origin toward it
+	const light_shape& sample(const point3& origin, vec3& dir) const;
+	// Density with which sample() picks dir from origin. Any of the lights might have picked it, so
+	// this is the average of their densities.
+	float direction_pdf(const point3& origin, const vec3& dir) const;
+
+	std::vector<const light_shape*> objects;
+
+private:
+	// Keeps the lights alive independently of the world they were gathered from
+	std::vector<shared_ptr<hittable>> owners;
+};
+
+void light_list::gather(const hittable_list& world, const material_table& materials)
+{
+	objects.clear();
+	owners.clear();
+	for (const auto& object : world.objects)
+	{
+		const auto shape = dynamic_cast<const light_shape*>(object.get());
+		if (shape && materials[shape->light_material()].is_emissive())
+		{
+			objects.push_back(shape);
+			owners.push_back(object);
+		}
+	}
+}
+
+const light_shape& light_list::sample(const point3& origin, vec3& dir) const
+{
+	const size_t index = std::min(static_cast<size_t>(random_float() * objects.size()), objects.size() - 1);
+	dir = objects[index]->random_direction(origin);
+	return *objects[index];
+}
+
+float light_list::direction_pdf(const point3& origin, const vec3& dir) const
+{
+	float sum = 0;
+	for (const light_shape* object : objects)
+	{
+		sum += object->direction_pdf(origin, dir);
+	}
+	return objects.empty() ? 0 : sum / objects.size();
+}
+
+// Weight of a sample taken with density pdf when the same path could also have been taken by a
+// strategy with density other_pdf; the weights of the two add up to 1 for every path
+float power_heuristic(float pdf, float other_pdf)
+{
+	const float a = pdf * pdf, b = other_pdf * other_pdf;
+	return a + b > 0 ? a / (a + b) : 0;
+}
+
+// Light reaching rec directly along a direction toward one light picked at random, scattered along
+// -r by m, which gave attenuation for the hit. Whatever the world hits first along it counts if it is
+// one of the lights, not necessarily the one picked, as direction_pdf() covers all of them. Weighted
+// against m's own sampling finding the same light; the path tracer applies the other weight when a
+// scattered ray hits a light.
+color sample_direct_light(const ray& r, const hit_record& rec, const material& m, const color& attenuation,
+	const hittable& world, const material_table& materials, const light_list& lights)
+{
+	vec3 dir;
+	lights.sample(rec.p, dir);
+	const ray shadow_ray(rec.p, dir, r.time);
+	const float scattering_pdf = m.scattering_pdf(r, rec, shadow_ray);
+	if (scattering_pdf <= 0)
+		return color(0, 0, 0);
+
+	primitive_hit light_hit;
+	if (!world.intersect(shadow_ray, 0.001, infinity, light_hit) || !lights.contains(light_hit.object))
+		return color(0, 0, 0);
+
+	const float light_pdf = lights.direction_pdf(rec.p, dir);
+	if (light_pdf <= 0)
+		return color(0, 0, 0);
+
+	hit_record light_rec;
+	light_hit.resolve(shadow_ray, light_rec);
+	const color emitted = materials[light_rec.material_id].emitted(light_rec.u, light_rec.v, light_rec.p);
+	return emitted * attenuation * (scattering_pdf / light_pdf * power_heuristic(light_pdf, scattering_pdf));
+}
+
+// Weight of light found by a scattered ray that hit object, when the ray was picked with density
+// scattering_pdf (0 for mirror-like scattering, which lights are never sampled for)
+float scattered_light_weight(const ray& scattered, const hittable* object, float scattering_pdf, const light_list* lights)
+{
+	if (!lights || scattering_pdf <= 0 || !lights->contains(object))
+		return 1;
+	return power_heuristic(scattering_pdf, lights->direction_pdf(scattered.origin, scattered.dir));
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "hittable.h"
+#include "rtweekend.h"
+
+// Shape that can be sampled as a light: it is covered by a single material, picks directions from
+// origin toward random points on itself, and gives the density over solid angle with which a
+// direction is picked (0 for directions that miss it).
+class light_shape : public hittable
+{
+public:
+	virtual material_handle light_material() const = 0;
+	virtual vec3 random_direction(const point3& origin) const = 0;
+	virtual float direction_pdf(const point3& origin, const vec3& dir) const = 0;
+};
\ No newline at end of file
@@ -0,0 +1,354 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "rtweekend.h"
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+struct linear_bvh_node
+{
+	aabb box;
+	union
+	{
+		uint32_t primitives_offset;		// leaf
+		uint32_t second_child_offset;	// interior
+	};
+	uint16_t primitive_count;	// 0 for interior nodes
+	uint8_t axis;				// split axis, interior nodes only
+	uint8_t pad;
+
+	bool is_leaf() const { return primitive_count > 0; }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+static_assert(bvh_builder::max_leaf_limit <= UINT16_MAX, "leaf sizes must fit linear_bvh_node::primitive_count");
+
+// BVH flattened into a single array in depth-first order: an interior node's first child directly
+// follows it, and its second child is found through second_child_offset. Leaves refer to a
+// contiguous range of primitives, which are reordered to match.
+class linear_bvh : public hittable
+{
+public:
+	// Every leaf is at most this deep, and traversal defers at most one node per level
+	static const int max_stack_depth = bvh_max_depth;
+
+	linear_bvh() {}
+	linear_bvh(const hittable_list& list, float time0, float time1, const bvh_build_settings& settings = bvh_build_settings())
+		: linear_bvh(list.objects, time0, time1, settings)
+	{}
+	linear_bvh(const std::vector<shared_ptr<hittable>>& objects, float time0, float time1, const bvh_build_settings& settings = bvh_build_settings());
+
+	// Converts the builder's output into nodes, rebasing primitive offsets by primitive_offset
+	static void flatten(const bvh_builder& builder, uint32_t primitive_offset, std::vector<linear_bvh_node>& out);
+	// Whether nodes, read from outside, are laid out as flatten lays them out, no deeper than
+	// traversal allows, with every leaf inside the primitive_count primitives
+	static bool is_valid(const linear_bvh_node* nodes, size_t node_count, size_t primitive_count);
+	// Walks nodes with the rays in active, culling each node for the whole packet before testing its
+	// rays. Calls intersect_leaf(node, rays) with the rays that reach a leaf; it returns those it
+	// found closer hits for, having lowered their t_max, and so does this.
+	template<class F>
+	static uint64_t traverse_packet(const linear_bvh_node* nodes, const ray_packet& packet, uint64_t active, float t_min, const float* t_max,
+		const F& intersect_leaf);
+	// Walks nodes until leaf_occluded(node) finds something blocking r within [t_min, t_max]. The
+	// range never shrinks, so unlike closest-hit traversal no visit order culls more than another.
+	template<class F>
+	static bool traverse_occluded(const linear_bvh_node* nodes, const ray& r, float t_min, float t_max, const F& leaf_occluded);
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual uint64_t intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	std::vector<linear_bvh_node> nodes;
+	std::vector<shared_ptr<hittable>> primitives;
+	bvh_build_stats build_stats;
+};
+
+linear_bvh::linear_bvh(const std::vector<shared_ptr<hittable>>& objects, float time0, float time1, const bvh_build_settings& settings)
+{
+	const bvh_builder builder(gather_bounding_boxes(objects, time0, time1, settings.report), settings);
+	build_stats = builder.stats;
+	flatten(builder, 0, nodes);
+	if (settings.report)
+		settings.report->memory_bytes = nodes.size() * sizeof(linear_bvh_node);
+
+	primitives.reserve(builder.primitive_indices.size());
+	for (const uint32_t index : builder.primitive_indices)
+	{
+		primitives.push_back(objects[index]);
+	}
+}
+
+void linear_bvh::flatten(const bvh_builder& builder, uint32_t primitive_offset, std::vector<linear_bvh_node>& out)
+{
+	// The builder already emits nodes depth-first with the left child following its parent, so
+	// flattening is a straight copy
+	out.resize(builder.nodes.size());
+	for (size_t i = 0; i < builder.nodes.size(); i++)
+	{
+		const bvh_build_node& src = builder.nodes[i];
+		linear_bvh_node& dst = out[i];
+		dst.box = src.box;
+		dst.pad = 0;
+		if (src.is_leaf())
+		{
+			dst.primitives_offset = primitive_offset + src.first;
+			dst.primitive_count = static_cast<uint16_t>(src.count);
+			dst.axis = 0;
+		}
+		else
+		{
+			assert(src.left == i + 1);
+			dst.second_child_offset = src.right;
+			dst.primitive_count = 0;
+			dst.axis = static_cast<uint8_t>(src.axis);
+		}
+	}
+}
+
+bool linear_bvh::is_valid(const linear_bvh_node* nodes, size_t node_count, size_t primitive_count)
+{
+	if (node_count == 0)
+		return true;
+
+	// Walk the tree in the order flatten writes it, so every node must be the next one in the array
+	struct pending { size_t node; int depth; };
+	std::vector<pending> stack = { { 0, 0 } };
+	size_t next = 0;
+	while (!stack.empty())
+	{
+		const pending p = stack.back();
+		stack.pop_back();
+		if (p.node != next || next == node_count)
+			return false;
+		next++;
+
+		const linear_bvh_node& node = nodes[p.node];
+		if (node.is_leaf())
+		{
+			if (node.primitives_offset > primitive_count || node.primitive_count > primitive_count - node.primitives_offset)
+				return false;
+		}
+		else
+		{
+			if (node.axis > 2 || p.depth >= max_stack_depth)
+				return false;
+			stack.push_back({ node.second_child_offset, p.depth + 1 });
+			stack.push_back({ p.node + 1, p.depth + 1 });
+		}
+	}
+	return next == node_count;
+}
+
+bool linear_bvh::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	if (nodes.empty())
+		return false;
+
+	// Nodes still to visit; lives on this thread's stack so traversal needs no allocation or locking
+	uint32_t stack[max_stack_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	bool hit_anything = false;
+
+	while (true)
+	{
+		const linear_bvh_node& node = nodes[current];
+		if (node.box.hit(r, t_min, t_max))
+		{
+			if (node.is_leaf())
+			{
+				for (uint32_t i = node.primitives_offset; i < node.primitives_offset + node.primitive_count; i++)
+				{
+					if (primitives[i]->intersect(r, t_min, t_max, hit))
+					{
+						hit_anything = true;
+						t_max = hit.t;
+					}
+				}
+			}
+			else
+			{
+				// Visit the child on the ray's side of the split first and defer the other; once a
+				// closer hit is found, the deferred child's box test culls it
+				if (r.sign[node.axis])
+				{
+					stack[stack_size++] = current + 1;
+					current = node.second_child_offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.second_child_offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+
+	return hit_anything;
+}
+
+template<class F>
+bool linear_bvh::traverse_occluded(const linear_bvh_node* nodes, const ray& r, float t_min, float t_max, const F& leaf_occluded)
+{
+	uint32_t stack[max_stack_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const linear_bvh_node& node = nodes[current];
+		if (node.box.hit(r, t_min, t_max))
+		{
+			if (node.is_leaf())
+			{
+				if (leaf_occluded(node))
+					return true;
+			}
+			else
+			{
+				// Near child first all the same: occluders near the origin, like the surface the ray
+				// leaves from, tend to be found sooner
+				if (r.sign[node.axis])
+				{
+					stack[stack_size++] = current + 1;
+					current = node.second_child_offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.second_child_offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			return false;
+		current = stack[--stack_size];
+	}
+}
+
+template<class F>
+uint64_t linear_bvh::traverse_packet(const linear_bvh_node* nodes, const ray_packet& packet, uint64_t active, float t_min, const float* t_max,
+	const F& intersect_leaf)
+{
+	if (active == 0)
+		return 0;
+
+	// Deferred nodes remember which rays reached their parent
+	struct deferred_node
+	{
+		uint32_t node;
+		uint64_t rays;
+	};
+	deferred_node stack[max_stack_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	uint64_t rays = active;
+	uint64_t found = 0;
+	// Farthest distance any ray of the packet still looks to, for the packet-wide cull
+	float packet_t_max = infinity;
+
+	// Children are visited in the order that suits the first ray; the others point nearly the same way
+	int first_ray = 0;
+	while (((active >> first_ray) & 1) == 0)
+		first_ray++;
+	const int* sign = packet.rays[first_ray].sign;
+
+	while (true)
+	{
+		const linear_bvh_node& node = nodes[current];
+		rays = packet.may_hit(node.box, t_min, packet_t_max) ? packet.hit_box(node.box, rays, t_min, t_max) : 0;
+		if (rays != 0)
+		{
+			if (node.is_leaf())
+			{
+				const uint64_t leaf_found = intersect_leaf(node, rays);
+				if (leaf_found != 0)
+				{
+					found |= leaf_found;
+					packet_t_max = 0;
+					for (int i = 0; i < packet.size; i++)
+					{
+						if ((active >> i) & 1)
+							packet_t_max = max(packet_t_max, t_max[i]);
+					}
+				}
+			}
+			else
+			{
+				if (sign[node.axis])
+				{
+					stack[stack_size++] = { current + 1, rays };
+					current = node.second_child_offset;
+				}
+				else
+				{
+					stack[stack_size++] = { node.second_child_offset, rays };
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		stack_size--;
+		current = stack[stack_size].node;
+		rays = stack[stack_size].rays;
+	}
+
+	return found;
+}
+
+uint64_t linear_bvh::intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const
+{
+	if (nodes.empty())
+		return 0;
+
+	return traverse_packet(nodes.data(), packet, active, t_min, t_max, [&](const linear_bvh_node& node, uint64_t rays)
+	{
+		uint64_t found = 0;
+		for (uint32_t i = node.primitives_offset; i < node.primitives_offset + node.primitive_count; i++)
+		{
+			found |= primitives[i]->intersect_packet(packet, rays, t_min, t_max, hits);
+		}
+		return found;
+	});
+}
+
+bool linear_bvh::occluded(const ray& r, float t_min, float t_max) const
+{
+	if (nodes.empty())
+		return false;
+
+	return traverse_occluded(nodes.data(), r, t_min, t_max, [&](const linear_bvh_node& node)
+	{
+		for (uint32_t i = node.primitives_offset; i < node.primitives_offset + node.primitive_count; i++)
+		{
+			if (primitives[i]->occluded(r, t_min, t_max))
+				return true;
+		}
+		return false;
+	});
+}
+
+bool linear_bvh::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (nodes.empty())
+		return false;
+
+	output_box = nodes[0].box;
+	return true;
+}
\ No newline at end of file
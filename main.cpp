@@ -1,68 +1,42 @@
+#include "benchmark.h"
 #include "camera.h"
 #include "color.h"
+#include "compiled_scene.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
 #include "material.h"
+#include "mesh_import.h"
 #include "moving_sphere.h"
+#include "plane.h"
+#include "render.h"
 #include "rtweekend.h"
+#include "scene_snapshot.h"
 #include "sphere.h"
+#include "sphere_batch.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
 
 #include "OpenImageDenoise/oidn.hpp"
 #include "stb_image_write.h"
 
-#include <chrono>
-#include <mutex>
-#include <queue>
-#include <thread>
+#include <cstring>
+#include <fstream>
+#include <vector>
 
-color ray_world_albedo(const ray& r)
-{
-	const vec3 unit_direction = normalize(r.dir);
-	const auto t = 0.5 * (unit_direction.y + 1.0);
-	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
-}
-
-color ray_albedo(const ray& r, const hittable& world)
-{
-	hit_record rec;
-	if (world.hit(r, 0.001, infinity, rec))
-	{
-		return rec.mat_ptr->get_albedo(rec.u, rec.v, rec.p);
-	}
-
-	return ray_world_albedo(r);
-}
-
-color ray_color(const ray& r, const hittable& world, int depth)
-{
-	hit_record rec;
-
-	// if we've exceeded the ray bounce limit, no more light is gathered
-	if (depth <= 0)
-		return color(0, 0, 0);
-
-	if (world.hit(r, 0.001, infinity, rec))
-	{
-		ray scattered;
-		color attenuation;
-		if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-			return attenuation * ray_color(scattered, world, depth - 1);
-	}
-
-	return ray_world_albedo(r);
-}
-
-hittable_list random_scene()
+hittable_list random_scene(material_table& materials)
 {
 	hittable_list world;
 
 	const auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-	world.add(make_shared<sphere>(point3(0, -1000,0), 1000, make_shared<lambertian>(checker)));
+	world.add(make_shared<sphere>(point3(0, -1000,0), 1000, materials.add(make_shared<lambertian>(checker))));
 
-	const auto mat_dielectric = make_shared<dielectric>(1.5);
+	const auto mat_dielectric = materials.add(make_shared<dielectric>(1.5));
 	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, mat_dielectric));
-	const auto mat_lambertian = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+	const auto mat_lambertian = materials.add(make_shared<lambertian>(color(0.4, 0.2, 0.1)));
 	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, mat_lambertian));
-	const auto mat_metal = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+	const auto mat_metal = materials.add(make_shared<metal>(color(0.7, 0.6, 0.5), 0.0));
 	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, mat_metal));
 
 	for(int a = -11; a < 11; a++) {
@@ -75,13 +49,13 @@ hittable_list random_scene()
 					// diffuse
 					const auto albedo = color::random() * color::random();
 					const auto center2 = center + vec3(0, random_float(0,0.5), 0);
-					const auto sphere_material = make_shared<lambertian>(albedo);
+					const auto sphere_material = materials.add(make_shared<lambertian>(albedo));
 					world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
 				} else if (choose_mat < 0.95) {
 					// metal
 					const auto albedo = color::random(0.5, 1);
 					const auto fuzz = random_float(0, 0.5);
-					const auto sphere_material = make_shared<metal>(albedo, fuzz);
+					const auto sphere_material = materials.add(make_shared<metal>(albedo, fuzz));
 					world.add(make_shared<sphere>(center, 0.2, sphere_material));
 				} else {
 					// glass
@@ -94,30 +68,338 @@ hittable_list random_scene()
 	return world;
 }
 
-hittable_list two_spheres()
+hittable_list two_spheres(material_table& materials)
 {
 	hittable_list objects;
 
-	auto lambert = make_shared<lambertian>(make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9)));
+	auto lambert = materials.add(make_shared<lambertian>(make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9))));
 	objects.add(make_shared<sphere>(point3(0, -10, 0), 10, lambert));
 	objects.add(make_shared<sphere>(point3(0, 10, 0), 10, lambert));
 
 	return objects;
 }
 
-hittable_list two_perlin_spheres()
+hittable_list two_perlin_spheres(material_table& materials)
 {
 	hittable_list objects;
 
-	const auto lambert = make_shared<lambertian>(make_shared<noise_texture>());
+	const auto lambert = materials.add(make_shared<lambertian>(make_shared<noise_texture>()));
 	objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, lambert));
 	objects.add(make_shared<sphere>(point3(0, 2, 0), 2, lambert));
 
 	return objects;
 }
 
-int main()
+// A closed room lit only by a small sphere light and a disk light, for light sampling
+hittable_list light_scene(material_table& materials)
+{
+	hittable_list world;
+
+	const auto mat_walls = materials.add(make_shared<lambertian>(color(0.6, 0.6, 0.6)));
+	const auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, materials.add(make_shared<lambertian>(checker))));
+	world.add(make_shared<sphere>(point3(0, 0, 0), 40, mat_walls));
+
+	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, materials.add(make_shared<lambertian>(color(0.4, 0.2, 0.1)))));
+	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, materials.add(make_shared<metal>(color(0.7, 0.6, 0.5), 0.0))));
+	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, materials.add(make_shared<dielectric>(1.5))));
+	for (int i = 0; i < 40; i++)
+	{
+		const point3 center(random_float(-6, 6), 0.2, random_float(-4, 4));
+		if ((center - point3(0, 0.2, 0)).length() < 1.5)
+			continue;
+		world.add(make_shared<sphere>(center, 0.2, materials.add(make_shared<lambertian>(color::random() * color::random()))));
+	}
+
+	world.add(make_shared<sphere>(point3(0, 6, 0), 0.4, materials.add(make_shared<diffuse_light>(color(40, 36, 30)))));
+	world.add(make_shared<disk>(point3(-3, 5, 3), vec3(0, -1, 0), 0.8, materials.add(make_shared<diffuse_light>(color(8, 10, 14)))));
+
+	return world;
+}
+
+hittable_list instanced_scene(material_table& materials)
+{
+	hittable_list world;
+
+	const auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, materials.add(make_shared<lambertian>(checker))));
+
+	// One cluster of spheres gets a bottom-level BVH...
+	hittable_list cluster;
+	const auto mat_metal = materials.add(make_shared<metal>(color(0.7, 0.6, 0.5), 0.1));
+	cluster.add(make_shared<sphere>(point3(0, 0.5, 0), 0.5, mat_metal));
+	for (int i = 0; i < 16; i++)
+	{
+		const float angle = 2 * pi * i / 16;
+		const auto mat_lambertian = materials.add(make_shared<lambertian>(color::random() * color::random()));
+		cluster.add(make_shared<sphere>(point3(0.8 * cos(angle), 0.1, 0.8 * sin(angle)), 0.1, mat_lambertian));
+	}
+	const auto cluster_bvh = make_shared<linear_bvh>(cluster, 0.0, 1.0);
+
+	// ...which is instanced all over the ground, with a top-level BVH over the instances
+	hittable_list instances;
+	for (int a = -40; a < 40; a++) {
+		for (int b = -40; b < 40; b++) {
+			const float scale = random_float(0.3, 0.6);
+			const transform placement = transform::translate(vec3(a + 0.5 * random_float(), 0, b + 0.5 * random_float()))
+				* transform::rotate(vec3(0, 1, 0), random_float(0, 360))
+				* transform::scale(vec3(scale));
+			instances.add(make_shared<instance>(cluster_bvh, placement));
+		}
+	}
+	world.add(make_shared<linear_bvh>(instances, 0.0, 1.0));
+
+	return world;
+}
+
+hittable_list sphere_field(int count, material_table& materials)
+{
+	// Lots of small spheres scattered over a plane, for stressing acceleration structures
+	hittable_list objects;
+
+	const auto mat_lambertian = materials.add(make_shared<lambertian>(color(0.4, 0.2, 0.1)));
+	const float extent = sqrt(static_cast<float>(count));
+	for (int i = 0; i < count; i++)
+	{
+		const point3 center(random_float(-extent, extent), 0.2, random_float(-extent, extent));
+		objects.add(make_shared<sphere>(center, 0.2, mat_lambertian));
+	}
+
+	return objects;
+}
+
+// A UV sphere of segments by rings quads, each cut into two triangles along its diagonal, with
+// slivers long thin triangles lying diagonally around it, whose boxes are mostly empty space
+triangle_mesh sliver_mesh(int segments, int rings, int slivers, material_handle m)
+{
+	std::vector<point3> positions;
+	std::vector<uint32_t> indices;
+	const float radius = 5;
+	for (int j = 0; j <= rings; j++)
+	{
+		for (int i = 0; i <= segments; i++)
+		{
+			const float theta = pi * j / rings, phi = 2 * pi * (i % segments) / segments;
+			positions.push_back(radius * vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+		}
+	}
+	for (int j = 0; j < rings; j++)
+	{
+		for (int i = 0; i < segments; i++)
+		{
+			const uint32_t a = j * (segments + 1) + i, b = a + 1, c = a + segments + 1, d = c + 1;
+			indices.insert(indices.end(), { a, c, b, b, c, d });
+		}
+	}
+
+	for (int k = 0; k < slivers; k++)
+	{
+		const auto first = static_cast<uint32_t>(positions.size());
+		const point3 p(random_float(-20, 20), random_float(-1, 2), random_float(-20, 20));
+		positions.push_back(p);
+		positions.push_back(p + vec3(10, 2, 10));
+		positions.push_back(p + vec3(10.05, 2, 10.1));
+		indices.insert(indices.end(), { first, first + 1, first + 2 });
+	}
+
+	return triangle_mesh(std::move(positions), std::move(indices), m);
+}
+
+// sphere_field as one sphere_batch, plus a mesh from each file in mesh_paths
+hittable_list batched_scene(int count, const std::vector<const char*>& mesh_paths, material_table& materials, thread_pool& pool)
+{
+	hittable_list objects;
+
+	const auto batch = make_shared<sphere_batch>();
+	for (const auto& object : sphere_field(count, materials).objects)
+	{
+		const auto s = std::static_pointer_cast<sphere>(object);
+		batch->add(s->center, s->radius, s->material_id);
+	}
+	bvh_build_settings settings = sphere_batch::default_build_settings();
+	settings.pool = &pool;
+	batch->build(settings);
+	objects.add(batch);
+
+	const auto mat_metal = materials.add(make_shared<metal>(color(0.7, 0.6, 0.5), 0.1));
+	for (const char* path : mesh_paths)
+	{
+		const auto mesh = make_shared<triangle_mesh>();
+		if (!load_mesh(path, *mesh, pool))
+			continue;
+		mesh->material_id = mat_metal;
+		triangle_mesh_settings mesh_settings;
+		mesh_settings.build.pool = &pool;
+		mesh->build(mesh_settings);
+		objects.add(mesh);
+	}
+
+	return objects;
+}
+
+int main(int argc, char** argv)
 {
+	if (argc > 1 && strcmp(argv[1], "--bench-build") == 0)
+	{
+		material_table materials;
+		benchmark_bvh_build(sphere_field(500000, materials), 0.0, 1.0);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-builders") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera scene_cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.1, 10, 0.0, 0.1);
+		benchmark_bvh_builders(random_scene(materials), materials, scene_cam, 0.0, 0.1, pool);
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_bvh_builders(sphere_field(200000, materials), materials, field_cam, 0.0, 0.0, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-dynamic") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_dynamic_bvh(sphere_field(200000, materials), field_cam, pool);
+		benchmark_dynamic_bvh(sphere_field(1000000, materials), field_cam, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-motion") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.1, 10, 0.0, 1.0);
+		benchmark_motion_blur(random_scene(materials), materials, cam, 0.0, 1.0, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-grid") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera scene_cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.1, 10, 0.0, 0.1);
+		benchmark_grid(random_scene(materials), materials, scene_cam, 0.0, 0.1, pool);
+		benchmark_grid(instanced_scene(materials), materials, scene_cam, 0.0, 0.1, pool);
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_grid(sphere_field(200000, materials), materials, field_cam, 0.0, 0.0, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-memory") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_bvh_memory(sphere_field(1000000, materials), materials, field_cam, 0.0, 0.0, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-threads") == 0)
+	{
+		material_table materials;
+		const camera cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.1, 10, 0.0, 0.1);
+		benchmark_render_scaling(random_scene(materials), materials, cam, 0.0, 0.1);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-spheres") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_sphere_batch(sphere_field(200000, materials), materials, field_cam, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-packets") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera scene_cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.0, 10, 0.0, 0.1);
+		benchmark_packets(compiled_scene(random_scene(materials)), materials, scene_cam, pool);
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_packets(compiled_scene(sphere_field(200000, materials)), materials, field_cam, pool);
+		benchmark_packets(batched_scene(200000, {}, materials, pool), materials, field_cam, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-lights") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const hittable_list world = light_scene(materials);
+		scene_compile_settings compile_settings;
+		compile_settings.materials = &materials;
+		const compiled_scene scene(world, compile_settings);
+		const camera cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.0, 10, 0.0, 0.1);
+		benchmark_light_sampling(scene, materials, scene.lights, cam, pool);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench-occlusion") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera scene_cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.0, 10, 0.0, 0.1);
+		benchmark_occlusion(compiled_scene(random_scene(materials)), scene_cam, pool);
+		benchmark_occlusion(compiled_scene(instanced_scene(materials)), scene_cam, pool);
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_occlusion(compiled_scene(sphere_field(200000, materials)), field_cam, pool);
+		benchmark_occlusion(batched_scene(200000, {}, materials, pool), field_cam, pool);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench-roulette") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera scene_cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.0, 10, 0.0, 0.1);
+		benchmark_russian_roulette(compiled_scene(random_scene(materials)), materials, scene_cam, pool);
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_russian_roulette(batched_scene(200000, {}, materials, pool), materials, field_cam, pool);
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench-wavefront") == 0)
+	{
+		thread_pool pool;
+		material_table materials;
+		const camera scene_cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20, 16.0 / 9.0, 0.0, 10, 0.0, 0.1);
+		benchmark_wavefront(compiled_scene(random_scene(materials)), materials, scene_cam, pool);
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_wavefront(batched_scene(200000, {}, materials, pool), materials, field_cam, pool);
+		return 0;
+	}
+
+	if (argc > 2 && strcmp(argv[1], "--bench-snapshot") == 0)
+	{
+		// The scene is random but the same every run, so it is keyed by its parameters and mesh files
+		const int count = 1000000;
+		const std::vector<const char*> mesh_paths(argv + 3, argv + argc);
+		snapshot_key key;
+		key.add("batched_scene").add(count);
+		for (const char* path : mesh_paths)
+		{
+			const mapped_file file(path);
+			key.add(file.data, file.size);
+		}
+
+		thread_pool pool;
+		const camera field_cam(point3(0,40,120), point3(0,0,0), vec3(0,1,0), 40, 16.0 / 9.0, 0, 120);
+		benchmark_scene_snapshot(argv[2], key.value, [&](material_table& materials) { return batched_scene(count, mesh_paths, materials, pool); },
+			field_cam, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-mesh") == 0)
+	{
+		thread_pool pool;
+		triangle_mesh mesh = sliver_mesh(64, 32, 200, 0);
+		benchmark_triangle_mesh(mesh, pool);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-import") == 0)
+	{
+		for (int i = 2; i < argc; i++)
+		{
+			benchmark_mesh_import(argv[i]);
+		}
+		return 0;
+	}
+
 	// Image
 	const auto aspect_ratio = 16.0 / 9.0;
 	const int image_width = 1200;
@@ -126,27 +408,40 @@ int main()
 	const int max_depth = 50;
 
 	// World
+	material_table materials;
 	hittable_list world;
 	point3 lookfrom, lookat;
 	float vfov = 40.0;
 	float aperture = 0;
 	switch (0) {
 		case 1:
-			world = random_scene();
+			world = random_scene(materials);
 			lookfrom = point3(13,2,3);
 			lookat = point3(0,0,0);
 			vfov = 20;
 			aperture = 0.1;
 			break;
 		case 2:
-			world = two_spheres();
+			world = two_spheres(materials);
 			lookfrom = point3(13,2,3);
 			lookat = point3(0,0,0);
 			vfov = 20;
 			break;
 		default:
 		case 3:
-			world = two_perlin_spheres();
+			world = two_perlin_spheres(materials);
+			lookfrom = point3(13,2,3);
+			lookat = point3(0,0,0);
+			vfov = 20;
+			break;
+		case 4:
+			world = instanced_scene(materials);
+			lookfrom = point3(13,2,3);
+			lookat = point3(0,0,0);
+			vfov = 20;
+			break;
+		case 5:
+			world = light_scene(materials);
 			lookfrom = point3(13,2,3);
 			lookat = point3(0,0,0);
 			vfov = 20;
@@ -156,80 +451,40 @@ int main()
 	// Camera
 	const vec3 vup(0,1,0);
 	const auto dist_to_focus = 10;
-	const camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus, 0.0, 0.1);
+	const float shutter_open = 0.0;
+	const float shutter_close = 0.1;
+	const camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus, shutter_open, shutter_close);
+
+	// Compile the world into its acceleration structure
+	thread_pool pool;
+	scene_compile_settings compile_settings;
+	compile_settings.build.pool = &pool;
+	compile_settings.time0 = shutter_open;
+	compile_settings.time1 = shutter_close;
+	compile_settings.materials = &materials;
+	const compiled_scene scene(world, compile_settings);
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp(argv[i], "--bvh-report") == 0)
+		{
+			std::ofstream report_file(argv[i + 1]);
+			scene.report.write_json(report_file);
+		}
+	}
 
 	// Buffers
 	color* color_buffer = (color*)malloc(image_width * image_height * sizeof(color));
 	color* albedo_ms_buffer = (color*)malloc(image_width * image_height * sizeof(color));
 
-	// Queue of jobs (rows to do)
-	std::queue<int> remaining_rows;
-	for (int i = 0; i < image_height; i++)
-	{
-		remaining_rows.push(i);
-	}
-
-	// Task the threads will do:
-	std::mutex queue_mutex;
-	auto thread_task = [&]()
-	{
-		while (true)
-		{
-			int row_idx;
-			{
-				std::unique_lock<std::mutex> lock(queue_mutex);
-				if (remaining_rows.empty()) return;
-				row_idx = remaining_rows.front();
-				remaining_rows.pop();
-			}
-
-			for (int i = 0; i < image_width; ++i)
-			{
-				const int buffer_idx = image_width * (image_height - 1 - row_idx) + i;
-
-				color& sampled_color = color_buffer[buffer_idx];
-				color& albedo_ms = albedo_ms_buffer[buffer_idx];
-				sampled_color = albedo_ms = color();
-
-				for (int s = 0; s < samples_per_pixel; ++s)
-				{
-					const auto u = (i + random_float()) / (image_width - 1);
-					const auto v = (row_idx + random_float()) / (image_height - 1);
-					const ray r = cam.get_ray(u, v);
-
-					albedo_ms += ray_albedo(r, world);
-					sampled_color += ray_color(r, world, max_depth);
-				}
-
-				resolve_samples(sampled_color, samples_per_pixel);
-				resolve_samples(albedo_ms, samples_per_pixel);
-			}
-		}
-	};
-
-	// Spawn worker threads
-	std::vector<std::thread> threads;
-	auto num_threads = std::thread::hardware_concurrency();
-	for (auto i = num_threads -1; i > 0; i--)
-	{
-		threads.push_back(std::thread(thread_task));
-	}
-	// Print num remaining while we wait
-	while (true)
-	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
-		size_t num_remaining;
-		{
-			std::unique_lock<std::mutex> lock(queue_mutex);
-			num_remaining = remaining_rows.size();
-		}
-		if (num_remaining == 0) break;
-		std::cout << "\rScanlines remaining: " << num_remaining << ' ' << std::flush;
-	}
-	for (auto i = 0; i < threads.size(); i++)
-	{
-		threads[i].join();
-	}
+	// Render
+	render_settings settings;
+	settings.image_width = image_width;
+	settings.image_height = image_height;
+	settings.samples_per_pixel = samples_per_pixel;
+	settings.max_depth = max_depth;
+	settings.packet_size = 8;
+	settings.lights = &scene.lights;
+	render(scene, materials, cam, settings, pool, color_buffer, albedo_ms_buffer);
 
 	std::cout << "\nDone.\nDenoising... ";
 
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file mapped into memory. Pages are read in by the OS as they are first
+// touched, so threads parsing different parts of the file load them in parallel and nothing is
+// copied into a separate buffer.
+class mapped_file
+{
+public:
+	mapped_file(const char* path);
+	~mapped_file();
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool is_open() const { return data != nullptr || (opened && size == 0); }
+
+	const char* data = nullptr;
+	size_t size = 0;
+
+private:
+	bool opened = false;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const char* path)
+{
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size))
+		return;
+	opened = true;
+	size = static_cast<size_t>(file_size.QuadPart);
+	if (size == 0)
+		return;
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping)
+		data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+}
+
+mapped_file::~mapped_file()
+{
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+#else
+
+mapped_file::mapped_file(const char* path)
+{
+	const int file = open(path, O_RDONLY);
+	if (file < 0)
+		return;
+
+	struct stat info;
+	if (fstat(file, &info) == 0)
+	{
+		opened = true;
+		size = static_cast<size_t>(info.st_size);
+		if (size > 0)
+		{
+			void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (mapping != MAP_FAILED)
+			{
+				data = static_cast<const char*>(mapping);
+				madvise(mapping, size, MADV_SEQUENTIAL);
+			}
+		}
+	}
+	// The mapping stays valid after the descriptor is closed
+	close(file);
+}
+
+mapped_file::~mapped_file()
+{
+	if (data)
+		munmap(const_cast<char*>(data), size);
+}
+
+#endif
\ No newline at end of file
@@ -1,15 +1,26 @@
 #pragma once
 
+#include "hittable.h"
 #include "rtweekend.h"
 #include "texture.h"
 
-struct hit_record;
+#include <vector>
 
 class material
 {
 public:
 	virtual color get_albedo(float u, float v, const point3& p) const = 0;
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+
+	// Light the surface gives off, which is added to whatever it scatters
+	virtual bool is_emissive() const { return false; }
+	virtual color emitted(float u, float v, const point3& p) const { return color(0, 0, 0); }
+
+	// Density over solid angle with which scatter() picks the direction of scattered. Times the
+	// attenuation it gives the BSDF times the cosine term, so directions picked some other way, like
+	// toward a light, can be weighed too. 0 for materials that scatter into one direction, like
+	// mirrors and glass, which light sampling can't hit.
+	virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const { return 0; }
 };
 
 class lambertian : public material
@@ -31,6 +42,13 @@ public:
 		return true;
 	}
 
+	// Cosine weighted, as normal + random_unit_vector() is
+	virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+	{
+		const float cosine = dot(rec.normal, normalize(scattered.dir));
+		return cosine < 0 ? 0 : cosine / pi;
+	}
+
 	virtual color get_albedo(float u, float v, const point3& p) const override { return albedo->value(u, v, p); }
 
 	shared_ptr<texture> albedo;
@@ -90,4 +108,39 @@ private:
 		r0 = r0*r0;
 		return r0 + (1.0-r0)*pow(1.0-cosine, 5.0);
 	}
+};
+
+// Gives off light from both sides and scatters none
+class diffuse_light : public material
+{
+public:
+	diffuse_light(const color& c) : emit(make_shared<solid_color>(c)) {}
+	diffuse_light(const shared_ptr<texture>& a) : emit(a) {}
+
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override { return false; }
+
+	virtual bool is_emissive() const override { return true; }
+	virtual color emitted(float u, float v, const point3& p) const override { return emit->value(u, v, p); }
+
+	virtual color get_albedo(float u, float v, const point3& p) const override { return color(1,1,1); }
+
+	shared_ptr<texture> emit;
+};
+
+// Owns a scene's materials. Primitives and hit records refer to them by handle, so shading a hit
+// looks the material up by index instead of copying a shared_ptr, whose reference count every
+// render thread would otherwise be incrementing and decrementing.
+class material_table
+{
+public:
+	material_handle add(const shared_ptr<material>& m)
+	{
+		materials.push_back(m);
+		return static_cast<material_handle>(materials.size() - 1);
+	}
+
+	const material& operator[](material_handle handle) const { return *materials[handle]; }
+	size_t size() const { return materials.size(); }
+
+	std::vector<shared_ptr<material>> materials;
 };
\ No newline at end of file
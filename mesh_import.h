@@ -0,0 +1,838 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct mesh_import_stats
+{
+	size_t file_bytes = 0;
+	size_t vertex_count = 0;
+	size_t triangle_count = 0;
+	double load_ms = 0;
+	unsigned num_threads = 1;
+
+	double megabytes_per_second() const { return load_ms > 0 ? file_bytes / (1024.0 * 1024.0) / (load_ms / 1000) : 0; }
+};
+
+std::ostream& operator<<(std::ostream& out, const mesh_import_stats& stats)
+{
+	return out << "file: " << stats.file_bytes / (1024.0 * 1024.0) << "MB"
+		<< ", vertices: " << stats.vertex_count
+		<< ", triangles: " << stats.triangle_count
+		<< ", load time: " << stats.load_ms << "ms on " << stats.num_threads << (stats.num_threads == 1 ? " thread" : " threads")
+		<< " (" << stats.megabytes_per_second() << "MB/s)";
+}
+
+// Text number parsing for the OBJ reader. Each parser skips leading blanks, stops at the first
+// character that can't continue the number and never reads at or past end.
+
+const char* skip_blanks(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+bool parse_int(const char*& p, const char* end, int64_t& value)
+{
+	const bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+
+	int64_t result = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		result = result * 10 + (*p - '0');
+		p++;
+	}
+	value = negative ? -result : result;
+	return true;
+}
+
+bool parse_float(const char*& p, const char* end, float& value)
+{
+	p = skip_blanks(p, end);
+	const bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+
+	// Digits accumulate exactly in a double well past float precision, then one scaling by a power
+	// of ten places the decimal point
+	double mantissa = 0;
+	int exponent = 0;
+	bool any_digits = false;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		mantissa = mantissa * 10 + (*p - '0');
+		any_digits = true;
+		p++;
+	}
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			exponent--;
+			any_digits = true;
+			p++;
+		}
+	}
+	if (!any_digits)
+		return false;
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		int64_t written_exponent;
+		if (!parse_int(p, end, written_exponent))
+			return false;
+		exponent += static_cast<int>(std::max<int64_t>(std::min<int64_t>(written_exponent, 1000), -1000));
+	}
+
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	if (exponent < 0 && exponent >= -22)
+		mantissa /= powers_of_ten[-exponent];
+	else if (exponent > 0 && exponent <= 22)
+		mantissa *= powers_of_ten[exponent];
+	else if (exponent != 0)
+		mantissa *= std::pow(10.0, exponent);
+
+	value = static_cast<float>(negative ? -mantissa : mantissa);
+	return true;
+}
+
+// Wavefront OBJ reader. The file is split into chunks at line boundaries, and every chunk is parsed
+// twice in parallel: once to count its vertices and triangles, so each chunk knows where its output
+// starts, and once to write them straight into the mesh buffers. Polygons are triangulated as fans.
+//
+// The mesh has one index per vertex, so normals and texture coordinates are attached to positions:
+// a position's normal is the average of the normals its corners use, and a position shared between
+// corners with different texture coordinates keeps one of them. If some faces have no normals or
+// texture coordinates, the mesh gets none.
+class obj_reader
+{
+public:
+	obj_reader(const char* data_, size_t size_, thread_pool& pool_) : data(data_), size(size_), pool(pool_) {}
+
+	bool read(triangle_mesh& mesh);
+
+private:
+	struct counts
+	{
+		size_t positions = 0, normals = 0, uvs = 0, triangles = 0;
+	};
+
+	// Where each chunk's output goes, and whether it parsed cleanly
+	struct chunk
+	{
+		const char* begin;
+		const char* end;
+		counts count;
+		counts first;
+		bool valid = true;
+	};
+
+	static const uint32_t no_index = UINT32_MAX;
+
+	void count_chunk(chunk& c) const;
+	void parse_chunk(chunk& c, triangle_mesh& mesh, const counts& total);
+	bool parse_corner(const char*& p, const char* end, const counts& seen, const counts& total, uint32_t* corner) const;
+	static const char* line_type(const char* p, const char* end, int& type);
+
+	enum { line_other, line_position, line_normal, line_uv, line_face };
+
+	const char* data;
+	size_t size;
+	thread_pool& pool;
+	std::vector<uint32_t> corner_normals;	// per triangle corner, only while reading
+	std::vector<uint32_t> corner_uvs;
+	std::vector<vec3> file_normals;
+	std::vector<float> file_uvs;
+};
+
+const char* obj_reader::line_type(const char* p, const char* end, int& type)
+{
+	p = skip_blanks(p, end);
+	type = line_other;
+	if (end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		type = line_position;
+	else if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+		type = line_normal;
+	else if (end - p >= 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+		type = line_uv;
+	else if (end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		type = line_face;
+	return p + (type == line_position || type == line_face ? 1 : type == line_other ? 0 : 2);
+}
+
+void obj_reader::count_chunk(chunk& c) const
+{
+	const char* p = c.begin;
+	while (p < c.end)
+	{
+		const char* line_end = static_cast<const char*>(memchr(p, '\n', c.end - p));
+		if (!line_end)
+			line_end = c.end;
+
+		int type;
+		const char* q = line_type(p, line_end, type);
+		switch (type)
+		{
+			case line_position: c.count.positions++; break;
+			case line_normal: c.count.normals++; break;
+			case line_uv: c.count.uvs++; break;
+			case line_face:
+			{
+				size_t corners = 0;
+				while (true)
+				{
+					q = skip_blanks(q, line_end);
+					if (q == line_end)
+						break;
+					corners++;
+					while (q < line_end && *q != ' ' && *q != '\t' && *q != '\r')
+						q++;
+				}
+				if (corners >= 3)
+					c.count.triangles += corners - 2;
+				break;
+			}
+		}
+		p = line_end + 1;
+	}
+}
+
+bool obj_reader::parse_corner(const char*& p, const char* end, const counts& seen, const counts& total, uint32_t* corner) const
+{
+	// v, v/vt, v//vn or v/vt/vn; negative indices count back from the last element read so far
+	const auto resolve = [](int64_t index, size_t seen_count, size_t total_count, uint32_t& out)
+	{
+		const int64_t resolved = index > 0 ? index - 1 : static_cast<int64_t>(seen_count) + index;
+		if (index == 0 || resolved < 0 || resolved >= static_cast<int64_t>(total_count))
+			return false;
+		out = static_cast<uint32_t>(resolved);
+		return true;
+	};
+
+	int64_t index;
+	corner[1] = corner[2] = no_index;
+	if (!parse_int(p, end, index) || !resolve(index, seen.positions, total.positions, corner[0]))
+		return false;
+	if (p < end && *p == '/')
+	{
+		p++;
+		if (p < end && *p != '/')
+		{
+			if (!parse_int(p, end, index) || !resolve(index, seen.uvs, total.uvs, corner[1]))
+				return false;
+		}
+		if (p < end && *p == '/')
+		{
+			p++;
+			if (!parse_int(p, end, index) || !resolve(index, seen.normals, total.normals, corner[2]))
+				return false;
+		}
+	}
+	return true;
+}
+
+void obj_reader::parse_chunk(chunk& c, triangle_mesh& mesh, const counts& total)
+{
+	counts seen = c.first;
+	const char* p = c.begin;
+	while (p < c.end && c.valid)
+	{
+		const char* line_end = static_cast<const char*>(memchr(p, '\n', c.end - p));
+		if (!line_end)
+			line_end = c.end;
+
+		int type;
+		const char* q = line_type(p, line_end, type);
+		switch (type)
+		{
+			case line_position:
+			{
+				point3& position = mesh.positions[seen.positions++];
+				c.valid = parse_float(q, line_end, position.x) && parse_float(q, line_end, position.y) && parse_float(q, line_end, position.z);
+				break;
+			}
+			case line_normal:
+			{
+				vec3& normal = file_normals[seen.normals++];
+				c.valid = parse_float(q, line_end, normal.x) && parse_float(q, line_end, normal.y) && parse_float(q, line_end, normal.z);
+				break;
+			}
+			case line_uv:
+			{
+				float* uv = &file_uvs[2 * seen.uvs++];
+				uv[1] = 0;
+				c.valid = parse_float(q, line_end, uv[0]);
+				parse_float(q, line_end, uv[1]);
+				break;
+			}
+			case line_face:
+			{
+				uint32_t first[3], previous[3], current[3];
+				int corners = 0;
+				while (c.valid)
+				{
+					q = skip_blanks(q, line_end);
+					if (q == line_end)
+						break;
+					c.valid = parse_corner(q, line_end, seen, total, current);
+					if (corners >= 2)
+					{
+						const size_t t = seen.triangles++;
+						const uint32_t* triangle[3] = { first, previous, current };
+						for (int k = 0; k < 3; k++)
+						{
+							mesh.indices[3 * t + k] = triangle[k][0];
+							if (!corner_uvs.empty())
+								corner_uvs[3 * t + k] = triangle[k][1];
+							if (!corner_normals.empty())
+								corner_normals[3 * t + k] = triangle[k][2];
+						}
+					}
+					if (corners == 0)
+						memcpy(first, current, sizeof(current));
+					memcpy(previous, current, sizeof(current));
+					corners++;
+				}
+				break;
+			}
+		}
+		p = line_end + 1;
+	}
+}
+
+bool obj_reader::read(triangle_mesh& mesh)
+{
+	// Chunks start at the beginning of a line; a few per thread evens out their differences
+	const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(pool.num_threads() * 4, size / (1 << 16)));
+	std::vector<chunk> chunks(num_chunks);
+	for (size_t i = 0; i < num_chunks; i++)
+	{
+		const char* start = data + size * i / num_chunks;
+		if (i > 0)
+		{
+			const char* line_end = static_cast<const char*>(memchr(start, '\n', data + size - start));
+			start = line_end ? line_end + 1 : data + size;
+		}
+		chunks[i].begin = start;
+		if (i > 0)
+			chunks[i - 1].end = start;
+	}
+	chunks.back().end = data + size;
+
+	pool.parallel_for(num_chunks, 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			count_chunk(chunks[i]);
+		}
+	});
+
+	counts total;
+	for (chunk& c : chunks)
+	{
+		c.first = total;
+		total.positions += c.count.positions;
+		total.normals += c.count.normals;
+		total.uvs += c.count.uvs;
+		total.triangles += c.count.triangles;
+	}
+	if (total.positions >= UINT32_MAX || 3 * total.triangles >= UINT32_MAX)
+	{
+		std::cerr << "OBJ has too many vertices or triangles for 32-bit indices\n";
+		return false;
+	}
+
+	mesh.positions.resize(total.positions);
+	mesh.indices.resize(3 * total.triangles);
+	file_normals.resize(total.normals);
+	file_uvs.resize(2 * total.uvs);
+	if (total.normals > 0)
+		corner_normals.resize(3 * total.triangles);
+	if (total.uvs > 0)
+		corner_uvs.resize(3 * total.triangles);
+
+	pool.parallel_for(num_chunks, 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			parse_chunk(chunks[i], mesh, total);
+		}
+	});
+	for (const chunk& c : chunks)
+	{
+		if (!c.valid)
+		{
+			std::cerr << "OBJ parse error or bad index near byte " << c.begin - data << "\n";
+			return false;
+		}
+	}
+
+	// Attach normals and texture coordinates to positions; several corners can share a position,
+	// so this one pass is serial
+	mesh.normals.clear();
+	mesh.uvs.clear();
+	const bool all_normals = !corner_normals.empty() && std::find(corner_normals.begin(), corner_normals.end(), no_index) == corner_normals.end();
+	const bool all_uvs = !corner_uvs.empty() && std::find(corner_uvs.begin(), corner_uvs.end(), no_index) == corner_uvs.end();
+	if (all_normals)
+	{
+		mesh.normals.assign(mesh.positions.size(), vec3(0, 0, 0));
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+		{
+			mesh.normals[mesh.indices[i]] += file_normals[corner_normals[i]];
+		}
+		for (vec3& normal : mesh.normals)
+		{
+			if (normal.length_squared() > 0)
+				normal = normalize(normal);
+		}
+	}
+	if (all_uvs)
+	{
+		mesh.uvs.assign(2 * mesh.positions.size(), 0.f);
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+		{
+			mesh.uvs[2 * mesh.indices[i]] = file_uvs[2 * corner_uvs[i]];
+			mesh.uvs[2 * mesh.indices[i] + 1] = file_uvs[2 * corner_uvs[i] + 1];
+		}
+	}
+	return true;
+}
+
+// Binary PLY reader, little endian only. Vertices have a fixed size, so they are converted in
+// parallel ranges. Faces are too when every face is a triangle, which is checked while reading
+// them; meshes with other polygons are read again serially and triangulated as fans.
+class ply_reader
+{
+public:
+	ply_reader(const char* data_, size_t size_, thread_pool& pool_) : data(data_), size(size_), pool(pool_) {}
+
+	bool read(triangle_mesh& mesh);
+
+private:
+	enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid };
+
+	struct property
+	{
+		std::string name;
+		ply_type type = ply_type::invalid;
+		ply_type count_type = ply_type::invalid;	// lists only
+		size_t offset = 0;							// from the start of the element, scalars before any list
+	};
+
+	struct element
+	{
+		std::string name;
+		size_t count = 0;
+		std::vector<property> properties;
+		bool has_list = false;
+		size_t fixed_size = 0;	// size of an item when there are no lists
+	};
+
+	static ply_type parse_type(const std::string& name);
+	static size_t type_size(ply_type type);
+	static double read_value(const char* p, ply_type type);
+	static bool fits(const char* p, const char* end, size_t count, size_t item_size);
+	bool parse_header(size_t& body_offset);
+	bool read_faces(const element& faces, const char* begin, triangle_mesh& mesh);
+
+	const char* data;
+	size_t size;
+	thread_pool& pool;
+	std::vector<element> elements;
+};
+
+ply_reader::ply_type ply_reader::parse_type(const std::string& name)
+{
+	if (name == "char" || name == "int8") return ply_type::int8;
+	if (name == "uchar" || name == "uint8") return ply_type::uint8;
+	if (name == "short" || name == "int16") return ply_type::int16;
+	if (name == "ushort" || name == "uint16") return ply_type::uint16;
+	if (name == "int" || name == "int32") return ply_type::int32;
+	if (name == "uint" || name == "uint32") return ply_type::uint32;
+	if (name == "float" || name == "float32") return ply_type::float32;
+	if (name == "double" || name == "float64") return ply_type::float64;
+	return ply_type::invalid;
+}
+
+size_t ply_reader::type_size(ply_type type)
+{
+	const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+	return sizes[static_cast<int>(type)];
+}
+
+double ply_reader::read_value(const char* p, ply_type type)
+{
+	// The file is little endian, like every platform this builds for
+	switch (type)
+	{
+		case ply_type::int8: { int8_t v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::uint8: { uint8_t v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::int16: { int16_t v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::uint16: { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::int32: { int32_t v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::uint32: { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::float32: { float v; memcpy(&v, p, sizeof(v)); return v; }
+		case ply_type::float64: { double v; memcpy(&v, p, sizeof(v)); return v; }
+		default: return 0;
+	}
+}
+
+// Whether count items of item_size bytes lie between p and end, without forming a pointer past end
+bool ply_reader::fits(const char* p, const char* end, size_t count, size_t item_size)
+{
+	return item_size == 0 || count <= static_cast<size_t>(end - p) / item_size;
+}
+
+bool ply_reader::parse_header(size_t& body_offset)
+{
+	const char* const header_end_marker = "end_header";
+	const char* p = data;
+	const char* end = data + size;
+	bool binary_little_endian = false;
+	while (p < end)
+	{
+		const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+		if (!line_end)
+			return false;
+
+		// Split the line into words
+		std::vector<std::string> words;
+		const char* q = p;
+		while (true)
+		{
+			q = skip_blanks(q, line_end);
+			if (q == line_end)
+				break;
+			const char* word_end = q;
+			while (word_end < line_end && *word_end != ' ' && *word_end != '\t' && *word_end != '\r')
+				word_end++;
+			words.emplace_back(q, word_end);
+			q = word_end;
+		}
+		p = line_end + 1;
+
+		if (words.empty() || words[0] == "comment" || words[0] == "obj_info" || words[0] == "ply")
+			continue;
+		if (words[0] == header_end_marker)
+		{
+			body_offset = p - data;
+			return binary_little_endian;
+		}
+		if (words[0] == "format")
+		{
+			binary_little_endian = words.size() > 1 && words[1] == "binary_little_endian";
+			if (!binary_little_endian)
+				return false;
+		}
+		else if (words[0] == "element" && words.size() == 3)
+		{
+			element e;
+			e.name = words[1];
+			const char* count_end = words[2].data() + words[2].size();
+			const std::from_chars_result parsed = std::from_chars(words[2].data(), count_end, e.count);
+			if (parsed.ec != std::errc() || parsed.ptr != count_end)
+				return false;
+			elements.push_back(e);
+		}
+		else if (words[0] == "property" && !elements.empty())
+		{
+			element& e = elements.back();
+			property prop;
+			if (words.size() == 5 && words[1] == "list")
+			{
+				prop.count_type = parse_type(words[2]);
+				prop.type = parse_type(words[3]);
+				prop.name = words[4];
+				e.has_list = true;
+			}
+			else if (words.size() == 3)
+			{
+				prop.type = parse_type(words[1]);
+				prop.name = words[2];
+				prop.offset = e.fixed_size;
+				e.fixed_size += type_size(prop.type);
+			}
+			if (prop.type == ply_type::invalid || (prop.count_type == ply_type::invalid && words.size() == 5))
+				return false;
+			e.properties.push_back(prop);
+		}
+	}
+	return false;
+}
+
+bool ply_reader::read_faces(const element& faces, const char* begin, triangle_mesh& mesh)
+{
+	// Only the vertex index list matters; other face properties are stepped over
+	int list_index = -1;
+	for (size_t i = 0; i < faces.properties.size(); i++)
+	{
+		const property& prop = faces.properties[i];
+		if (prop.count_type != ply_type::invalid && (prop.name == "vertex_indices" || prop.name == "vertex_index"))
+			list_index = static_cast<int>(i);
+	}
+	if (list_index < 0)
+		return false;
+
+	// Size of one face record if every list holds three items
+	size_t triangle_stride = 0;
+	for (const property& prop : faces.properties)
+	{
+		triangle_stride += prop.count_type == ply_type::invalid ? type_size(prop.type) : type_size(prop.count_type) + 3 * type_size(prop.type);
+	}
+
+	const char* const end = data + size;
+	const uint32_t vertex_count = static_cast<uint32_t>(mesh.positions.size());
+	if (fits(begin, end, faces.count, triangle_stride))
+	{
+		mesh.indices.resize(3 * faces.count);
+		std::atomic<bool> all_triangles(true);
+		std::atomic<bool> indices_valid(true);
+		pool.parallel_for(faces.count, 1 << 16, [&](size_t first, size_t last)
+		{
+			for (size_t f = first; f < last; f++)
+			{
+				const char* p = begin + f * triangle_stride;
+				for (size_t i = 0; i < faces.properties.size(); i++)
+				{
+					const property& prop = faces.properties[i];
+					if (prop.count_type == ply_type::invalid)
+					{
+						p += type_size(prop.type);
+						continue;
+					}
+					if (read_value(p, prop.count_type) != 3)
+					{
+						all_triangles = false;
+						return;
+					}
+					p += type_size(prop.count_type);
+					for (int k = 0; k < 3; k++, p += type_size(prop.type))
+					{
+						if (static_cast<int>(i) != list_index)
+							continue;
+						const double index = read_value(p, prop.type);
+						if (index < 0 || index >= vertex_count)
+							indices_valid = false;
+						mesh.indices[3 * f + k] = static_cast<uint32_t>(index);
+					}
+				}
+			}
+		});
+		if (all_triangles)
+			return indices_valid;
+	}
+
+	// Other polygons: one pass to count triangles, one to write them
+	mesh.indices.clear();
+	for (int pass = 0; pass < 2; pass++)
+	{
+		size_t triangle_count = 0;
+		const char* p = begin;
+		for (size_t f = 0; f < faces.count; f++)
+		{
+			for (size_t i = 0; i < faces.properties.size(); i++)
+			{
+				const property& prop = faces.properties[i];
+				if (!fits(p, end, 1, type_size(prop.count_type == ply_type::invalid ? prop.type : prop.count_type)))
+					return false;
+				if (prop.count_type == ply_type::invalid)
+				{
+					p += type_size(prop.type);
+					continue;
+				}
+				const size_t count = static_cast<size_t>(read_value(p, prop.count_type));
+				p += type_size(prop.count_type);
+				if (!fits(p, end, count, type_size(prop.type)))
+					return false;
+				if (static_cast<int>(i) == list_index && count >= 3)
+				{
+					if (pass == 1)
+					{
+						const uint32_t first = static_cast<uint32_t>(read_value(p, prop.type));
+						for (size_t k = 2; k < count; k++)
+						{
+							const uint32_t corners[3] = { first,
+								static_cast<uint32_t>(read_value(p + (k - 1) * type_size(prop.type), prop.type)),
+								static_cast<uint32_t>(read_value(p + k * type_size(prop.type), prop.type)) };
+							for (int c = 0; c < 3; c++)
+							{
+								if (corners[c] >= vertex_count)
+									return false;
+								mesh.indices[3 * triangle_count + c] = corners[c];
+							}
+							triangle_count++;
+						}
+					}
+					else
+					{
+						triangle_count += count - 2;
+					}
+				}
+				p += count * type_size(prop.type);
+			}
+		}
+		if (pass == 0)
+			mesh.indices.resize(3 * triangle_count);
+	}
+	return true;
+}
+
+bool ply_reader::read(triangle_mesh& mesh)
+{
+	size_t body_offset = 0;
+	if (!parse_header(body_offset))
+	{
+		std::cerr << "PLY header is invalid or the file is not binary little endian\n";
+		return false;
+	}
+
+	const char* p = data + body_offset;
+	const char* const end = data + size;
+	bool have_vertices = false, have_faces = false;
+	for (const element& e : elements)
+	{
+		if (e.name == "vertex")
+		{
+			if (e.has_list || !fits(p, end, e.count, e.fixed_size))
+				break;
+
+			// Properties the mesh uses, or null
+			const auto find = [&](std::initializer_list<const char*> names) -> const property*
+			{
+				for (const property& prop : e.properties)
+				{
+					for (const char* name : names)
+					{
+						if (prop.name == name)
+							return &prop;
+					}
+				}
+				return nullptr;
+			};
+			const property* position[3] = { find({ "x" }), find({ "y" }), find({ "z" }) };
+			const property* normal[3] = { find({ "nx" }), find({ "ny" }), find({ "nz" }) };
+			const property* uv[2] = { find({ "u", "s", "texture_u", "texture_s" }), find({ "v", "t", "texture_v", "texture_t" }) };
+			if (!position[0] || !position[1] || !position[2] || e.count >= UINT32_MAX)
+				break;
+			const bool has_normals = normal[0] && normal[1] && normal[2];
+			const bool has_uvs = uv[0] && uv[1];
+
+			mesh.positions.resize(e.count);
+			mesh.normals.resize(has_normals ? e.count : 0);
+			mesh.uvs.resize(has_uvs ? 2 * e.count : 0);
+			const char* const vertices = p;
+			pool.parallel_for(e.count, 1 << 16, [&](size_t first, size_t last)
+			{
+				for (size_t v = first; v < last; v++)
+				{
+					const char* item = vertices + v * e.fixed_size;
+					for (int axis = 0; axis < 3; axis++)
+					{
+						mesh.positions[v][axis] = static_cast<float>(read_value(item + position[axis]->offset, position[axis]->type));
+						if (has_normals)
+							mesh.normals[v][axis] = static_cast<float>(read_value(item + normal[axis]->offset, normal[axis]->type));
+					}
+					if (has_uvs)
+					{
+						mesh.uvs[2 * v] = static_cast<float>(read_value(item + uv[0]->offset, uv[0]->type));
+						mesh.uvs[2 * v + 1] = static_cast<float>(read_value(item + uv[1]->offset, uv[1]->type));
+					}
+				}
+			});
+			p += e.count * e.fixed_size;
+			have_vertices = true;
+		}
+		else if (e.name == "face" && have_vertices)
+		{
+			have_faces = read_faces(e, p, mesh);
+			break;
+		}
+		else if (!e.has_list && fits(p, end, e.count, e.fixed_size))
+		{
+			p += e.count * e.fixed_size;
+		}
+		else
+		{
+			// Elements with lists can only be stepped over one item at a time, and are never needed
+			break;
+		}
+	}
+
+	if (!have_vertices || !have_faces)
+	{
+		std::cerr << "PLY has no readable vertex and face elements, or a face refers to a missing vertex\n";
+		return false;
+	}
+	return true;
+}
+
+// Loads an OBJ or binary PLY file, chosen by extension, into the buffers of mesh, replacing what was
+// there. The mesh still needs build() before it can be rendered.
+bool load_mesh(const char* path, triangle_mesh& mesh, thread_pool& pool, mesh_import_stats* stats = nullptr)
+{
+	const auto start_time = std::chrono::high_resolution_clock::now();
+
+	const mapped_file file(path);
+	if (!file.is_open())
+	{
+		std::cerr << "Can't open " << path << "\n";
+		return false;
+	}
+
+	std::string extension = path;
+	extension = extension.substr(std::min(extension.size(), extension.rfind('.') + 1));
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.uvs.clear();
+	mesh.indices.clear();
+	mesh.arrays = triangle_mesh_arrays();
+	bool loaded = false;
+	if (extension == "obj")
+	{
+		obj_reader reader(file.data, file.size, pool);
+		loaded = reader.read(mesh);
+	}
+	else if (extension == "ply")
+	{
+		ply_reader reader(file.data, file.size, pool);
+		loaded = reader.read(mesh);
+	}
+	else
+	{
+		std::cerr << "Unknown mesh format: " << path << "\n";
+	}
+
+	if (stats)
+	{
+		stats->file_bytes = file.size;
+		stats->vertex_count = mesh.positions.size();
+		stats->triangle_count = mesh.indices.size() / 3;
+		stats->num_threads = pool.num_threads();
+		stats->load_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	}
+	return loaded;
+}
\ No newline at end of file
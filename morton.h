@@ -0,0 +1,109 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct morton_primitive
+{
+	uint64_t code;
+	uint32_t index;
+};
+
+// Spreads the low 10 bits of x out so that there are two zero bits between each
+inline uint64_t left_shift3_10(uint64_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+// Spreads the low 21 bits of x out so that there are two zero bits between each
+inline uint64_t left_shift3_21(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x1f00000000ffffull;
+	x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+	x = (x | (x << 8)) & 0x100f00f00f00f00full;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+// Interleaves the bits of three coordinates, already quantized to bits_per_axis (10 or 21) bits,
+// into a 30 or 63 bit Morton code with x in the most significant position
+inline uint64_t encode_morton3(uint32_t x, uint32_t y, uint32_t z, int bits_per_axis)
+{
+	if (bits_per_axis <= 10)
+		return (left_shift3_10(x) << 2) | (left_shift3_10(y) << 1) | left_shift3_10(z);
+	return (left_shift3_21(x) << 2) | (left_shift3_21(y) << 1) | left_shift3_21(z);
+}
+
+// Stable least-significant-digit radix sort on the low num_bits bits of the codes. Each pass
+// histograms fixed-size chunks in parallel, then scatters every chunk to its own offsets.
+void radix_sort(std::vector<morton_primitive>& primitives, int num_bits, thread_pool* pool)
+{
+	const int bits_per_pass = 8;
+	const int num_buckets = 1 << bits_per_pass;
+	const size_t chunk_size = 1 << 14;
+	const size_t count = primitives.size();
+	const size_t num_chunks = (count + chunk_size - 1) / chunk_size;
+
+	const auto for_each_chunk = [&](const std::function<void(size_t)>& task)
+	{
+		if (pool && num_chunks > 1)
+		{
+			pool->parallel_for(num_chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++) task(chunk);
+			});
+		}
+		else
+		{
+			for (size_t chunk = 0; chunk < num_chunks; chunk++) task(chunk);
+		}
+	};
+
+	std::vector<morton_primitive> temp(count);
+	std::vector<size_t> offsets(num_chunks * num_buckets);
+	for (int shift = 0; shift < num_bits; shift += bits_per_pass)
+	{
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for_each_chunk([&](size_t chunk)
+		{
+			size_t* histogram = &offsets[chunk * num_buckets];
+			for (size_t i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, count); i++)
+			{
+				histogram[(primitives[i].code >> shift) & (num_buckets - 1)]++;
+			}
+		});
+
+		// Exclusive prefix sum ordered by bucket, then by chunk, so the sort stays stable
+		size_t total = 0;
+		for (int bucket = 0; bucket < num_buckets; bucket++)
+		{
+			for (size_t chunk = 0; chunk < num_chunks; chunk++)
+			{
+				const size_t n = offsets[chunk * num_buckets + bucket];
+				offsets[chunk * num_buckets + bucket] = total;
+				total += n;
+			}
+		}
+
+		for_each_chunk([&](size_t chunk)
+		{
+			size_t* chunk_offsets = &offsets[chunk * num_buckets];
+			for (size_t i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, count); i++)
+			{
+				temp[chunk_offsets[(primitives[i].code >> shift) & (num_buckets - 1)]++] = primitives[i];
+			}
+		});
+		primitives.swap(temp);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+// BVH for motion-blurred scenes. A moving object's box over the whole shutter covers its entire
+// path, so rays test it whatever their time. Here the shutter is split into equal time segments,
+// each with its own tree built over the objects' bounds within that segment, and a ray only
+// traverses the segment containing ray::time. Static objects are in every segment's tree, so each
+// ray still walks a single tree.
+// Rays are expected to have times within [time0, time1]; others use the nearest segment.
+// A report describes all segments together: sizes and memory add up, and the SAH cost, depth and
+// motion figures are averaged, as a ray with a uniformly random time walks one segment's tree.
+class motion_bvh : public hittable
+{
+public:
+	motion_bvh() {}
+	// With max_segments == 0 the segment count is picked from how far objects move relative to their size
+	motion_bvh(const hittable_list& list, float time0_, float time1_, const bvh_build_settings& settings = bvh_build_settings(), int max_segments = 0);
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	int segment_count() const { return static_cast<int>(segments.size()); }
+	// The segment whose tree covers time; segments must not be empty
+	const linear_bvh& segment_at(float time) const;
+
+	// Upper bound on the automatically chosen segment count
+	static const int max_auto_segments = 16;
+
+	std::vector<linear_bvh> segments;
+	float time0 = 0, time1 = 0;
+	aabb box;
+
+private:
+	static void combine_reports(const std::vector<bvh_report>& segment_reports, bvh_report& report);
+};
+
+motion_bvh::motion_bvh(const hittable_list& list, float time0_, float time1_, const bvh_build_settings& settings, int max_segments)
+	: time0(time0_), time1(time1_)
+{
+	size_t num_moving = 0;
+	float total_motion = 0;
+	float total_size = 0;
+
+	box = aabb::empty();
+	for (const auto& object : list.objects)
+	{
+		aabb shutter_box, start_box, end_box;
+		object->bounding_box(time0, time1, shutter_box);
+		object->bounding_box(time0, time0, start_box);
+		object->bounding_box(time1, time1, end_box);
+		box = surrounding_box(box, shutter_box);
+
+		const vec3 growth = (start_box.min_point - shutter_box.min_point) + (shutter_box.max_point - start_box.max_point);
+		if (growth.x != 0 || growth.y != 0 || growth.z != 0)
+		{
+			num_moving++;
+			total_motion += (end_box.center() - start_box.center()).length();
+			total_size += (start_box.max_point - start_box.min_point).length();
+		}
+	}
+
+	if (list.objects.empty())
+		return;
+
+	// Enough segments that a typical object moves about a quarter of its size within one
+	int num_segments = max_segments;
+	if (num_segments <= 0)
+	{
+		const float motion_per_size = total_size > 0 ? total_motion / total_size : 1.f;
+		num_segments = std::min(std::max(static_cast<int>(std::ceil(4 * motion_per_size)), 1), max_auto_segments);
+	}
+	if (num_moving == 0 || time1 <= time0)
+		num_segments = 1;
+
+	// Each segment reports into its own, so the caller's report ends up covering all of them
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	std::vector<bvh_report> segment_reports(settings.report ? num_segments : 0);
+	segments.resize(num_segments);
+	for (int s = 0; s < num_segments; s++)
+	{
+		const float segment_time0 = time0 + (time1 - time0) * s / num_segments;
+		const float segment_time1 = time0 + (time1 - time0) * (s + 1) / num_segments;
+		bvh_build_settings segment_settings = settings;
+		segment_settings.report = settings.report ? &segment_reports[s] : nullptr;
+		segments[s] = linear_bvh(list.objects, segment_time0, segment_time1, segment_settings);
+	}
+
+	if (settings.report)
+	{
+		combine_reports(segment_reports, *settings.report);
+		settings.report->build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	}
+}
+
+void motion_bvh::combine_reports(const std::vector<bvh_report>& segment_reports, bvh_report& report)
+{
+	report = bvh_report();
+	report.max_leaf_size = segment_reports.front().max_leaf_size;
+	report.num_threads = segment_reports.front().num_threads;
+	report.primitive_count = segment_reports.front().primitive_count;
+	report.leaf_sizes.assign(1, 0);
+
+	double total_leaf_depth = 0, total_sah_cost = 0, total_overlap = 0, total_expansion = 0;
+	for (const bvh_report& segment : segment_reports)
+	{
+		report.node_count += segment.node_count;
+		report.leaf_count += segment.leaf_count;
+		report.memory_bytes += segment.memory_bytes;
+		report.max_depth = std::max(report.max_depth, segment.max_depth);
+		report.largest_leaf = std::max(report.largest_leaf, segment.largest_leaf);
+		report.moving_count = std::max(report.moving_count, segment.moving_count);
+		if (report.leaf_sizes.size() < segment.leaf_sizes.size())
+			report.leaf_sizes.resize(segment.leaf_sizes.size(), 0);
+		for (size_t size = 0; size < segment.leaf_sizes.size(); size++)
+		{
+			report.leaf_sizes[size] += segment.leaf_sizes[size];
+		}
+
+		total_leaf_depth += static_cast<double>(segment.average_depth) * segment.leaf_count;
+		total_sah_cost += segment.sah_cost;
+		total_overlap += segment.sibling_overlap;
+		total_expansion += segment.motion_expansion;
+	}
+
+	const auto num_segments = static_cast<double>(segment_reports.size());
+	report.average_depth = report.leaf_count > 0 ? static_cast<float>(total_leaf_depth / report.leaf_count) : 0.f;
+	report.sah_cost = static_cast<float>(total_sah_cost / num_segments);
+	report.sibling_overlap = static_cast<float>(total_overlap / num_segments);
+	report.motion_expansion = static_cast<float>(total_expansion / num_segments);
+}
+
+const linear_bvh& motion_bvh::segment_at(float time) const
+{
+	const int num_segments = segment_count();
+	const float segment_time = time1 > time0 ? (time - time0) / (time1 - time0) * num_segments : 0.f;
+	const int s = std::min(std::max(static_cast<int>(segment_time), 0), num_segments - 1);
+	return segments[s];
+}
+
+bool motion_bvh::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	if (segments.empty())
+		return false;
+
+	return segment_at(r.time).intersect(r, t_min, t_max, hit);
+}
+
+bool motion_bvh::occluded(const ray& r, float t_min, float t_max) const
+{
+	if (segments.empty())
+		return false;
+
+	return segment_at(r.time).occluded(r, t_min, t_max);
+}
+
+bool motion_bvh::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (segments.empty())
+		return false;
+
+	output_box = box;
+	return true;
+}
\ No newline at end of file
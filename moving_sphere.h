@@ -3,17 +3,21 @@
 #include "aabb.h"
 #include "rtweekend.h"
 #include "hittable.h"
+#include "sphere.h"
 
 class moving_sphere : public hittable
 {
 public:
 	moving_sphere() {}
 	moving_sphere(
-		point3 cen0, point3 cen1, float time0_, float time1_, float r, shared_ptr<material> m)
-		: center0(cen0), center1(cen1), time0(time0_), time1(time1_), radius(r), mat_ptr(m)
+		point3 cen0, point3 cen1, float time0_, float time1_, float r, material_handle m)
+		: center0(cen0), center1(cen1), time0(time0_), time1(time1_), radius(r), material_id(m)
 	{}
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual material_handle hit_material(const primitive_hit& hit) const override { return material_id; }
 	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
 
 	point3 get_center(double time) const;
@@ -21,7 +25,7 @@ public:
 	point3 center0, center1;
 	float time0, time1;
 	float radius;
-	shared_ptr<material> mat_ptr;
+	material_handle material_id;
 };
 
 point3 moving_sphere::get_center(double time) const
@@ -29,35 +33,30 @@ point3 moving_sphere::get_center(double time) const
 	return center0 + ((time - time0) / (time1-time0))*(center1-center0);
 }
 
-bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
+bool moving_sphere::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
 {
-	const point3 center = get_center(r.time);
-	const vec3 oc = r.origin - center;
-	const auto a = r.dir.length_squared();
-	const auto half_b = dot(oc, r.dir);
-	const auto c = oc.length_squared() - radius * radius;
+	float root;
+	if (!sphere_root_in_range(r, get_center(r.time), radius, t_min, t_max, root))
+		return false;
 
-	const auto discriminant = half_b * half_b - a * c;
-	if (discriminant < 0) return false;
-	const auto sqrtd = sqrt(discriminant);
+	hit.set(root, this);
+	return true;
+}
 
-	// Find the nearest root that lies in the acceptable range
-	auto root = (-half_b - sqrtd) / a;
-	if (root < t_min || t_max < root)
-	{
-		root = (-half_b + sqrtd) / a;
-		if (root < t_min || t_max < root)
-		{
-			return false;
-		}
-	}
+bool moving_sphere::occluded(const ray& r, float t_min, float t_max) const
+{
+	float root;
+	return sphere_root_in_range(r, get_center(r.time), radius, t_min, t_max, root);
+}
 
-	rec.t = root;
+void moving_sphere::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	const point3 center = get_center(r.time);
+	rec.t = hit.t;
 	rec.p = r.at(rec.t);
 	const vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
-	return true;
+	rec.material_id = material_id;
 }
 
 bool moving_sphere::bounding_box(float in_time0, float in_time1, aabb& output_box) const
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "light_shape.h"
+#include "rtweekend.h"
+
+// Infinite plane through point with the given normal. It has no bounding box, so acceleration
+// structures leave it out and compiled_scene tests it against every ray, at the cost of a dot
+// product and a division.
+class plane : public hittable
+{
+public:
+	plane() {}
+	plane(const point3& point_, const vec3& normal_, material_handle m)
+		: point(point_), normal(normalize(normal_)), material_id(m)
+	{
+		plane_basis(normal, tangent, bitangent);
+	}
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual material_handle hit_material(const primitive_hit& hit) const override { return material_id; }
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override { return false; }
+
+	point3 point;
+	vec3 normal;
+	vec3 tangent, bitangent;
+	material_handle material_id;
+};
+
+bool plane::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	const float denom = dot(normal, r.dir);
+	if (denom == 0)
+		return false;
+
+	const float t = dot(point - r.origin, normal) / denom;
+	if (t < t_min || t > t_max)
+		return false;
+
+	hit.set(t, this);
+	return true;
+}
+
+void plane::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	rec.t = hit.t;
+	rec.p = r.at(rec.t);
+	rec.set_face_normal(r, normal);
+	// Planar coordinates; they repeat textures once per unit
+	const vec3 offset = rec.p - point;
+	rec.u = dot(offset, tangent) - floor(dot(offset, tangent));
+	rec.v = dot(offset, bitangent) - floor(dot(offset, bitangent));
+	rec.material_id = material_id;
+}
+
+// Disk of the given radius around center, facing along normal. Unlike the plane it is bounded and
+// its box is tight: along each axis it extends radius * sqrt(1 - normal[axis]^2) from the center.
+class disk : public light_shape
+{
+public:
+	disk() {}
+	disk(const point3& center_, const vec3& normal_, float radius_, material_handle m)
+		: center(center_), normal(normalize(normal_)), radius(radius_), material_id(m)
+	{
+		plane_basis(normal, tangent, bitangent);
+	}
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual material_handle hit_material(const primitive_hit& hit) const override { return material_id; }
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	virtual material_handle light_material() const override { return material_id; }
+	virtual vec3 random_direction(const point3& origin) const override;
+	virtual float direction_pdf(const point3& origin, const vec3& dir) const override;
+
+	point3 center;
+	vec3 normal;
+	float radius;
+	vec3 tangent, bitangent;
+	material_handle material_id;
+};
+
+bool disk::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	const float denom = dot(normal, r.dir);
+	if (denom == 0)
+		return false;
+
+	const float t = dot(center - r.origin, normal) / denom;
+	if (t < t_min || t > t_max)
+		return false;
+
+	const vec3 offset = r.at(t) - center;
+	if (offset.length_squared() > radius * radius)
+		return false;
+
+	hit.set(t, this);
+	return true;
+}
+
+void disk::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	rec.t = hit.t;
+	rec.p = r.at(rec.t);
+	const vec3 offset = rec.p - center;
+	rec.set_face_normal(r, normal);
+	// Map the disk onto [0,1]^2
+	rec.u = 0.5f * (dot(offset, tangent) / radius + 1);
+	rec.v = 0.5f * (dot(offset, bitangent) / radius + 1);
+	rec.material_id = material_id;
+}
+
+bool disk::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	const vec3 extent(radius * sqrt(max(0.f, 1 - normal.x * normal.x)),
+					  radius * sqrt(max(0.f, 1 - normal.y * normal.y)),
+					  radius * sqrt(max(0.f, 1 - normal.z * normal.z)));
+	output_box = aabb(center - extent, center + extent);
+	return true;
+}
+
+// Points are picked uniformly over the disk's area
+vec3 disk::random_direction(const point3& origin) const
+{
+	const float r = radius * sqrt(random_float());
+	const float phi = 2 * pi * random_float();
+	return center + (r * cos(phi)) * tangent + (r * sin(phi)) * bitangent - origin;
+}
+
+float disk::direction_pdf(const point3& origin, const vec3& dir) const
+{
+	primitive_hit hit;
+	if (!intersect(ray(origin, dir), 0.001, infinity, hit))
+		return 0;
+
+	// Density over area, 1 / area, turned into one over solid angle
+	const float distance_squared = hit.t * hit.t * dir.length_squared();
+	const float cosine = fabs(dot(normalize(dir), normal));
+	if (cosine <= 0)
+		return 0;
+	return distance_squared / (cosine * pi * radius * radius);
+}
\ No newline at end of file
@@ -8,7 +8,13 @@ public:
 	ray() {}
 	ray(const point3& origin_, const vec3& dir_, float time_ = 0.0)
 		: origin(origin_), dir(dir_), time(time_)
-	{}
+	{
+		// Computed once here so box tests during traversal only multiply
+		inv_dir = vec3(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+		sign[0] = inv_dir.x < 0;
+		sign[1] = inv_dir.y < 0;
+		sign[2] = inv_dir.z < 0;
+	}
 
 	point3 at(float t) const
 	{
@@ -18,4 +24,6 @@ public:
 	point3 origin;
 	vec3 dir;
 	float time;
+	vec3 inv_dir;
+	int sign[3];	// 1 where the direction is negative
 };
\ No newline at end of file
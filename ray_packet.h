@@ -0,0 +1,173 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "simd.h"
+
+#include <cmath>
+#include <cstdint>
+
+// Up to 64 rays traced through a hierarchy together. Primary rays through a tile of neighbouring
+// pixels leave the same camera in nearly the same direction, so they visit nearly the same nodes.
+// A node is first tested once for the whole packet with interval arithmetic over the bounds of its
+// origins and directions; only when that can't rule it out are the rays themselves tested, several
+// per SIMD instruction. Sets of rays are bit masks, bit i standing for rays[i].
+struct ray_packet
+{
+	static const int max_size = 64;
+
+	void clear() { size = 0; }
+	void add(const ray& r);
+	// Bounds the packet's origins and directions; must be called after the last add()
+	void finish();
+
+	uint64_t all() const { return size == max_size ? ~0ull : (1ull << size) - 1; }
+
+	// Whether any ray could hit box within [t_min, t_max], from the packet bounds alone. May answer
+	// true when no ray does, but never false when one does.
+	bool may_hit(const aabb& box, float t_min, float t_max) const;
+	// The rays in active that hit box within [t_min, t_max[i]], each tested exactly as aabb::hit does.
+	// t_max has max_size entries.
+	uint64_t hit_box(const aabb& box, uint64_t active, float t_min, const float* t_max) const;
+
+	int size = 0;
+	ray rays[max_size];
+	// The same rays as structure-of-arrays for hit_box
+	alignas(32) float origin_x[max_size], origin_y[max_size], origin_z[max_size];
+	alignas(32) float inv_dir_x[max_size], inv_dir_y[max_size], inv_dir_z[max_size];
+	point3 min_origin, max_origin;
+	vec3 min_inv_dir, max_inv_dir;
+};
+
+void ray_packet::add(const ray& r)
+{
+	rays[size] = r;
+	origin_x[size] = r.origin.x;
+	origin_y[size] = r.origin.y;
+	origin_z[size] = r.origin.z;
+	inv_dir_x[size] = r.inv_dir.x;
+	inv_dir_y[size] = r.inv_dir.y;
+	inv_dir_z[size] = r.inv_dir.z;
+	size++;
+}
+
+void ray_packet::finish()
+{
+	min_origin = max_origin = rays[0].origin;
+	min_inv_dir = max_inv_dir = rays[0].inv_dir;
+	for (int i = 1; i < size; i++)
+	{
+		min_origin = min(min_origin, rays[i].origin);
+		max_origin = max(max_origin, rays[i].origin);
+		min_inv_dir = min(min_inv_dir, rays[i].inv_dir);
+		max_inv_dir = max(max_inv_dir, rays[i].inv_dir);
+	}
+
+	// Unused lanes are tested along with the rest but never reported
+	for (int i = size; i < max_size; i++)
+	{
+		origin_x[i] = origin_y[i] = origin_z[i] = 0;
+		inv_dir_x[i] = inv_dir_y[i] = inv_dir_z[i] = 1;
+	}
+}
+
+bool ray_packet::may_hit(const aabb& box, float t_min, float t_max) const
+{
+	// Every ray's distance to a slab plane, (plane - origin) * inv_dir, lies within the product of
+	// the intervals of its two factors, so every ray enters the box no earlier than entry and
+	// leaves it no later than exit. Float rounding is monotonic, which keeps the bounds safe.
+	float entry = t_min, exit = t_max;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float inv_lo = min_inv_dir[axis], inv_hi = max_inv_dir[axis];
+		// Rays parallel to the slab have infinite inverses; leave the axis unbounded
+		if (!std::isfinite(inv_lo) || !std::isfinite(inv_hi))
+			continue;
+
+		float plane_lo[2], plane_hi[2];
+		for (int side = 0; side < 2; side++)
+		{
+			const float plane = side == 0 ? box.min_point[axis] : box.max_point[axis];
+			const float offset_lo = plane - max_origin[axis], offset_hi = plane - min_origin[axis];
+			const float products[4] = { offset_lo * inv_lo, offset_lo * inv_hi, offset_hi * inv_lo, offset_hi * inv_hi };
+			plane_lo[side] = min(min(products[0], products[1]), min(products[2], products[3]));
+			plane_hi[side] = max(max(products[0], products[1]), max(products[2], products[3]));
+		}
+		entry = max(entry, min(plane_lo[0], plane_lo[1]));
+		exit = min(exit, max(plane_hi[0], plane_hi[1]));
+	}
+	return entry <= exit;
+}
+
+uint64_t ray_packet::hit_box(const aabb& box, uint64_t active, float t_min, const float* t_max) const
+{
+	uint64_t hits = 0;
+
+#if RT_AVX
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 min_x = _mm256_set1_ps(box.min_point.x), min_y = _mm256_set1_ps(box.min_point.y), min_z = _mm256_set1_ps(box.min_point.z);
+	const __m256 max_x = _mm256_set1_ps(box.max_point.x), max_y = _mm256_set1_ps(box.max_point.y), max_z = _mm256_set1_ps(box.max_point.z);
+	const __m256 vt_min = _mm256_set1_ps(t_min);
+	for (int i = 0; i < size; i += 8)
+	{
+		if (((active >> i) & 0xff) == 0)
+			continue;
+
+		// The direction's sign picks the near plane on each axis, as in aabb::hit, and min/max
+		// treat NaN the same way too
+		const auto slab = [&](const float* origin, const float* inv_dir, __m256 lo, __m256 hi, __m256& near_t, __m256& far_t)
+		{
+			const __m256 o = _mm256_load_ps(origin + i), inv = _mm256_load_ps(inv_dir + i);
+			const __m256 negative = _mm256_cmp_ps(inv, zero, _CMP_LT_OQ);
+			const __m256 t_lo = _mm256_mul_ps(_mm256_sub_ps(lo, o), inv), t_hi = _mm256_mul_ps(_mm256_sub_ps(hi, o), inv);
+			near_t = _mm256_blendv_ps(t_lo, t_hi, negative);
+			far_t = _mm256_blendv_ps(t_hi, t_lo, negative);
+		};
+		__m256 near_x, far_x, near_y, far_y, near_z, far_z;
+		slab(origin_x, inv_dir_x, min_x, max_x, near_x, far_x);
+		slab(origin_y, inv_dir_y, min_y, max_y, near_y, far_y);
+		slab(origin_z, inv_dir_z, min_z, max_z, near_z, far_z);
+
+		const __m256 entry = _mm256_max_ps(_mm256_max_ps(near_x, near_y), _mm256_max_ps(near_z, vt_min));
+		const __m256 exit = _mm256_min_ps(_mm256_min_ps(far_x, far_y), _mm256_min_ps(far_z, _mm256_loadu_ps(t_max + i)));
+		hits |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ))) << i;
+	}
+#elif RT_SSE
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 min_x = _mm_set1_ps(box.min_point.x), min_y = _mm_set1_ps(box.min_point.y), min_z = _mm_set1_ps(box.min_point.z);
+	const __m128 max_x = _mm_set1_ps(box.max_point.x), max_y = _mm_set1_ps(box.max_point.y), max_z = _mm_set1_ps(box.max_point.z);
+	const __m128 vt_min = _mm_set1_ps(t_min);
+	for (int i = 0; i < size; i += 4)
+	{
+		if (((active >> i) & 0xf) == 0)
+			continue;
+
+		// SSE2 has no blend, so select with and/andnot
+		const auto slab = [&](const float* origin, const float* inv_dir, __m128 lo, __m128 hi, __m128& near_t, __m128& far_t)
+		{
+			const __m128 o = _mm_load_ps(origin + i), inv = _mm_load_ps(inv_dir + i);
+			const __m128 negative = _mm_cmplt_ps(inv, zero);
+			const __m128 t_lo = _mm_mul_ps(_mm_sub_ps(lo, o), inv), t_hi = _mm_mul_ps(_mm_sub_ps(hi, o), inv);
+			near_t = _mm_or_ps(_mm_and_ps(negative, t_hi), _mm_andnot_ps(negative, t_lo));
+			far_t = _mm_or_ps(_mm_and_ps(negative, t_lo), _mm_andnot_ps(negative, t_hi));
+		};
+		__m128 near_x, far_x, near_y, far_y, near_z, far_z;
+		slab(origin_x, inv_dir_x, min_x, max_x, near_x, far_x);
+		slab(origin_y, inv_dir_y, min_y, max_y, near_y, far_y);
+		slab(origin_z, inv_dir_z, min_z, max_z, near_z, far_z);
+
+		const __m128 entry = _mm_max_ps(_mm_max_ps(near_x, near_y), _mm_max_ps(near_z, vt_min));
+		const __m128 exit = _mm_min_ps(_mm_min_ps(far_x, far_y), _mm_min_ps(far_z, _mm_loadu_ps(t_max + i)));
+		hits |= static_cast<uint64_t>(_mm_movemask_ps(_mm_cmple_ps(entry, exit))) << i;
+	}
+#else
+	for (int i = 0; i < size; i++)
+	{
+		if (((active >> i) & 1) && box.hit(rays[i], t_min, t_max[i]))
+			hits |= 1ull << i;
+	}
+#endif
+
+	return hits & active;
+}
\ No newline at end of file
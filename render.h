@@ -0,0 +1,316 @@
+#pragma once
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+struct render_settings
+{
+	int image_width = 1200;
+	int image_height = 675;
+	int samples_per_pixel = 32;
+	int max_depth = 50;
+	// Primary rays are traced in packets of packet_size x packet_size pixels (up to 8), or one at a
+	// time when 0; bounces are always traced one at a time
+	int packet_size = 0;
+	// Paths that have scattered this many times go on with a probability given by their throughput,
+	// or stop at max_depth when negative
+	int roulette_depth = 3;
+	// Lights sampled directly at diffuse bounces; without them, light is only found by paths that
+	// happen to hit it
+	const light_list* lights = nullptr;
+};
+
+// Paths traced by a render and the rays along them, including the last one, which escapes or is
+// absorbed. Shadow rays toward lights are counted apart.
+struct path_stats
+{
+	uint64_t paths = 0;
+	uint64_t rays = 0;
+	uint64_t shadow_rays = 0;
+
+	double average_length() const { return paths > 0 ? static_cast<double>(rays) / paths : 0; }
+
+	void add(const path_stats& other)
+	{
+		paths += other.paths;
+		rays += other.rays;
+		shadow_rays += other.shadow_rays;
+	}
+};
+
+std::ostream& operator<<(std::ostream& out, const path_stats& stats)
+{
+	return out << "paths: " << stats.paths << ", rays: " << stats.rays << ", average path length: " << stats.average_length()
+		<< ", shadow rays: " << stats.shadow_rays;
+}
+
+color ray_world_albedo(const ray& r)
+{
+	const vec3 unit_direction = normalize(r.dir);
+	const auto t = 0.5 * (unit_direction.y + 1.0);
+	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+}
+
+color ray_albedo(const ray& r, const hittable& world, const material_table& materials)
+{
+	hit_record rec;
+	if (world.hit(r, 0.001, infinity, rec))
+	{
+		return materials[rec.material_id].get_albedo(rec.u, rec.v, rec.p);
+	}
+
+	return ray_world_albedo(r);
+}
+
+// Russian roulette for a path whose throughput is that after its latest scatter: ends it with
+// probability 1 - max(throughput), or scales the throughput up to make up for the paths ended, so
+// the estimate stays unbiased. Paths carrying little light are the ones that are cut short.
+bool survives_roulette(color& throughput)
+{
+	const float survival = std::min(1.f, std::max(throughput.r, std::max(throughput.g, throughput.b)));
+	if (survival <= 0 || random_float() >= survival)
+		return false;
+	throughput /= survival;
+	return true;
+}
+
+// Light arriving along r, which hit object at rec. The path is followed in a loop, carrying the
+// product of the attenuations so far as its throughput instead of a stack frame per bounce. With
+// settings.lights, every diffuse bounce also samples a light with a shadow ray, and light reached
+// both that way and by scattering is weighted by multiple importance sampling.
+color hit_color(ray r, hit_record rec, const hittable* object, const hittable& world, const material_table& materials, const render_settings& settings,
+	path_stats& stats)
+{
+	const bool sample_lights = settings.lights && !settings.lights->empty();
+	color radiance(0, 0, 0);
+	color throughput(1, 1, 1);
+	float scattering_pdf = 0;	// with which r was picked; 0 for camera rays and mirror-like scattering
+	for (int bounce = 1; ; bounce++)
+	{
+		const material& m = materials[rec.material_id];
+		if (m.is_emissive())
+			radiance += throughput * m.emitted(rec.u, rec.v, rec.p) * scattered_light_weight(r, object, scattering_pdf, settings.lights);
+
+		ray scattered;
+		color attenuation;
+		if (!m.scatter(r, rec, attenuation, scattered))
+			return m.is_emissive() ? radiance : radiance + throughput * ray_world_albedo(r);
+
+		// if we've exceeded the ray bounce limit, no more light is gathered
+		if (bounce >= settings.max_depth)
+			return radiance;
+
+		// Only when the scattered ray is traced, so the two ways of reaching a light stay paired
+		scattering_pdf = m.scattering_pdf(r, rec, scattered);
+		if (sample_lights && scattering_pdf > 0)
+		{
+			stats.shadow_rays++;
+			radiance += throughput * sample_direct_light(r, rec, m, attenuation, world, materials, *settings.lights);
+		}
+
+		throughput = throughput * attenuation;
+		if (settings.roulette_depth >= 0 && bounce >= settings.roulette_depth && !survives_roulette(throughput))
+			return radiance;
+
+		r = scattered;
+		stats.rays++;
+		primitive_hit hit;
+		if (!world.intersect(r, 0.001, infinity, hit))
+			return radiance + throughput * ray_world_albedo(r);
+		hit.resolve(r, rec);
+		object = hit.object;
+	}
+}
+
+color ray_color(const ray& r, const hittable& world, const material_table& materials, const render_settings& settings, path_stats& stats)
+{
+	stats.paths++;
+
+	if (settings.max_depth <= 0)
+		return color(0, 0, 0);
+
+	stats.rays++;
+	primitive_hit hit;
+	if (world.intersect(r, 0.001, infinity, hit))
+	{
+		hit_record rec;
+		hit.resolve(r, rec);
+		return hit_color(r, rec, hit.object, world, materials, settings, stats);
+	}
+
+	return ray_world_albedo(r);
+}
+
+// Samples a tile of pixels, tracing the primary rays of each sample as one packet. Colors and
+// albedos are summed into the buffers, not resolved.
+void render_tile_packets(const hittable& world, const material_table& materials, const camera& cam, const render_settings& settings,
+	int x0, int y0, int width, int height, color* color_buffer, color* albedo_ms_buffer, path_stats& stats)
+{
+	ray_packet packet;
+	float t_max[ray_packet::max_size];
+	primitive_hit hits[ray_packet::max_size];
+	for (int s = 0; s < settings.samples_per_pixel; ++s)
+	{
+		packet.clear();
+		for (int y = y0; y < y0 + height; y++)
+		{
+			for (int x = x0; x < x0 + width; x++)
+			{
+				const auto u = (x + random_float()) / (settings.image_width - 1);
+				const auto v = (y + random_float()) / (settings.image_height - 1);
+				packet.add(cam.get_ray(u, v));
+			}
+		}
+		packet.finish();
+		std::fill(t_max, t_max + ray_packet::max_size, infinity);
+		const uint64_t found = world.intersect_packet(packet, packet.all(), 0.001, t_max, hits);
+
+		for (int i = 0; i < packet.size; i++)
+		{
+			const int x = x0 + i % width, y = y0 + i / width;
+			const int buffer_idx = settings.image_width * (settings.image_height - 1 - y) + x;
+			const ray& r = packet.rays[i];
+			stats.paths++;
+			stats.rays += settings.max_depth > 0;
+			if ((found >> i) & 1)
+			{
+				hit_record rec;
+				hits[i].resolve(r, rec);
+				albedo_ms_buffer[buffer_idx] += materials[rec.material_id].get_albedo(rec.u, rec.v, rec.p);
+				color_buffer[buffer_idx] += settings.max_depth > 0 ? hit_color(r, rec, hits[i].object, world, materials, settings, stats) : color(0, 0, 0);
+			}
+			else
+			{
+				albedo_ms_buffer[buffer_idx] += ray_world_albedo(r);
+				color_buffer[buffer_idx] += settings.max_depth > 0 ? ray_world_albedo(r) : color(0, 0, 0);
+			}
+		}
+	}
+}
+
+// Renders the image rows in parallel on the pool, writing resolved colors and albedos
+void render(const hittable& world, const material_table& materials, const camera& cam, const render_settings& settings, thread_pool& pool,
+	color* color_buffer, color* albedo_ms_buffer, bool print_progress = true, path_stats* stats = nullptr)
+{
+	// Queue of jobs (rows to do, or bands of rows as tall as a packet)
+	const int packet_size = std::min(settings.packet_size, 8);
+	const int rows_per_job = std::max(packet_size, 1);
+	std::queue<int> remaining_rows;
+	for (int i = 0; i < settings.image_height; i += rows_per_job)
+	{
+		remaining_rows.push(i);
+	}
+
+	// Task the threads will do:
+	std::mutex queue_mutex;
+	path_stats total_stats;
+	auto thread_task = [&]()
+	{
+		path_stats thread_stats;
+		while (true)
+		{
+			int row_idx;
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				if (remaining_rows.empty())
+				{
+					total_stats.add(thread_stats);
+					return;
+				}
+				row_idx = remaining_rows.front();
+				remaining_rows.pop();
+			}
+
+			if (packet_size > 0)
+			{
+				const int band_height = std::min(packet_size, settings.image_height - row_idx);
+				for (int y = row_idx; y < row_idx + band_height; y++)
+				{
+					for (int x = 0; x < settings.image_width; x++)
+					{
+						const int buffer_idx = settings.image_width * (settings.image_height - 1 - y) + x;
+						color_buffer[buffer_idx] = albedo_ms_buffer[buffer_idx] = color();
+					}
+				}
+				for (int x = 0; x < settings.image_width; x += packet_size)
+				{
+					render_tile_packets(world, materials, cam, settings, x, row_idx, std::min(packet_size, settings.image_width - x), band_height,
+						color_buffer, albedo_ms_buffer, thread_stats);
+				}
+				for (int y = row_idx; y < row_idx + band_height; y++)
+				{
+					for (int x = 0; x < settings.image_width; x++)
+					{
+						const int buffer_idx = settings.image_width * (settings.image_height - 1 - y) + x;
+						resolve_samples(color_buffer[buffer_idx], settings.samples_per_pixel);
+						resolve_samples(albedo_ms_buffer[buffer_idx], settings.samples_per_pixel);
+					}
+				}
+				continue;
+			}
+
+			for (int i = 0; i < settings.image_width; ++i)
+			{
+				const int buffer_idx = settings.image_width * (settings.image_height - 1 - row_idx) + i;
+
+				color& sampled_color = color_buffer[buffer_idx];
+				color& albedo_ms = albedo_ms_buffer[buffer_idx];
+				sampled_color = albedo_ms = color();
+
+				for (int s = 0; s < settings.samples_per_pixel; ++s)
+				{
+					const auto u = (i + random_float()) / (settings.image_width - 1);
+					const auto v = (row_idx + random_float()) / (settings.image_height - 1);
+					const ray r = cam.get_ray(u, v);
+
+					albedo_ms += ray_albedo(r, world, materials);
+					sampled_color += ray_color(r, world, materials, settings, thread_stats);
+				}
+
+				resolve_samples(sampled_color, settings.samples_per_pixel);
+				resolve_samples(albedo_ms, settings.samples_per_pixel);
+			}
+		}
+	};
+
+	// Render on the pool's worker threads while this one reports progress
+	task_group render_tasks(pool);
+	for (auto i = pool.num_threads() - 1; i > 0; i--)
+	{
+		render_tasks.run(thread_task);
+	}
+	if (pool.num_threads() == 1)
+	{
+		thread_task();
+	}
+	// Print num remaining while we wait
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		size_t num_remaining;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			num_remaining = remaining_rows.size();
+		}
+		if (num_remaining == 0) break;
+		if (print_progress)
+			std::cout << "\rScanlines remaining: " << num_remaining << ' ' << std::flush;
+	}
+	render_tasks.wait();
+
+	if (stats)
+		*stats = total_stats;
+}
\ No newline at end of file
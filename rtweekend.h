@@ -49,7 +49,7 @@ inline float random_float()
 inline int random_int(int min, int max)
 {
 	// returns a random integer in [min,max]
-	std::uniform_int_distribution<> distribution(min, max+1);
+	std::uniform_int_distribution<> distribution(min, max);
 	return distribution(get_generator());
 }
 
@@ -0,0 +1,459 @@
+#pragma once
+
+#include "array_view.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "sphere_batch.h"
+#include "texture.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <vector>
+
+// A scene saved with its acceleration structures already built, as one file that is mapped into
+// memory to load. Sphere batches and triangle meshes render straight from the mapped sections, so
+// loading reads only the header and the material records; their pages come in as rays touch them.
+//
+// The file is a cache, not an interchange format: it only loads into the build that wrote it, on a
+// little endian machine, and only when its key matches the key of the inputs it was made from.
+//
+// Layout: a header, a table of sections, then the sections, each starting on a page boundary so the
+// arrays in them are aligned for any element type.
+
+const uint64_t hash_seed = 14695981039346656037ull;
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = hash_seed)
+{
+	// 64-bit FNV-1a
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// Hash of everything a snapshot is made from: the name of the scene, its parameters, the contents
+// of the files it reads. A snapshot whose key differs was made from something else and is stale.
+class snapshot_key
+{
+public:
+	snapshot_key& add(const void* data, size_t size) { value = hash_bytes(data, size, value); return *this; }
+	snapshot_key& add(const char* text) { return add(text, strlen(text) + 1); }
+	snapshot_key& add(int64_t number) { return add(&number, sizeof(number)); }
+
+	uint64_t value = hash_seed;
+};
+
+struct scene_snapshot_stats
+{
+	size_t file_bytes = 0;
+	size_t section_count = 0;
+	size_t object_count = 0;
+	double load_ms = 0;
+};
+
+std::ostream& operator<<(std::ostream& out, const scene_snapshot_stats& stats)
+{
+	return out << "file: " << stats.file_bytes / (1024.0 * 1024.0) << "MB, sections: " << stats.section_count
+		<< ", objects: " << stats.object_count << ", load time: " << stats.load_ms << "ms";
+}
+
+// Bump whenever a record or the layout of an array element changes
+const uint32_t snapshot_version = 2;
+const char snapshot_magic[8] = { 'R', 'T', 'S', 'N', 'A', 'P', 0, 0 };
+const size_t snapshot_alignment = 4096;
+
+enum class snapshot_section_type : uint32_t
+{
+	textures,			// snapshot_texture records
+	materials,			// snapshot_material records
+	objects,			// snapshot_object records, one per sphere batch or mesh
+	sphere_center_x,
+	sphere_center_y,
+	sphere_center_z,
+	sphere_radius,
+	sphere_material_ids,
+	sphere_nodes,
+	mesh_positions,
+	mesh_normals,
+	mesh_uvs,
+	mesh_indices,
+	mesh_references,
+	mesh_nodes,
+};
+
+struct snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t section_count;
+	uint64_t key;
+	uint64_t content_hash;	// of the sections, in table order
+	uint64_t file_size;
+};
+
+struct snapshot_section
+{
+	snapshot_section_type type;
+	uint32_t object;	// index of the object record for object arrays
+	uint64_t offset;	// from the start of the file
+	uint64_t size;		// in bytes
+};
+
+struct snapshot_texture
+{
+	enum : uint32_t { solid, checker } type;
+	uint32_t even, odd;	// earlier textures, checker only
+	float color[3];
+};
+
+struct snapshot_material
+{
+	enum : uint32_t { lambertian, metal, dielectric, diffuse_light } type;
+	uint32_t texture;	// lambertian and diffuse_light only
+	float albedo[3];	// metal only
+	float parameter;	// metal fuzz or dielectric index of refraction
+};
+
+struct snapshot_object
+{
+	enum : uint32_t { sphere_batch, triangle_mesh } type;
+	material_handle material_id;	// triangle meshes only
+	uint64_t primitive_count;
+};
+
+// The section of a type belonging to an object, as an array of T; empty if there is none
+template<class T>
+array_view<T> find_snapshot_array(const mapped_file& file, snapshot_section_type type, uint32_t object = 0)
+{
+	snapshot_header file_header;
+	memcpy(&file_header, file.data, sizeof(file_header));
+	const snapshot_section* sections = reinterpret_cast<const snapshot_section*>(file.data + sizeof(snapshot_header));
+	for (uint32_t i = 0; i < file_header.section_count; i++)
+	{
+		if (sections[i].type == type && sections[i].object == object)
+			return array_view<T>(reinterpret_cast<const T*>(file.data + sections[i].offset), sections[i].size / sizeof(T));
+	}
+	return array_view<T>();
+}
+
+// Writes the materials and the sphere batches and triangle meshes in world, which must have been
+// built, to path. Returns false if the file can't be written or the scene has something the format
+// can't hold: other kinds of objects, or noise textures.
+bool save_scene_snapshot(const char* path, uint64_t key, const hittable_list& world, const material_table& materials)
+{
+	// Textures are written children first, each once however many materials share it
+	std::vector<snapshot_texture> textures;
+	std::map<const texture*, uint32_t> texture_indices;
+	bool supported = true;
+	const std::function<uint32_t(const shared_ptr<texture>&)> add_texture = [&](const shared_ptr<texture>& t)
+	{
+		const auto found = texture_indices.find(t.get());
+		if (found != texture_indices.end())
+			return found->second;
+
+		snapshot_texture record = {};
+		if (const auto solid = std::dynamic_pointer_cast<solid_color>(t))
+		{
+			record.type = snapshot_texture::solid;
+			for (int i = 0; i < 3; i++)
+				record.color[i] = solid->color_value[i];
+		}
+		else if (const auto checker = std::dynamic_pointer_cast<checker_texture>(t))
+		{
+			record.type = snapshot_texture::checker;
+			record.even = add_texture(checker->even);
+			record.odd = add_texture(checker->odd);
+		}
+		else
+		{
+			supported = false;
+		}
+		textures.push_back(record);
+		return texture_indices[t.get()] = static_cast<uint32_t>(textures.size() - 1);
+	};
+
+	std::vector<snapshot_material> material_records;
+	for (const auto& m : materials.materials)
+	{
+		snapshot_material record = {};
+		if (const auto diffuse = std::dynamic_pointer_cast<lambertian>(m))
+		{
+			record.type = snapshot_material::lambertian;
+			record.texture = add_texture(diffuse->albedo);
+		}
+		else if (const auto shiny = std::dynamic_pointer_cast<metal>(m))
+		{
+			record.type = snapshot_material::metal;
+			for (int i = 0; i < 3; i++)
+				record.albedo[i] = shiny->albedo[i];
+			record.parameter = shiny->fuzz;
+		}
+		else if (const auto glass = std::dynamic_pointer_cast<dielectric>(m))
+		{
+			record.type = snapshot_material::dielectric;
+			record.parameter = glass->ir;
+		}
+		else if (const auto light = std::dynamic_pointer_cast<diffuse_light>(m))
+		{
+			record.type = snapshot_material::diffuse_light;
+			record.texture = add_texture(light->emit);
+		}
+		else
+		{
+			supported = false;
+		}
+		material_records.push_back(record);
+	}
+
+	// Sections in the order they are written, and where their bytes are now
+	std::vector<snapshot_section> sections;
+	std::vector<const void*> contents;
+	const auto add_section = [&](snapshot_section_type type, uint32_t object, const void* data, size_t size)
+	{
+		sections.push_back({ type, object, 0, size });
+		contents.push_back(data);
+	};
+	std::vector<snapshot_object> objects;
+	for (const auto& object : world.objects)
+	{
+		const uint32_t index = static_cast<uint32_t>(objects.size());
+		if (const auto batch = std::dynamic_pointer_cast<sphere_batch>(object))
+		{
+			const sphere_batch_arrays& a = batch->arrays;
+			objects.push_back({ snapshot_object::sphere_batch, 0, batch->size() });
+			add_section(snapshot_section_type::sphere_center_x, index, a.center_x.data(), a.center_x.size() * sizeof(float));
+			add_section(snapshot_section_type::sphere_center_y, index, a.center_y.data(), a.center_y.size() * sizeof(float));
+			add_section(snapshot_section_type::sphere_center_z, index, a.center_z.data(), a.center_z.size() * sizeof(float));
+			add_section(snapshot_section_type::sphere_radius, index, a.radius.data(), a.radius.size() * sizeof(float));
+			add_section(snapshot_section_type::sphere_material_ids, index, a.material_ids.data(), a.material_ids.size() * sizeof(material_handle));
+			add_section(snapshot_section_type::sphere_nodes, index, a.nodes.data(), a.nodes.size() * sizeof(linear_bvh_node));
+		}
+		else if (const auto mesh = std::dynamic_pointer_cast<triangle_mesh>(object))
+		{
+			const triangle_mesh_arrays& a = mesh->arrays;
+			objects.push_back({ snapshot_object::triangle_mesh, mesh->material_id, mesh->triangle_count() });
+			add_section(snapshot_section_type::mesh_positions, index, a.positions.data(), a.positions.size() * sizeof(point3));
+			add_section(snapshot_section_type::mesh_normals, index, a.normals.data(), a.normals.size() * sizeof(vec3));
+			add_section(snapshot_section_type::mesh_uvs, index, a.uvs.data(), a.uvs.size() * sizeof(float));
+			add_section(snapshot_section_type::mesh_indices, index, a.indices.data(), a.indices.size() * sizeof(uint32_t));
+			add_section(snapshot_section_type::mesh_references, index, a.references.data(), a.references.size() * sizeof(uint32_t));
+			add_section(snapshot_section_type::mesh_nodes, index, a.nodes.data(), a.nodes.size() * sizeof(linear_bvh_node));
+		}
+		else
+		{
+			supported = false;
+		}
+	}
+	if (!supported)
+	{
+		std::cerr << "Scene snapshots hold only sphere batches and triangle meshes, with lambertian, metal, dielectric and "
+			"diffuse_light materials over solid and checker textures\n";
+		return false;
+	}
+	add_section(snapshot_section_type::textures, 0, textures.data(), textures.size() * sizeof(snapshot_texture));
+	add_section(snapshot_section_type::materials, 0, material_records.data(), material_records.size() * sizeof(snapshot_material));
+	add_section(snapshot_section_type::objects, 0, objects.data(), objects.size() * sizeof(snapshot_object));
+
+	snapshot_header header = {};
+	memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+	header.version = snapshot_version;
+	header.section_count = static_cast<uint32_t>(sections.size());
+	header.key = key;
+	header.content_hash = hash_seed;
+	uint64_t offset = sizeof(snapshot_header) + sections.size() * sizeof(snapshot_section);
+	for (size_t i = 0; i < sections.size(); i++)
+	{
+		offset = (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+		sections[i].offset = offset;
+		offset += sections[i].size;
+		header.content_hash = hash_bytes(contents[i], sections[i].size, header.content_hash);
+	}
+	header.file_size = offset;
+
+	std::ofstream out(path, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(snapshot_section));
+	const std::vector<char> padding(snapshot_alignment, 0);
+	uint64_t written = sizeof(snapshot_header) + sections.size() * sizeof(snapshot_section);
+	for (size_t i = 0; i < sections.size(); i++)
+	{
+		out.write(padding.data(), sections[i].offset - written);
+		out.write(static_cast<const char*>(contents[i]), sections[i].size);
+		written = sections[i].offset + sections[i].size;
+	}
+	if (!out)
+	{
+		std::cerr << "Can't write " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+// Maps the snapshot at path and adds its objects to world and its materials to materials, which
+// should start empty since objects refer to materials by position. Returns false, leaving both
+// untouched, if the file is missing, stale (its key isn't key), from another build or damaged.
+// Indices the renderer follows, in BVH nodes, references, triangles and material ids, are always
+// bounds checked; checking the content hash means reading the whole file, so it only happens when
+// verify is set.
+bool load_scene_snapshot(const char* path, uint64_t key, hittable_list& world, material_table& materials, bool verify = false,
+	scene_snapshot_stats* stats = nullptr)
+{
+	const auto start_time = std::chrono::high_resolution_clock::now();
+
+	// Every object keeps the mapping alive for as long as it renders from it
+	const auto file = make_shared<mapped_file>(path);
+	if (!file->is_open())
+		return false;
+
+	snapshot_header header;
+	if (file->size < sizeof(header))
+	{
+		std::cerr << path << " is not a scene snapshot\n";
+		return false;
+	}
+	memcpy(&header, file->data, sizeof(header));
+	if (memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 || header.version != snapshot_version || header.file_size != file->size
+		|| (file->size - sizeof(header)) / sizeof(snapshot_section) < header.section_count)
+	{
+		std::cerr << path << " is not a scene snapshot, or was written by another version\n";
+		return false;
+	}
+	if (header.key != key)
+	{
+		std::cerr << path << " is stale\n";
+		return false;
+	}
+
+	const snapshot_section* sections = reinterpret_cast<const snapshot_section*>(file->data + sizeof(header));
+	uint64_t content_hash = hash_seed;
+	for (uint32_t i = 0; i < header.section_count; i++)
+	{
+		const snapshot_section& s = sections[i];
+		if (s.offset % snapshot_alignment != 0 || s.offset > file->size || s.size > file->size - s.offset)
+		{
+			std::cerr << path << " is damaged\n";
+			return false;
+		}
+		if (verify)
+			content_hash = hash_bytes(file->data + s.offset, s.size, content_hash);
+	}
+	if (verify && content_hash != header.content_hash)
+	{
+		std::cerr << path << " is damaged: its content hash doesn't match\n";
+		return false;
+	}
+
+	// Materials are the only part rebuilt as objects; there are few of them
+	std::vector<shared_ptr<texture>> textures;
+	for (const snapshot_texture& record : find_snapshot_array<snapshot_texture>(*file, snapshot_section_type::textures))
+	{
+		if (record.type == snapshot_texture::checker && record.even < textures.size() && record.odd < textures.size())
+			textures.push_back(make_shared<checker_texture>(textures[record.even], textures[record.odd]));
+		else
+			textures.push_back(make_shared<solid_color>(record.color[0], record.color[1], record.color[2]));
+	}
+	material_table loaded_materials;
+	for (const snapshot_material& record : find_snapshot_array<snapshot_material>(*file, snapshot_section_type::materials))
+	{
+		if (record.type == snapshot_material::lambertian && record.texture < textures.size())
+			loaded_materials.add(make_shared<lambertian>(textures[record.texture]));
+		else if (record.type == snapshot_material::metal)
+			loaded_materials.add(make_shared<metal>(color(record.albedo[0], record.albedo[1], record.albedo[2]), record.parameter));
+		else if (record.type == snapshot_material::diffuse_light && record.texture < textures.size())
+			loaded_materials.add(make_shared<diffuse_light>(textures[record.texture]));
+		else
+			loaded_materials.add(make_shared<dielectric>(record.parameter));
+	}
+
+	hittable_list loaded;
+	const array_view<snapshot_object> objects = find_snapshot_array<snapshot_object>(*file, snapshot_section_type::objects);
+	for (uint32_t i = 0; i < objects.size(); i++)
+	{
+		const snapshot_object& record = objects[i];
+		if (record.type == snapshot_object::sphere_batch)
+		{
+			sphere_batch_arrays a;
+			a.center_x = find_snapshot_array<float>(*file, snapshot_section_type::sphere_center_x, i);
+			a.center_y = find_snapshot_array<float>(*file, snapshot_section_type::sphere_center_y, i);
+			a.center_z = find_snapshot_array<float>(*file, snapshot_section_type::sphere_center_z, i);
+			a.radius = find_snapshot_array<float>(*file, snapshot_section_type::sphere_radius, i);
+			a.material_ids = find_snapshot_array<material_handle>(*file, snapshot_section_type::sphere_material_ids, i);
+			a.nodes = find_snapshot_array<linear_bvh_node>(*file, snapshot_section_type::sphere_nodes, i);
+			const size_t padded = record.primitive_count + sphere_batch::simd_width;
+			if (a.center_x.size() != padded || a.center_y.size() != padded || a.center_z.size() != padded || a.radius.size() != padded
+				|| a.material_ids.size() != record.primitive_count)
+			{
+				std::cerr << path << " is damaged: sphere batch " << i << " has arrays of the wrong size\n";
+				return false;
+			}
+			const size_t material_count = loaded_materials.materials.size();
+			if (!linear_bvh::is_valid(a.nodes.data(), a.nodes.size(), record.primitive_count)
+				|| std::any_of(a.material_ids.begin(), a.material_ids.end(), [&](material_handle id) { return id >= material_count; }))
+			{
+				std::cerr << path << " is damaged: sphere batch " << i << " refers outside its arrays\n";
+				return false;
+			}
+			const auto batch = make_shared<sphere_batch>();
+			batch->attach(a, record.primitive_count, file);
+			loaded.add(batch);
+		}
+		else
+		{
+			triangle_mesh_arrays a;
+			a.positions = find_snapshot_array<point3>(*file, snapshot_section_type::mesh_positions, i);
+			a.normals = find_snapshot_array<vec3>(*file, snapshot_section_type::mesh_normals, i);
+			a.uvs = find_snapshot_array<float>(*file, snapshot_section_type::mesh_uvs, i);
+			a.indices = find_snapshot_array<uint32_t>(*file, snapshot_section_type::mesh_indices, i);
+			a.references = find_snapshot_array<uint32_t>(*file, snapshot_section_type::mesh_references, i);
+			a.nodes = find_snapshot_array<linear_bvh_node>(*file, snapshot_section_type::mesh_nodes, i);
+			if (a.indices.size() % 3 != 0 || a.indices.size() / 3 != record.primitive_count || (!a.normals.empty() && a.normals.size() != a.positions.size())
+				|| (!a.uvs.empty() && a.uvs.size() != 2 * a.positions.size()))
+			{
+				std::cerr << path << " is damaged: mesh " << i << " has arrays of the wrong size\n";
+				return false;
+			}
+			const size_t vertex_count = a.positions.size();
+			if (!linear_bvh::is_valid(a.nodes.data(), a.nodes.size(), a.references.size()) || record.material_id >= loaded_materials.materials.size()
+				|| std::any_of(a.references.begin(), a.references.end(), [&](uint32_t triangle) { return triangle >= record.primitive_count; })
+				|| std::any_of(a.indices.begin(), a.indices.end(), [&](uint32_t vertex) { return vertex >= vertex_count; }))
+			{
+				std::cerr << path << " is damaged: mesh " << i << " refers outside its arrays\n";
+				return false;
+			}
+			const auto mesh = make_shared<triangle_mesh>();
+			mesh->material_id = record.material_id;
+			mesh->attach(a, file);
+			loaded.add(mesh);
+		}
+	}
+
+	for (const auto& object : loaded.objects)
+	{
+		world.add(object);
+	}
+	for (const auto& m : loaded_materials.materials)
+	{
+		materials.add(m);
+	}
+
+	if (stats)
+	{
+		stats->file_bytes = file->size;
+		stats->section_count = header.section_count;
+		stats->object_count = loaded.objects.size();
+		stats->load_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+// SIMD feature detection. SSE2 is always available on x64; AVX is enabled by /arch:AVX (or -mavx)
+// and lets 8-wide code run in a single instruction instead of two 4-wide halves.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE 1
+#endif
+
+#if defined(__AVX__)
+#define RT_AVX 1
+#endif
+
+#if RT_SSE || RT_AVX
+#include <immintrin.h>
+#endif
\ No newline at end of file
@@ -1,23 +1,56 @@
 #pragma once
 
 #include "hittable.h"
+#include "light_shape.h"
 #include "vec3.h"
 
-class sphere : public hittable
+// Nearest distance within [t_min, t_max] at which r meets the sphere around center. Returns false
+// when neither root of the quadratic lies in that range.
+bool sphere_root_in_range(const ray& r, const point3& center, float radius, float t_min, float t_max, float& root)
+{
+	const vec3 oc = r.origin - center;
+	const auto a = r.dir.length_squared();
+	const auto half_b = dot(oc, r.dir);
+	const auto c = oc.length_squared() - radius*radius;
+
+	const auto discriminant = half_b*half_b - a*c;
+	if (discriminant < 0) return false;
+	const auto sqrtd = sqrt(discriminant);
+
+	// Find the nearest root that lies in the acceptable range
+	root = (-half_b - sqrtd) / a;
+	if (root < t_min || t_max < root)
+	{
+		root = (-half_b + sqrtd) / a;
+		if(root < t_min || t_max < root)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+class sphere : public light_shape
 {
 public:
 	sphere() {}
-	sphere(const point3& cen, float r, const shared_ptr<material> m)
-		: center(cen), radius(r), mat_ptr(m) {};
+	sphere(const point3& cen, float r, material_handle m)
+		: center(cen), radius(r), material_id(m) {};
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual material_handle hit_material(const primitive_hit& hit) const override { return material_id; }
 	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
 
+	virtual material_handle light_material() const override { return material_id; }
+	virtual vec3 random_direction(const point3& origin) const override;
+	virtual float direction_pdf(const point3& origin, const vec3& dir) const override;
+
 	point3 center;
 	float radius;
-	shared_ptr<material> mat_ptr;
+	material_handle material_id;
 
-private:
 	static void get_sphere_uv(const point3& p, float& u, float& v)
 	{
 		// p: a given point on the sphere of radius one, centered at the origin.
@@ -35,39 +68,69 @@ private:
 	}
 };
 
-bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
+bool sphere::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
 {
-	const vec3 oc = r.origin - center;
-	const auto a = r.dir.length_squared();
-	const auto half_b = dot(oc, r.dir);
-	const auto c = oc.length_squared() - radius*radius;
+	float root;
+	if (!sphere_root_in_range(r, center, radius, t_min, t_max, root))
+		return false;
 
-	const auto discriminant = half_b*half_b - a*c;
-	if (discriminant < 0) return false;
-	const auto sqrtd = sqrt(discriminant);
+	hit.set(root, this);
+	return true;
+}
 
-	// Find the nearest root that lies in the acceptable range
-	auto root = (-half_b - sqrtd) / a;
-	if (root < t_min || t_max < root)
-	{
-		root = (-half_b + sqrtd) / a;
-		if(root < t_min || t_max < root)
-		{
-			return false;
-		}
-	}
+bool sphere::occluded(const ray& r, float t_min, float t_max) const
+{
+	float root;
+	return sphere_root_in_range(r, center, radius, t_min, t_max, root);
+}
 
-	rec.t = root;
+void sphere::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	rec.t = hit.t;
 	rec.p = r.at(rec.t);
 	const vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.mat_ptr = mat_ptr;
-	return true;
+	rec.material_id = material_id;
 }
 
 bool sphere::bounding_box(float time0, float time1, aabb& output_box) const
 {
 	output_box = aabb(center - vec3(radius), center + vec3(radius));
 	return true;
+}
+
+// Directions toward the sphere fill a cone around the one to its center; they are picked uniformly
+// from it. From inside, every direction reaches the sphere and they are picked uniformly from all.
+vec3 sphere::random_direction(const point3& origin) const
+{
+	const vec3 to_center = center - origin;
+	const float distance_squared = to_center.length_squared();
+	if (distance_squared <= radius * radius)
+		return random_unit_vector();
+
+	// 1 - cos of the cone's half angle, written so it doesn't cancel out for small, distant spheres
+	const float sin_squared = radius * radius / distance_squared;
+	const float one_minus_cos_max = sin_squared / (1 + sqrt(1 - sin_squared));
+	const float z = 1 - random_float() * one_minus_cos_max;
+	const float phi = 2 * pi * random_float();
+	const float sin_theta = sqrt(max(0.f, 1 - z * z));
+
+	const vec3 w = normalize(to_center);
+	vec3 u, v;
+	plane_basis(w, u, v);
+	return (cos(phi) * sin_theta) * u + (sin(phi) * sin_theta) * v + z * w;
+}
+
+float sphere::direction_pdf(const point3& origin, const vec3& dir) const
+{
+	const float distance_squared = (center - origin).length_squared();
+	if (distance_squared <= radius * radius)
+		return 1 / (4 * pi);
+	if (!occluded(ray(origin, dir), 0.001, infinity))
+		return 0;
+
+	const float sin_squared = radius * radius / distance_squared;
+	const float one_minus_cos_max = sin_squared / (1 + sqrt(1 - sin_squared));
+	return 1 / (2 * pi * one_minus_cos_max);
 }
\ No newline at end of file
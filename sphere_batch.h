@@ -0,0 +1,365 @@
+#pragma once
+
+#include "aabb.h"
+#include "array_view.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <vector>
+
+// The arrays sphere_batch traversal and shading read. They point into the batch's own vectors once
+// build() has run, or into a mapped scene snapshot.
+struct sphere_batch_arrays
+{
+	array_view<float> center_x, center_y, center_z, radius;	// padded past the last sphere
+	array_view<material_handle> material_ids;
+	array_view<linear_bvh_node> nodes;
+};
+
+// Static spheres stored as structure-of-arrays, with a BVH of their own whose leaves are ranges of
+// the arrays. A leaf is intersected 8 spheres per AVX instruction (4 with SSE), finding only the
+// closest distance and sphere index; resolve() fills in the rest for the closest hit.
+class sphere_batch : public hittable
+{
+public:
+	// Lanes per intersection step; the arrays are padded by this much so leaves can load past their end
+	static const int simd_width = 8;
+
+	sphere_batch() {}
+
+	// A copy's arrays would still point into the original's vectors
+	sphere_batch(const sphere_batch&) = delete;
+	sphere_batch& operator=(const sphere_batch&) = delete;
+	sphere_batch(sphere_batch&&) = default;
+	sphere_batch& operator=(sphere_batch&&) = default;
+
+	void add(const point3& center, float radius, material_handle m);
+	// Builds the BVH over everything added so far; must be called before intersect()
+	void build(const bvh_build_settings& settings = default_build_settings());
+	// Renders count spheres from arrays owned elsewhere instead of building; storage keeps them alive
+	void attach(const sphere_batch_arrays& arrays_, size_t count, shared_ptr<const void> storage_);
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual uint64_t intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual material_handle hit_material(const primitive_hit& hit) const override { return arrays.material_ids[hit.primitive]; }
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	// Closest sphere in [first, first + count) hit within [t_min, t_max]. Shrinks t_max and sets
+	// hit_index when one is found.
+	bool intersect_range(const ray& r, uint32_t first, uint32_t count, float t_min, float& t_max, uint32_t& hit_index) const;
+
+	size_t size() const { return num_spheres; }
+
+	// Leaves of up to 8 spheres fill one AVX step, which costs about half a scalar test per sphere
+	static bvh_build_settings default_build_settings()
+	{
+		bvh_build_settings settings;
+		settings.max_leaf_size = simd_width;
+		settings.intersection_cost = 0.5;
+		return settings;
+	}
+
+	std::vector<float> center_x, center_y, center_z, radius;
+	std::vector<material_handle> material_ids;
+	std::vector<linear_bvh_node> nodes;
+	bvh_build_stats build_stats;
+
+	sphere_batch_arrays arrays;
+	shared_ptr<const void> storage;
+
+private:
+	size_t num_spheres = 0;
+};
+
+void sphere_batch::add(const point3& center, float r, material_handle m)
+{
+	material_ids.push_back(m);
+	center_x.push_back(center.x);
+	center_y.push_back(center.y);
+	center_z.push_back(center.z);
+	radius.push_back(r);
+	num_spheres++;
+}
+
+void sphere_batch::build(const bvh_build_settings& settings)
+{
+	std::vector<aabb> boxes(num_spheres);
+	for (size_t i = 0; i < num_spheres; i++)
+	{
+		const point3 center(center_x[i], center_y[i], center_z[i]);
+		boxes[i] = aabb(center - vec3(radius[i]), center + vec3(radius[i]));
+	}
+
+	const bvh_builder builder(std::move(boxes), settings);
+	build_stats = builder.stats;
+	nodes.clear();
+	linear_bvh::flatten(builder, 0, nodes);
+
+	// Reorder the arrays to match the leaves, then pad them with spheres no ray can hit
+	const auto reorder = [&](std::vector<float>& values, float padding)
+	{
+		std::vector<float> sorted(num_spheres + simd_width, padding);
+		for (size_t i = 0; i < num_spheres; i++)
+		{
+			sorted[i] = values[builder.primitive_indices[i]];
+		}
+		values.swap(sorted);
+	};
+	reorder(center_x, infinity);
+	reorder(center_y, infinity);
+	reorder(center_z, infinity);
+	reorder(radius, 0);
+
+	std::vector<material_handle> sorted_ids(num_spheres);
+	for (size_t i = 0; i < num_spheres; i++)
+	{
+		sorted_ids[i] = material_ids[builder.primitive_indices[i]];
+	}
+	material_ids.swap(sorted_ids);
+
+	arrays.center_x = center_x;
+	arrays.center_y = center_y;
+	arrays.center_z = center_z;
+	arrays.radius = radius;
+	arrays.material_ids = material_ids;
+	arrays.nodes = nodes;
+	storage = nullptr;
+}
+
+void sphere_batch::attach(const sphere_batch_arrays& arrays_, size_t count, shared_ptr<const void> storage_)
+{
+	arrays = arrays_;
+	num_spheres = count;
+	storage = std::move(storage_);
+}
+
+bool sphere_batch::intersect_range(const ray& r, uint32_t first, uint32_t count, float t_min, float& t_max, uint32_t& hit_index) const
+{
+	// Same quadratic as sphere::hit, per lane
+	const float a = r.dir.length_squared();
+	const float inv_a = 1.f / a;
+	bool found = false;
+
+#if RT_AVX
+	const __m256 ox = _mm256_set1_ps(r.origin.x), oy = _mm256_set1_ps(r.origin.y), oz = _mm256_set1_ps(r.origin.z);
+	const __m256 dx = _mm256_set1_ps(r.dir.x), dy = _mm256_set1_ps(r.dir.y), dz = _mm256_set1_ps(r.dir.z);
+	const __m256 va = _mm256_set1_ps(a), vinv_a = _mm256_set1_ps(inv_a);
+	const __m256 vt_min = _mm256_set1_ps(t_min);
+	const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256 zero = _mm256_setzero_ps();
+
+	for (uint32_t i = first; i < first + count; i += 8)
+	{
+		const __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&arrays.center_x[i]));
+		const __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&arrays.center_y[i]));
+		const __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&arrays.center_z[i]));
+		const __m256 rad = _mm256_loadu_ps(&arrays.radius[i]);
+
+		const __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+		const __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(rad, rad));
+		const __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(va, c));
+		const __m256 sqrtd = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+
+		const __m256 vt_max = _mm256_set1_ps(t_max);
+		const __m256 near_root = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(zero, half_b), sqrtd), vinv_a);
+		const __m256 far_root = _mm256_mul_ps(_mm256_sub_ps(sqrtd, half_b), vinv_a);
+		const __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near_root, vt_min, _CMP_GE_OQ), _mm256_cmp_ps(near_root, vt_max, _CMP_LE_OQ));
+		const __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far_root, vt_min, _CMP_GE_OQ), _mm256_cmp_ps(far_root, vt_max, _CMP_LE_OQ));
+		// Lanes past the end of the range hold padding or the next leaf's spheres
+		const __m256 in_range = _mm256_cmp_ps(lane, _mm256_set1_ps(static_cast<float>(first + count - i)), _CMP_LT_OQ);
+		const __m256 valid = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ), in_range), _mm256_or_ps(near_ok, far_ok));
+		if (_mm256_movemask_ps(valid) == 0)
+			continue;
+
+		float t[8];
+		_mm256_storeu_ps(t, _mm256_blendv_ps(_mm256_set1_ps(infinity), _mm256_blendv_ps(far_root, near_root, near_ok), valid));
+		for (uint32_t j = 0; j < 8; j++)
+		{
+			if (t[j] < t_max)
+			{
+				t_max = t[j];
+				hit_index = i + j;
+				found = true;
+			}
+		}
+	}
+#elif RT_SSE
+	const __m128 ox = _mm_set1_ps(r.origin.x), oy = _mm_set1_ps(r.origin.y), oz = _mm_set1_ps(r.origin.z);
+	const __m128 dx = _mm_set1_ps(r.dir.x), dy = _mm_set1_ps(r.dir.y), dz = _mm_set1_ps(r.dir.z);
+	const __m128 va = _mm_set1_ps(a), vinv_a = _mm_set1_ps(inv_a);
+	const __m128 vt_min = _mm_set1_ps(t_min);
+	const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (uint32_t i = first; i < first + count; i += 4)
+	{
+		const __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&arrays.center_x[i]));
+		const __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&arrays.center_y[i]));
+		const __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&arrays.center_z[i]));
+		const __m128 rad = _mm_loadu_ps(&arrays.radius[i]);
+
+		const __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+		const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(rad, rad));
+		const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(va, c));
+		const __m128 sqrtd = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+
+		const __m128 vt_max = _mm_set1_ps(t_max);
+		const __m128 near_root = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(zero, half_b), sqrtd), vinv_a);
+		const __m128 far_root = _mm_mul_ps(_mm_sub_ps(sqrtd, half_b), vinv_a);
+		const __m128 near_ok = _mm_and_ps(_mm_cmpge_ps(near_root, vt_min), _mm_cmple_ps(near_root, vt_max));
+		const __m128 far_ok = _mm_and_ps(_mm_cmpge_ps(far_root, vt_min), _mm_cmple_ps(far_root, vt_max));
+		const __m128 in_range = _mm_cmplt_ps(lane, _mm_set1_ps(static_cast<float>(first + count - i)));
+		const __m128 valid = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(discriminant, zero), in_range), _mm_or_ps(near_ok, far_ok));
+		if (_mm_movemask_ps(valid) == 0)
+			continue;
+
+		// SSE2 has no blend, so select with and/andnot
+		const __m128 root = _mm_or_ps(_mm_and_ps(near_ok, near_root), _mm_andnot_ps(near_ok, far_root));
+		float t[4];
+		_mm_storeu_ps(t, _mm_or_ps(_mm_and_ps(valid, root), _mm_andnot_ps(valid, _mm_set1_ps(infinity))));
+		for (uint32_t j = 0; j < 4; j++)
+		{
+			if (t[j] < t_max)
+			{
+				t_max = t[j];
+				hit_index = i + j;
+				found = true;
+			}
+		}
+	}
+#else
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		const vec3 oc = r.origin - point3(arrays.center_x[i], arrays.center_y[i], arrays.center_z[i]);
+		const float half_b = dot(oc, r.dir);
+		const float c = oc.length_squared() - arrays.radius[i] * arrays.radius[i];
+		const float discriminant = half_b * half_b - a * c;
+		if (discriminant < 0)
+			continue;
+
+		const float sqrtd = sqrt(discriminant);
+		float root = (-half_b - sqrtd) * inv_a;
+		if (root < t_min || t_max < root)
+		{
+			root = (-half_b + sqrtd) * inv_a;
+			if (root < t_min || t_max < root)
+				continue;
+		}
+		t_max = root;
+		hit_index = i;
+		found = true;
+	}
+#endif
+
+	return found;
+}
+
+bool sphere_batch::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	if (arrays.nodes.empty())
+		return false;
+
+	uint32_t stack[linear_bvh::max_stack_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	uint32_t hit_index = 0;
+	bool hit_anything = false;
+
+	while (true)
+	{
+		const linear_bvh_node& node = arrays.nodes[current];
+		if (node.box.hit(r, t_min, t_max))
+		{
+			if (node.is_leaf())
+			{
+				hit_anything |= intersect_range(r, node.primitives_offset, node.primitive_count, t_min, t_max, hit_index);
+			}
+			else
+			{
+				if (r.sign[node.axis])
+				{
+					stack[stack_size++] = current + 1;
+					current = node.second_child_offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.second_child_offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+
+	if (hit_anything)
+		hit.set(t_max, this, hit_index);
+	return hit_anything;
+}
+
+uint64_t sphere_batch::intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const
+{
+	if (arrays.nodes.empty())
+		return 0;
+
+	return linear_bvh::traverse_packet(arrays.nodes.data(), packet, active, t_min, t_max, [&](const linear_bvh_node& node, uint64_t rays)
+	{
+		// Leaves are already SIMD across spheres, so their rays go through one by one
+		uint64_t found = 0;
+		for (int i = 0; i < packet.size; i++)
+		{
+			uint32_t hit_index;
+			if (((rays >> i) & 1) && intersect_range(packet.rays[i], node.primitives_offset, node.primitive_count, t_min, t_max[i], hit_index))
+			{
+				hits[i].set(t_max[i], this, hit_index);
+				found |= 1ull << i;
+			}
+		}
+		return found;
+	});
+}
+
+bool sphere_batch::occluded(const ray& r, float t_min, float t_max) const
+{
+	if (arrays.nodes.empty())
+		return false;
+
+	// A leaf is one SIMD step, so finding its closest sphere costs no more than finding any
+	return linear_bvh::traverse_occluded(arrays.nodes.data(), r, t_min, t_max, [&](const linear_bvh_node& node)
+	{
+		float leaf_t_max = t_max;
+		uint32_t hit_index;
+		return intersect_range(r, node.primitives_offset, node.primitive_count, t_min, leaf_t_max, hit_index);
+	});
+}
+
+void sphere_batch::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	const uint32_t i = hit.primitive;
+	const point3 center(arrays.center_x[i], arrays.center_y[i], arrays.center_z[i]);
+	rec.t = hit.t;
+	rec.p = r.at(rec.t);
+	const vec3 outward_normal = (rec.p - center) / arrays.radius[i];
+	rec.set_face_normal(r, outward_normal);
+	sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+	rec.material_id = arrays.material_ids[i];
+}
+
+bool sphere_batch::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (arrays.nodes.empty())
+		return false;
+
+	output_box = arrays.nodes[0].box;
+	return true;
+}
\ No newline at end of file
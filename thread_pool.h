@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads fed from a single task queue. The thread that creates the pool counts
+// as one of its threads: it runs queued tasks itself while waiting on a task_group.
+class thread_pool
+{
+public:
+	thread_pool(unsigned num_threads_ = std::thread::hardware_concurrency());
+	~thread_pool();
+
+	unsigned num_threads() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+	// Calls task(begin, end) over chunks of [0, count), spread across the pool
+	template<class F>
+	void parallel_for(size_t count, size_t min_chunk_size, const F& task);
+
+private:
+	friend class task_group;
+
+	void push(std::function<void()> task);
+	bool run_one();
+	void worker_loop();
+
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex queue_mutex;
+	std::condition_variable queue_condition;
+	bool stopping = false;
+};
+
+// Set of tasks that can be waited on together. Waiting helps run queued tasks, so tasks may
+// themselves start and wait on nested groups without starving the pool.
+class task_group
+{
+public:
+	task_group(thread_pool& pool_) : pool(pool_) {}
+	~task_group() { wait(); }
+
+	void run(std::function<void()> task);
+	void wait();
+
+private:
+	thread_pool& pool;
+	std::atomic<int> pending{0};
+};
+
+thread_pool::thread_pool(unsigned num_threads_)
+{
+	for (unsigned i = 1; i < std::max(num_threads_, 1u); i++)
+	{
+		workers.push_back(std::thread([this]() { worker_loop(); }));
+	}
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_condition.notify_all();
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+void thread_pool::push(std::function<void()> task)
+{
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		tasks.push(std::move(task));
+	}
+	queue_condition.notify_one();
+}
+
+bool thread_pool::run_one()
+{
+	std::function<void()> task;
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		if (tasks.empty()) return false;
+		task = std::move(tasks.front());
+		tasks.pop();
+	}
+	task();
+	return true;
+}
+
+void thread_pool::worker_loop()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_condition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty()) return;
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
+
+template<class F>
+void thread_pool::parallel_for(size_t count, size_t min_chunk_size, const F& task)
+{
+	const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(num_threads() * 4, count / std::max<size_t>(min_chunk_size, 1)));
+	if (num_chunks == 1)
+	{
+		task(0, count);
+		return;
+	}
+
+	task_group group(*this);
+	for (size_t chunk = 0; chunk < num_chunks; chunk++)
+	{
+		const size_t begin = count * chunk / num_chunks;
+		const size_t end = count * (chunk + 1) / num_chunks;
+		group.run([&task, begin, end]() { task(begin, end); });
+	}
+	group.wait();
+}
+
+void task_group::run(std::function<void()> task)
+{
+	pending++;
+	pool.push([this, task]()
+	{
+		task();
+		pending--;
+	});
+}
+
+void task_group::wait()
+{
+	while (pending > 0)
+	{
+		if (!pool.run_one())
+			std::this_thread::yield();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "aabb.h"
+#include "rtweekend.h"
+
+// Affine transform stored as the top three rows of a 4x4 matrix
+class transform
+{
+public:
+	transform()
+	{
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 4; c++)
+				m[r][c] = r == c ? 1.f : 0.f;
+	}
+
+	static transform translate(const vec3& offset)
+	{
+		transform t;
+		t.m[0][3] = offset.x;
+		t.m[1][3] = offset.y;
+		t.m[2][3] = offset.z;
+		return t;
+	}
+
+	static transform scale(const vec3& s)
+	{
+		transform t;
+		t.m[0][0] = s.x;
+		t.m[1][1] = s.y;
+		t.m[2][2] = s.z;
+		return t;
+	}
+
+	// Rotation by angle degrees around axis, counter-clockwise looking down the axis
+	static transform rotate(const vec3& axis, float degrees)
+	{
+		const vec3 a = normalize(axis);
+		const float theta = degrees_to_radians(degrees);
+		const float s = sin(theta);
+		const float c = cos(theta);
+
+		transform t;
+		t.m[0][0] = a.x * a.x + (1 - a.x * a.x) * c;
+		t.m[0][1] = a.x * a.y * (1 - c) - a.z * s;
+		t.m[0][2] = a.x * a.z * (1 - c) + a.y * s;
+		t.m[1][0] = a.x * a.y * (1 - c) + a.z * s;
+		t.m[1][1] = a.y * a.y + (1 - a.y * a.y) * c;
+		t.m[1][2] = a.y * a.z * (1 - c) - a.x * s;
+		t.m[2][0] = a.x * a.z * (1 - c) - a.y * s;
+		t.m[2][1] = a.y * a.z * (1 - c) + a.x * s;
+		t.m[2][2] = a.z * a.z + (1 - a.z * a.z) * c;
+		return t;
+	}
+
+	// Composes two transforms; the result applies rhs first, then this
+	transform operator*(const transform& rhs) const
+	{
+		transform t;
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				t.m[r][c] = m[r][0] * rhs.m[0][c] + m[r][1] * rhs.m[1][c] + m[r][2] * rhs.m[2][c] + (c == 3 ? m[r][3] : 0.f);
+			}
+		}
+		return t;
+	}
+
+	transform inverse() const
+	{
+		// Invert the linear part by cofactors, then undo the translation
+		const float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		const float inv_det = 1.f / det;
+
+		transform t;
+		t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+		t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+		t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+		t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+		t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+		t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+		t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+		t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+		t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+		const vec3 offset = t.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+		t.m[0][3] = -offset.x;
+		t.m[1][3] = -offset.y;
+		t.m[2][3] = -offset.z;
+		return t;
+	}
+
+	point3 apply_point(const point3& p) const
+	{
+		return apply_vector(p) + vec3(m[0][3], m[1][3], m[2][3]);
+	}
+
+	vec3 apply_vector(const vec3& v) const
+	{
+		return vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+					m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+					m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+	}
+
+	// Multiplies by the transposed linear part. Called on the inverse of a transform, this maps
+	// normals through the original transform.
+	vec3 apply_transposed_vector(const vec3& v) const
+	{
+		return vec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+					m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+					m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+	}
+
+	ray apply_ray(const ray& r) const
+	{
+		// The direction isn't renormalized, so hit distances are the same in both spaces
+		return ray(apply_point(r.origin), apply_vector(r.dir), r.time);
+	}
+
+	aabb apply_box(const aabb& box) const
+	{
+		aabb result = aabb::empty();
+		for (int corner = 0; corner < 8; corner++)
+		{
+			const point3 p(corner & 1 ? box.max_point.x : box.min_point.x,
+						   corner & 2 ? box.max_point.y : box.min_point.y,
+						   corner & 4 ? box.max_point.z : box.min_point.z);
+			result = surrounding_box(result, apply_point(p));
+		}
+		return result;
+	}
+
+	float m[3][4];
+};
\ No newline at end of file
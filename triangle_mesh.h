@@ -0,0 +1,551 @@
+#pragma once
+
+#include "aabb.h"
+#include "array_view.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "rtweekend.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct triangle_mesh_settings
+{
+	bvh_build_settings build = default_build();
+	// Early split clipping: triangles whose box area is more than this multiple of their own area
+	// (long thin or diagonal ones) and larger than the average box are cut into pieces with tighter
+	// boxes before the build, and each piece gets its own reference in the BVH. 0 disables it;
+	// around 16 suits most meshes.
+	float split_ratio = 0;
+	int max_split_depth = 6;	// at most 2^max_split_depth pieces per triangle
+
+	// Leaves of up to 4 triangles fill one SSE step
+	static bvh_build_settings default_build()
+	{
+		bvh_build_settings settings;
+		settings.max_leaf_size = 4;
+		settings.intersection_cost = 0.5;
+		return settings;
+	}
+};
+
+// A ray sheared so that it points down +z from the origin, for the watertight ray/triangle test
+// of Woop, Benthin and Wald. Triangle edges are tested in that space with the same operations
+// whichever triangle they belong to, so rays can't slip through the edges shared by two triangles.
+struct watertight_ray
+{
+	watertight_ray() {}
+	watertight_ray(const ray& r)
+		: origin(r.origin)
+	{
+		kz = fabs(r.dir.x) > fabs(r.dir.y) ? (fabs(r.dir.x) > fabs(r.dir.z) ? 0 : 2) : (fabs(r.dir.y) > fabs(r.dir.z) ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		// Keep the winding of the sheared triangle the same as in world space
+		if (r.dir[kz] < 0)
+			std::swap(kx, ky);
+		sx = r.dir[kx] / r.dir[kz];
+		sy = r.dir[ky] / r.dir[kz];
+		sz = 1.f / r.dir[kz];
+	}
+
+	point3 origin;
+	int kx, ky, kz;
+	float sx, sy, sz;
+};
+
+// The arrays triangle_mesh traversal and shading read. They point into the mesh's own vectors once
+// build() has run, or into a mapped scene snapshot.
+struct triangle_mesh_arrays
+{
+	array_view<point3> positions;
+	array_view<vec3> normals;
+	array_view<float> uvs;
+	array_view<uint32_t> indices;
+	array_view<uint32_t> references;
+	array_view<linear_bvh_node> nodes;
+};
+
+// Triangles sharing indexed vertex buffers, with a BVH of their own whose leaves are ranges of
+// triangle references. A triangle costs its three indices plus its share of the vertices and BVH,
+// a few dozen bytes, instead of a heap-allocated hittable each. Leaves are tested 4 triangles per
+// SSE step; resolve() interpolates normals and UVs for the closest hit only.
+class triangle_mesh : public hittable
+{
+public:
+	triangle_mesh() {}
+	triangle_mesh(std::vector<point3> positions_, std::vector<uint32_t> indices_, material_handle m)
+		: positions(std::move(positions_)), indices(std::move(indices_)), material_id(m)
+	{}
+
+	// A copy's arrays would still point into the original's vectors
+	triangle_mesh(const triangle_mesh&) = delete;
+	triangle_mesh& operator=(const triangle_mesh&) = delete;
+	triangle_mesh(triangle_mesh&&) = default;
+	triangle_mesh& operator=(triangle_mesh&&) = default;
+
+	// Builds the BVH over the triangles in indices; must be called before intersect()
+	void build(const triangle_mesh_settings& settings = triangle_mesh_settings());
+	// Renders from arrays owned elsewhere instead of building; storage keeps them alive
+	void attach(const triangle_mesh_arrays& arrays_, shared_ptr<const void> storage_);
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual uint64_t intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual void resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const override;
+	virtual material_handle hit_material(const primitive_hit& hit) const override { return material_id; }
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	// Of the built or attached arrays
+	size_t triangle_count() const { return arrays.indices.size() / 3; }
+	size_t memory_bytes() const;
+
+	// Watertight test of one triangle. On a hit within [t_min, t_max], writes t and the barycentric
+	// weights of its three vertices.
+	bool intersect_triangle(const watertight_ray& wr, uint32_t triangle, float t_min, float t_max, float& t, float* weights) const;
+	// Closest triangle hit among the references [first, first + count). Shrinks t_max and sets
+	// hit_triangle when one is found.
+	bool intersect_leaf(const watertight_ray& wr, uint32_t first, uint32_t count, float t_min, float& t_max, uint32_t& hit_triangle) const;
+
+	std::vector<point3> positions;
+	std::vector<vec3> normals;		// per vertex, or empty for flat shading
+	std::vector<float> uvs;			// two per vertex, or empty to use barycentric coordinates
+	std::vector<uint32_t> indices;	// three per triangle
+	material_handle material_id = 0;
+
+	std::vector<linear_bvh_node> nodes;
+	std::vector<uint32_t> references;	// triangle of each BVH primitive; split triangles appear more than once
+	bvh_build_stats build_stats;
+
+	triangle_mesh_arrays arrays;
+	shared_ptr<const void> storage;
+
+private:
+	void split_triangle(uint32_t triangle, const aabb& box, float area, int depth, float average_box_area,
+		const triangle_mesh_settings& settings, std::vector<aabb>& boxes, std::vector<uint32_t>& triangles) const;
+};
+
+// Bounds and area of the part of triangle v0 v1 v2 inside box. Returns false if there is none.
+bool clip_triangle(const point3& v0, const point3& v1, const point3& v2, const aabb& box, aabb& clipped_box, float& clipped_area)
+{
+	// A triangle clipped by six planes has at most nine vertices
+	point3 polygon[9] = { v0, v1, v2 };
+	int count = 3;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		for (int side = 0; side < 2; side++)
+		{
+			// Sutherland-Hodgman against one plane; inside means not past it
+			const float plane = side == 0 ? box.min_point[axis] : box.max_point[axis];
+			const float sign = side == 0 ? 1.f : -1.f;
+			point3 clipped[9];
+			int clipped_count = 0;
+			for (int i = 0; i < count; i++)
+			{
+				const point3& a = polygon[i];
+				const point3& b = polygon[(i + 1) % count];
+				const float da = sign * (a[axis] - plane);
+				const float db = sign * (b[axis] - plane);
+				if (da >= 0)
+					clipped[clipped_count++] = a;
+				if ((da >= 0) != (db >= 0) && clipped_count < 9)
+				{
+					point3 crossing = a + (da / (da - db)) * (b - a);
+					crossing[axis] = plane;
+					clipped[clipped_count++] = crossing;
+				}
+			}
+			count = clipped_count;
+			for (int i = 0; i < count; i++)
+			{
+				polygon[i] = clipped[i];
+			}
+			if (count == 0)
+				return false;
+		}
+	}
+
+	clipped_box = aabb::empty();
+	vec3 area_vector;
+	for (int i = 0; i < count; i++)
+	{
+		clipped_box = surrounding_box(clipped_box, polygon[i]);
+		area_vector += cross(polygon[i], polygon[(i + 1) % count]);
+	}
+	clipped_area = 0.5f * area_vector.length();
+	return true;
+}
+
+void triangle_mesh::build(const triangle_mesh_settings& settings)
+{
+	const uint32_t triangle_count = static_cast<uint32_t>(indices.size() / 3);
+	std::vector<aabb> boxes(triangle_count);
+	std::vector<uint32_t> triangles(triangle_count);
+	double total_box_area = 0;
+	for (uint32_t i = 0; i < triangle_count; i++)
+	{
+		const point3& v0 = positions[indices[3 * i]];
+		boxes[i] = surrounding_box(surrounding_box(aabb(v0, v0), positions[indices[3 * i + 1]]), positions[indices[3 * i + 2]]);
+		triangles[i] = i;
+		total_box_area += boxes[i].surface_area();
+	}
+
+	if (settings.split_ratio > 0 && triangle_count > 0)
+	{
+		// Pieces are appended, and a split triangle's first piece replaces its original box
+		const float average_box_area = static_cast<float>(total_box_area / triangle_count);
+		for (uint32_t i = 0; i < triangle_count; i++)
+		{
+			const point3& v0 = positions[indices[3 * i]];
+			const float area = 0.5f * cross(positions[indices[3 * i + 1]] - v0, positions[indices[3 * i + 2]] - v0).length();
+			const size_t first_piece = boxes.size();
+			split_triangle(i, boxes[i], area, 0, average_box_area, settings, boxes, triangles);
+			if (boxes.size() > first_piece)
+			{
+				boxes[i] = boxes.back();
+				boxes.pop_back();
+				triangles.pop_back();
+			}
+		}
+	}
+
+	const bvh_builder builder(std::move(boxes), settings.build);
+	build_stats = builder.stats;
+	nodes.clear();
+	linear_bvh::flatten(builder, 0, nodes);
+
+	references.resize(builder.primitive_indices.size());
+	for (size_t i = 0; i < references.size(); i++)
+	{
+		references[i] = triangles[builder.primitive_indices[i]];
+	}
+
+	arrays.positions = positions;
+	arrays.normals = normals;
+	arrays.uvs = uvs;
+	arrays.indices = indices;
+	arrays.references = references;
+	arrays.nodes = nodes;
+	storage = nullptr;
+	if (settings.build.report)
+		settings.build.report->memory_bytes = memory_bytes();
+}
+
+void triangle_mesh::attach(const triangle_mesh_arrays& arrays_, shared_ptr<const void> storage_)
+{
+	arrays = arrays_;
+	storage = std::move(storage_);
+}
+
+void triangle_mesh::split_triangle(uint32_t triangle, const aabb& box, float area, int depth, float average_box_area,
+	const triangle_mesh_settings& settings, std::vector<aabb>& boxes, std::vector<uint32_t>& triangles) const
+{
+	const float box_area = box.surface_area();
+	if (depth >= settings.max_split_depth || box_area <= settings.split_ratio * area || box_area <= average_box_area)
+	{
+		// Unsplit triangles keep the box they already have
+		if (depth > 0)
+		{
+			boxes.push_back(box);
+			triangles.push_back(triangle);
+		}
+		return;
+	}
+
+	// Halve the box along its longest axis and bound the piece of the triangle in each half
+	const point3& v0 = positions[indices[3 * triangle]];
+	const point3& v1 = positions[indices[3 * triangle + 1]];
+	const point3& v2 = positions[indices[3 * triangle + 2]];
+	const int axis = box.longest_axis();
+	const float middle = 0.5f * (box.min_point[axis] + box.max_point[axis]);
+	aabb halves[2] = { box, box };
+	halves[0].max_point[axis] = middle;
+	halves[1].min_point[axis] = middle;
+	for (const aabb& half : halves)
+	{
+		aabb piece_box;
+		float piece_area;
+		if (clip_triangle(v0, v1, v2, half, piece_box, piece_area))
+			split_triangle(triangle, piece_box, piece_area, depth + 1, average_box_area, settings, boxes, triangles);
+	}
+}
+
+bool triangle_mesh::intersect_triangle(const watertight_ray& wr, uint32_t triangle, float t_min, float t_max, float& t, float* weights) const
+{
+	const vec3 a = arrays.positions[arrays.indices[3 * triangle]] - wr.origin;
+	const vec3 b = arrays.positions[arrays.indices[3 * triangle + 1]] - wr.origin;
+	const vec3 c = arrays.positions[arrays.indices[3 * triangle + 2]] - wr.origin;
+	const float ax = a[wr.kx] - wr.sx * a[wr.kz], ay = a[wr.ky] - wr.sy * a[wr.kz];
+	const float bx = b[wr.kx] - wr.sx * b[wr.kz], by = b[wr.ky] - wr.sy * b[wr.kz];
+	const float cx = c[wr.kx] - wr.sx * c[wr.kz], cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+	// Scaled barycentric coordinates: twice the signed areas of the sub-triangles facing each vertex
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+	// On an edge float rounding decides the side, so redo it exactly enough to agree with the
+	// triangle across the edge
+	if (u == 0 || v == 0 || w == 0)
+	{
+		u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+		v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+		w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+	}
+
+	// Both faces count, so the coordinates only need to agree in sign
+	if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+		return false;
+	const float det = u + v + w;
+	if (det == 0)
+		return false;
+
+	const float distance = wr.sz * (u * a[wr.kz] + v * b[wr.kz] + w * c[wr.kz]) / det;
+	if (distance < t_min || distance > t_max)
+		return false;
+
+	t = distance;
+	if (weights)
+	{
+		weights[0] = u / det;
+		weights[1] = v / det;
+		weights[2] = w / det;
+	}
+	return true;
+}
+
+bool triangle_mesh::intersect_leaf(const watertight_ray& wr, uint32_t first, uint32_t count, float t_min, float& t_max, uint32_t& hit_triangle) const
+{
+	bool found = false;
+
+#if RT_SSE
+	const __m128 sx = _mm_set1_ps(wr.sx), sy = _mm_set1_ps(wr.sy), sz = _mm_set1_ps(wr.sz);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 vt_min = _mm_set1_ps(t_min);
+
+	for (uint32_t i = first; i < first + count; i += 4)
+	{
+		// Gather the vertices of four triangles relative to the ray origin, permuted into the ray's
+		// axis order. Past the end of the leaf the last triangle is repeated, which can't change
+		// the closest hit.
+		uint32_t triangles[4];
+		alignas(16) float vertices[9][4];
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			const uint32_t triangle = arrays.references[std::min(i + lane, first + count - 1)];
+			triangles[lane] = triangle;
+			for (int vertex = 0; vertex < 3; vertex++)
+			{
+				const point3& p = arrays.positions[arrays.indices[3 * triangle + vertex]];
+				vertices[3 * vertex][lane] = p[wr.kx] - wr.origin[wr.kx];
+				vertices[3 * vertex + 1][lane] = p[wr.ky] - wr.origin[wr.ky];
+				vertices[3 * vertex + 2][lane] = p[wr.kz] - wr.origin[wr.kz];
+			}
+		}
+
+		const __m128 az = _mm_load_ps(vertices[2]), bz = _mm_load_ps(vertices[5]), cz = _mm_load_ps(vertices[8]);
+		const __m128 ax = _mm_sub_ps(_mm_load_ps(vertices[0]), _mm_mul_ps(sx, az)), ay = _mm_sub_ps(_mm_load_ps(vertices[1]), _mm_mul_ps(sy, az));
+		const __m128 bx = _mm_sub_ps(_mm_load_ps(vertices[3]), _mm_mul_ps(sx, bz)), by = _mm_sub_ps(_mm_load_ps(vertices[4]), _mm_mul_ps(sy, bz));
+		const __m128 cx = _mm_sub_ps(_mm_load_ps(vertices[6]), _mm_mul_ps(sx, cz)), cy = _mm_sub_ps(_mm_load_ps(vertices[7]), _mm_mul_ps(sy, cz));
+
+		const __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+		const __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+		const __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+		const __m128 any_negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+		const __m128 any_positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+		const __m128 on_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+		const __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+		const __m128 distance = _mm_div_ps(
+			_mm_mul_ps(sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz))), det);
+		const __m128 inside = _mm_andnot_ps(_mm_and_ps(any_negative, any_positive), _mm_cmpneq_ps(det, zero));
+		const __m128 valid = _mm_and_ps(_mm_andnot_ps(on_edge, inside),
+			_mm_and_ps(_mm_cmpge_ps(distance, vt_min), _mm_cmple_ps(distance, _mm_set1_ps(t_max))));
+
+		const int valid_mask = _mm_movemask_ps(valid);
+		const int edge_mask = _mm_movemask_ps(on_edge);
+		if ((valid_mask | edge_mask) == 0)
+			continue;
+
+		alignas(16) float t[4];
+		_mm_store_ps(t, distance);
+		for (int lane = 0; lane < 4; lane++)
+		{
+			// Lanes on an edge go through the scalar test for its exact fallback
+			float lane_t;
+			if ((edge_mask >> lane) & 1)
+			{
+				if (!intersect_triangle(wr, triangles[lane], t_min, t_max, lane_t, nullptr))
+					continue;
+			}
+			else if ((valid_mask >> lane) & 1)
+			{
+				lane_t = t[lane];
+			}
+			else
+			{
+				continue;
+			}
+
+			if (lane_t <= t_max)
+			{
+				t_max = lane_t;
+				hit_triangle = triangles[lane];
+				found = true;
+			}
+		}
+	}
+#else
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		float t;
+		if (intersect_triangle(wr, arrays.references[i], t_min, t_max, t, nullptr))
+		{
+			t_max = t;
+			hit_triangle = arrays.references[i];
+			found = true;
+		}
+	}
+#endif
+
+	return found;
+}
+
+bool triangle_mesh::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	if (arrays.nodes.empty())
+		return false;
+
+	const watertight_ray wr(r);
+	uint32_t stack[linear_bvh::max_stack_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	uint32_t hit_triangle = 0;
+	bool hit_anything = false;
+
+	while (true)
+	{
+		const linear_bvh_node& node = arrays.nodes[current];
+		if (node.box.hit(r, t_min, t_max))
+		{
+			if (node.is_leaf())
+			{
+				hit_anything |= intersect_leaf(wr, node.primitives_offset, node.primitive_count, t_min, t_max, hit_triangle);
+			}
+			else
+			{
+				if (r.sign[node.axis])
+				{
+					stack[stack_size++] = current + 1;
+					current = node.second_child_offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.second_child_offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+
+	if (hit_anything)
+		hit.set(t_max, this, hit_triangle);
+	return hit_anything;
+}
+
+uint64_t triangle_mesh::intersect_packet(const ray_packet& packet, uint64_t active, float t_min, float* t_max, primitive_hit* hits) const
+{
+	if (arrays.nodes.empty() || active == 0)
+		return 0;
+
+	watertight_ray watertight[ray_packet::max_size];
+	for (int i = 0; i < packet.size; i++)
+	{
+		if ((active >> i) & 1)
+			watertight[i] = watertight_ray(packet.rays[i]);
+	}
+
+	return linear_bvh::traverse_packet(arrays.nodes.data(), packet, active, t_min, t_max, [&](const linear_bvh_node& node, uint64_t rays)
+	{
+		// Leaves are already SIMD across triangles, so their rays go through one by one
+		uint64_t found = 0;
+		for (int i = 0; i < packet.size; i++)
+		{
+			uint32_t hit_triangle;
+			if (((rays >> i) & 1) && intersect_leaf(watertight[i], node.primitives_offset, node.primitive_count, t_min, t_max[i], hit_triangle))
+			{
+				hits[i].set(t_max[i], this, hit_triangle);
+				found |= 1ull << i;
+			}
+		}
+		return found;
+	});
+}
+
+bool triangle_mesh::occluded(const ray& r, float t_min, float t_max) const
+{
+	if (arrays.nodes.empty())
+		return false;
+
+	const watertight_ray wr(r);
+	return linear_bvh::traverse_occluded(arrays.nodes.data(), r, t_min, t_max, [&](const linear_bvh_node& node)
+	{
+		float leaf_t_max = t_max;
+		uint32_t hit_triangle;
+		return intersect_leaf(wr, node.primitives_offset, node.primitive_count, t_min, leaf_t_max, hit_triangle);
+	});
+}
+
+void triangle_mesh::resolve(const ray& r, const primitive_hit& hit, hit_record& rec) const
+{
+	// Traversal kept only the distance, so test the one triangle again for its barycentrics
+	const uint32_t triangle = hit.primitive;
+	const uint32_t i0 = arrays.indices[3 * triangle], i1 = arrays.indices[3 * triangle + 1], i2 = arrays.indices[3 * triangle + 2];
+	float t;
+	float weights[3] = { 1.f / 3, 1.f / 3, 1.f / 3 };
+	intersect_triangle(watertight_ray(r), triangle, -infinity, infinity, t, weights);
+
+	rec.t = hit.t;
+	rec.p = r.at(rec.t);
+	const vec3 geometric_normal = normalize(cross(arrays.positions[i1] - arrays.positions[i0], arrays.positions[i2] - arrays.positions[i0]));
+	if (arrays.normals.empty())
+		rec.set_face_normal(r, geometric_normal);
+	else
+		rec.set_face_normal(r, normalize(weights[0] * arrays.normals[i0] + weights[1] * arrays.normals[i1] + weights[2] * arrays.normals[i2]));
+
+	if (arrays.uvs.empty())
+	{
+		rec.u = weights[1];
+		rec.v = weights[2];
+	}
+	else
+	{
+		rec.u = weights[0] * arrays.uvs[2 * i0] + weights[1] * arrays.uvs[2 * i1] + weights[2] * arrays.uvs[2 * i2];
+		rec.v = weights[0] * arrays.uvs[2 * i0 + 1] + weights[1] * arrays.uvs[2 * i1 + 1] + weights[2] * arrays.uvs[2 * i2 + 1];
+	}
+	rec.material_id = material_id;
+}
+
+bool triangle_mesh::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (arrays.nodes.empty())
+		return false;
+
+	output_box = arrays.nodes[0].box;
+	return true;
+}
+
+size_t triangle_mesh::memory_bytes() const
+{
+	return arrays.positions.size() * sizeof(point3) + arrays.normals.size() * sizeof(vec3) + arrays.uvs.size() * sizeof(float)
+		+ arrays.indices.size() * sizeof(uint32_t) + arrays.references.size() * sizeof(uint32_t) + arrays.nodes.size() * sizeof(linear_bvh_node);
+}
\ No newline at end of file
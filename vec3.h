@@ -20,8 +20,8 @@ public:
 	vec3(float x_, float y_, float z_) : x(x_), y(y_), z(z_) {}
 
 	vec3 operator-() const { return vec3(-x, -y, -z); }
-	float operator[](const int i) const { return y; }
-	float& operator[](const int i) { return y; }
+	float operator[](const int i) const { return (&x)[i]; }
+	float& operator[](const int i) { return (&x)[i]; }
 
 	vec3& operator+=(const vec3& v)
 	{
@@ -148,6 +148,14 @@ vec3 max(const vec3& a, const vec3& b)
 	return vec3(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
 }
 
+// Two unit vectors spanning the plane with the given unit normal
+void plane_basis(const vec3& normal, vec3& tangent, vec3& bitangent)
+{
+	const vec3 helper = fabs(normal.x) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	tangent = normalize(cross(helper, normal));
+	bitangent = cross(normal, tangent);
+}
+
 vec3 random_in_unit_sphere()
 {
 	while (true)
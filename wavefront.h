@@ -0,0 +1,423 @@
+#pragma once
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+#include "ray_packet.h"
+#include "render.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+struct wavefront_settings
+{
+	// Paths in flight at once; capped at the pixel count so no pixel is in a batch twice. Small
+	// enough for the batch's state to stay in cache between kernels.
+	size_t batch_size = 1 << 14;
+	// Sort paths by direction octant before each extend, and by material before each shade
+	bool sort_paths = true;
+};
+
+struct wavefront_stats
+{
+	size_t paths = 0;
+	size_t rays = 0;			// extension rays traced, over all bounces
+	double generate_ms = 0;
+	double extend_ms = 0;
+	double sort_ms = 0;
+	double shade_ms = 0;
+	double connect_ms = 0;
+	double total_ms = 0;
+
+	double rays_per_second() const { return total_ms > 0 ? rays / (total_ms / 1000) : 0; }
+	double average_length() const { return paths > 0 ? static_cast<double>(rays) / paths : 0; }
+};
+
+std::ostream& operator<<(std::ostream& out, const wavefront_stats& stats)
+{
+	return out << "paths: " << stats.paths
+		<< ", rays: " << stats.rays << " (" << stats.rays_per_second() / 1e6 << " Mrays/s, " << stats.average_length() << " per path)"
+		<< ", generate: " << stats.generate_ms << "ms"
+		<< ", extend: " << stats.extend_ms << "ms"
+		<< ", sort: " << stats.sort_ms << "ms"
+		<< ", shade: " << stats.shade_ms << "ms"
+		<< ", connect: " << stats.connect_ms << "ms"
+		<< ", total: " << stats.total_ms << "ms";
+}
+
+// State of every path in a batch, one array per field. Kernels walk a queue of path indices and
+// touch only the fields they need. Hits are kept as found by traversal, and only resolved into
+// hit_records by the shade kernel, which uses them straight away.
+struct path_buffer
+{
+	enum status : uint8_t { missed, hit, scattered, absorbed, terminated };
+
+	void resize(size_t count);
+
+	ray get_ray(uint32_t path) const
+	{
+		return ray(point3(origin_x[path], origin_y[path], origin_z[path]), vec3(dir_x[path], dir_y[path], dir_z[path]), time[path]);
+	}
+	void set_ray(uint32_t path, const ray& r);
+	primitive_hit get_hit(uint32_t path) const;
+	void set_hit(uint32_t path, const primitive_hit& hit);
+
+	std::vector<float> origin_x, origin_y, origin_z;
+	std::vector<float> dir_x, dir_y, dir_z;
+	std::vector<float> time;
+	std::vector<float> throughput_r, throughput_g, throughput_b;
+	std::vector<float> scattering_pdf;	// with which the current ray was picked, for weighting the light it finds
+	std::vector<uint32_t> pixel;		// index into the color buffers
+	std::vector<uint8_t> state;
+	// The current ray's closest hit, when state is hit, and the material it will be shaded with
+	std::vector<float> hit_t;
+	std::vector<const hittable*> hit_object;
+	std::vector<uint32_t> hit_primitive;
+	std::vector<uint8_t> hit_instance_count;
+	std::vector<std::array<const hittable*, primitive_hit::max_instance_depth>> hit_instances;	// only read for instanced hits
+	std::vector<material_handle> material;
+};
+
+void path_buffer::resize(size_t count)
+{
+	for (auto* field : { &origin_x, &origin_y, &origin_z, &dir_x, &dir_y, &dir_z, &time, &throughput_r, &throughput_g, &throughput_b, &scattering_pdf })
+	{
+		field->resize(count);
+	}
+	pixel.resize(count);
+	state.resize(count);
+	hit_t.resize(count);
+	hit_object.resize(count);
+	hit_primitive.resize(count);
+	hit_instance_count.resize(count);
+	hit_instances.resize(count);
+	material.resize(count);
+}
+
+void path_buffer::set_ray(uint32_t path, const ray& r)
+{
+	origin_x[path] = r.origin.x;
+	origin_y[path] = r.origin.y;
+	origin_z[path] = r.origin.z;
+	dir_x[path] = r.dir.x;
+	dir_y[path] = r.dir.y;
+	dir_z[path] = r.dir.z;
+	time[path] = r.time;
+}
+
+primitive_hit path_buffer::get_hit(uint32_t path) const
+{
+	primitive_hit hit;
+	hit.set(hit_t[path], hit_object[path], hit_primitive[path]);
+	hit.instance_count = hit_instance_count[path];
+	std::copy(hit_instances[path].begin(), hit_instances[path].begin() + hit.instance_count, hit.instances);
+	return hit;
+}
+
+void path_buffer::set_hit(uint32_t path, const primitive_hit& hit)
+{
+	hit_t[path] = hit.t;
+	hit_object[path] = hit.object;
+	hit_primitive[path] = hit.primitive;
+	hit_instance_count[path] = static_cast<uint8_t>(hit.instance_count);
+	std::copy(hit.instances, hit.instances + hit.instance_count, hit_instances[path].begin());
+	material[path] = hit.material();
+}
+
+// Stable counting sort of queue into sorted by bin(path) < num_bins; paths whose bin is num_bins
+// or more are dropped. counts receives each bin's size.
+template<class F>
+void bin_paths(const std::vector<uint32_t>& queue, size_t num_bins, const F& bin, std::vector<uint32_t>& sorted, std::vector<uint32_t>& counts)
+{
+	counts.assign(num_bins + 1, 0);
+	for (const uint32_t path : queue)
+	{
+		counts[std::min<size_t>(bin(path), num_bins)]++;
+	}
+
+	std::vector<uint32_t> offsets(num_bins + 1, 0);
+	for (size_t i = 1; i <= num_bins; i++)
+	{
+		offsets[i] = offsets[i - 1] + counts[i - 1];
+	}
+	sorted.resize(offsets[num_bins]);
+	for (const uint32_t path : queue)
+	{
+		const size_t b = bin(path);
+		if (b < num_bins)
+			sorted[offsets[b]++] = path;
+	}
+	counts.pop_back();
+}
+
+// Renders the same image as render(), but breadth first: rather than following one path to its end
+// before starting the next, a batch of paths is advanced one bounce at a time by separate kernels,
+// each a parallel loop over a queue of paths:
+//   generate - camera rays for every sample in the batch
+//   extend   - closest hit of each path's ray
+//   shade    - scatter the paths that hit something off their material
+//   connect  - add the light of paths that reach the sky to their pixel
+// Between kernels the queues are binned, so the shade kernel runs each material's paths together
+// and the extend kernel traces rays heading into the same octant together.
+// The estimate per path is exactly that of ray_color(): the shade kernel also adds the light of
+// emitters that are hit and samples settings.lights with shadow rays.
+// This is not a faster way to render. It traces the same rays through the same nodes as render()
+// with packet_size 8, and adds the sorts and the round trips of path state between kernels, so it
+// runs at about 0.75x to 0.9x of render()'s speed on a single core. It exists to measure what each
+// kernel costs and what the binning buys; render() remains the integrator to use.
+void render_wavefront(const hittable& world, const material_table& materials, const camera& cam, const render_settings& settings,
+	const wavefront_settings& wavefront, thread_pool& pool, color* color_buffer, color* albedo_ms_buffer, wavefront_stats* stats = nullptr)
+{
+	using clock = std::chrono::high_resolution_clock;
+	const auto elapsed_ms = [](clock::time_point start) { return std::chrono::duration<double, std::milli>(clock::now() - start).count(); };
+	const auto render_start = clock::now();
+	wavefront_stats run_stats;
+
+	const size_t num_pixels = static_cast<size_t>(settings.image_width) * settings.image_height;
+	std::fill(color_buffer, color_buffer + num_pixels, color());
+	std::fill(albedo_ms_buffer, albedo_ms_buffer + num_pixels, color());
+
+	// Pixels in 8x8 tiles, so that the primary rays of each tile can be traced as a packet
+	const int tile_size = 8;
+	static_assert(tile_size * tile_size <= ray_packet::max_size, "a tile must fit in a packet");
+	std::vector<uint32_t> pixel_order;
+	std::vector<uint8_t> starts_tile(num_pixels, 0);	// by position in pixel_order
+	pixel_order.reserve(num_pixels);
+	for (int y0 = 0; y0 < settings.image_height; y0 += tile_size)
+	{
+		for (int x0 = 0; x0 < settings.image_width; x0 += tile_size)
+		{
+			starts_tile[pixel_order.size()] = 1;
+			for (int y = y0; y < std::min(y0 + tile_size, settings.image_height); y++)
+			{
+				for (int x = x0; x < std::min(x0 + tile_size, settings.image_width); x++)
+				{
+					pixel_order.push_back(static_cast<uint32_t>(settings.image_width * (settings.image_height - 1 - y) + x));
+				}
+			}
+		}
+	}
+
+	const bool sample_lights = settings.lights && !settings.lights->empty();
+	const size_t total_paths = num_pixels * std::max(settings.samples_per_pixel, 0);
+	const size_t batch_size = std::max<size_t>(1, std::min(wavefront.batch_size, num_pixels));
+	path_buffer paths;
+	paths.resize(std::min(batch_size, total_paths));
+	std::vector<uint32_t> queue, sorted, next_queue, counts;
+	std::vector<uint32_t> packet_begin;	// where each primary packet starts in the queue, then the queue's end
+
+	for (size_t first_path = 0; first_path < total_paths; first_path += batch_size)
+	{
+		const size_t count = std::min(batch_size, total_paths - first_path);
+
+		// Generate: path i of the batch is sample (first_path + i) / num_pixels of a pixel in tile order
+		auto kernel_start = clock::now();
+		pool.parallel_for(count, 4096, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const uint32_t buffer_idx = pixel_order[(first_path + i) % num_pixels];
+				const int x = buffer_idx % settings.image_width, y = settings.image_height - 1 - static_cast<int>(buffer_idx / settings.image_width);
+				const auto u = (x + random_float()) / (settings.image_width - 1);
+				const auto v = (y + random_float()) / (settings.image_height - 1);
+				const uint32_t path = static_cast<uint32_t>(i);
+				paths.set_ray(path, cam.get_ray(u, v));
+				paths.pixel[path] = buffer_idx;
+				// With no bounces allowed the path gathers no light, but its first hit still gives the albedo
+				const float throughput = settings.max_depth > 0 ? 1.f : 0.f;
+				paths.throughput_r[path] = paths.throughput_g[path] = paths.throughput_b[path] = throughput;
+				paths.scattering_pdf[path] = 0;
+			}
+		});
+		queue.resize(count);
+		packet_begin.clear();
+		for (size_t i = 0; i < count; i++)
+		{
+			queue[i] = static_cast<uint32_t>(i);
+			// Batches and images rarely hold a whole number of tiles, so packets follow the tiles
+			if (i == 0 || starts_tile[(first_path + i) % num_pixels])
+				packet_begin.push_back(static_cast<uint32_t>(i));
+		}
+		packet_begin.push_back(static_cast<uint32_t>(count));
+		run_stats.generate_ms += elapsed_ms(kernel_start);
+		run_stats.paths += count;
+
+		// depth counts down as ray_color's argument does; bounce 0 always runs for the albedo
+		for (int depth = settings.max_depth, bounce = 0; !queue.empty(); depth--, bounce++)
+		{
+			// Extend. Primary rays are traced as packets of a tile each; scattered rays
+			// one at a time, since even within an octant they spread too far for packet bounds to cull
+			// any node their rays miss, and testing every ray against every node the packet reaches cost
+			// more than it saved.
+			kernel_start = clock::now();
+			if (bounce == 0)
+			{
+				pool.parallel_for(packet_begin.size() - 1, 16, [&](size_t begin, size_t end)
+				{
+					ray_packet packet;
+					float t_max[ray_packet::max_size];
+					primitive_hit hits[ray_packet::max_size];
+					for (size_t group = begin; group < end; group++)
+					{
+						const size_t group_begin = packet_begin[group];
+						packet.clear();
+						for (size_t i = group_begin; i < packet_begin[group + 1]; i++)
+						{
+							packet.add(paths.get_ray(queue[i]));
+						}
+						packet.finish();
+						std::fill(t_max, t_max + ray_packet::max_size, infinity);
+						const uint64_t found = world.intersect_packet(packet, packet.all(), 0.001, t_max, hits);
+						for (int i = 0; i < packet.size; i++)
+						{
+							const uint32_t path = queue[group_begin + i];
+							paths.state[path] = ((found >> i) & 1) ? path_buffer::hit : path_buffer::missed;
+							if ((found >> i) & 1)
+								paths.set_hit(path, hits[i]);
+						}
+					}
+				});
+			}
+			else
+			{
+				pool.parallel_for(queue.size(), 1024, [&](size_t begin, size_t end)
+				{
+					primitive_hit hit;
+					for (size_t i = begin; i < end; i++)
+					{
+						const uint32_t path = queue[i];
+						const bool found = world.intersect(paths.get_ray(path), 0.001, infinity, hit);
+						paths.state[path] = found ? path_buffer::hit : path_buffer::missed;
+						if (found)
+							paths.set_hit(path, hit);
+					}
+				});
+			}
+			run_stats.extend_ms += elapsed_ms(kernel_start);
+			run_stats.rays += queue.size();
+
+			// Hits to shade, by material, then misses to connect
+			kernel_start = clock::now();
+			const size_t num_materials = materials.size();
+			bin_paths(queue, num_materials + 1, [&](uint32_t path)
+			{
+				if (paths.state[path] == path_buffer::missed)
+					return num_materials;
+				return wavefront.sort_paths ? static_cast<size_t>(paths.material[path]) : 0;
+			}, sorted, counts);
+			const size_t num_hits = sorted.size() - counts[num_materials];
+			std::swap(queue, sorted);
+			run_stats.sort_ms += elapsed_ms(kernel_start);
+
+			// Shade
+			kernel_start = clock::now();
+			pool.parallel_for(num_hits, 1024, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const uint32_t path = queue[i];
+					const ray r = paths.get_ray(path);
+					hit_record rec;
+					paths.get_hit(path).resolve(r, rec);
+					const material& m = materials[rec.material_id];
+					const uint32_t buffer_idx = paths.pixel[path];
+					color throughput(paths.throughput_r[path], paths.throughput_g[path], paths.throughput_b[path]);
+					if (bounce == 0)
+						albedo_ms_buffer[buffer_idx] += m.get_albedo(rec.u, rec.v, rec.p);
+					if (m.is_emissive())
+						color_buffer[buffer_idx] += throughput * m.emitted(rec.u, rec.v, rec.p) * scattered_light_weight(r, paths.hit_object[path], paths.scattering_pdf[path], settings.lights);
+
+					ray scattered;
+					color attenuation;
+					if (!m.scatter(r, rec, attenuation, scattered))
+					{
+						// Absorbed paths still see the sky along the ray that reached the surface, unless they ended on a light
+						paths.state[path] = m.is_emissive() ? path_buffer::terminated : path_buffer::absorbed;
+						continue;
+					}
+					if (depth - 1 <= 0)
+					{
+						paths.state[path] = path_buffer::terminated;
+						continue;
+					}
+
+					const float scattering_pdf = m.scattering_pdf(r, rec, scattered);
+					if (sample_lights && scattering_pdf > 0)
+						color_buffer[buffer_idx] += throughput * sample_direct_light(r, rec, m, attenuation, world, materials, *settings.lights);
+
+					throughput = throughput * attenuation;
+					if (settings.roulette_depth >= 0 && bounce + 1 >= settings.roulette_depth && !survives_roulette(throughput))
+					{
+						paths.state[path] = path_buffer::terminated;
+						continue;
+					}
+					paths.state[path] = path_buffer::scattered;
+					paths.set_ray(path, scattered);
+					paths.throughput_r[path] = throughput.r;
+					paths.throughput_g[path] = throughput.g;
+					paths.throughput_b[path] = throughput.b;
+					paths.scattering_pdf[path] = scattering_pdf;
+				}
+			});
+			run_stats.shade_ms += elapsed_ms(kernel_start);
+
+			// Connect
+			kernel_start = clock::now();
+			pool.parallel_for(queue.size(), 1024, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const uint32_t path = queue[i];
+					const uint8_t state = paths.state[path];
+					if (state != path_buffer::missed && state != path_buffer::absorbed)
+						continue;
+
+					const color sky = ray_world_albedo(paths.get_ray(path));
+					const uint32_t buffer_idx = paths.pixel[path];
+					if (bounce == 0 && state == path_buffer::missed)
+						albedo_ms_buffer[buffer_idx] += sky;
+					color_buffer[buffer_idx] += color(paths.throughput_r[path] * sky.r, paths.throughput_g[path] * sky.g, paths.throughput_b[path] * sky.b);
+				}
+			});
+			run_stats.connect_ms += elapsed_ms(kernel_start);
+
+			// Scattered paths, by the octant they now head into. They are binned from the order this
+			// bounce's rays were traced in, still in sorted, rather than by material, so neighbouring
+			// rays in the queue keep coming from neighbouring pixels.
+			kernel_start = clock::now();
+			const size_t num_octants = 8;
+			bin_paths(sorted, num_octants, [&](uint32_t path) -> size_t
+			{
+				if (paths.state[path] != path_buffer::scattered)
+					return num_octants;
+				if (!wavefront.sort_paths)
+					return 0;
+				return (paths.dir_x[path] < 0) | (paths.dir_y[path] < 0) << 1 | (paths.dir_z[path] < 0) << 2;
+			}, next_queue, counts);
+			std::swap(queue, next_queue);
+			run_stats.sort_ms += elapsed_ms(kernel_start);
+		}
+	}
+
+	pool.parallel_for(num_pixels, 4096, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			resolve_samples(color_buffer[i], settings.samples_per_pixel);
+			resolve_samples(albedo_ms_buffer[i], settings.samples_per_pixel);
+		}
+	});
+
+	run_stats.total_ms = elapsed_ms(render_start);
+	if (stats)
+		*stats = run_stats;
+}
\ No newline at end of file
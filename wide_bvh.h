@@ -0,0 +1,382 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "rtweekend.h"
+#include "simd.h"
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+// Node of an N-wide BVH. Child boxes are stored as structure-of-arrays so a ray can be tested
+// against all of them at once.
+template<int N>
+struct wide_bvh_node
+{
+	float min_x[N], min_y[N], min_z[N];
+	float max_x[N], max_y[N], max_z[N];
+	uint32_t child[N];	// node index for interior children, first primitive for leaves
+	uint32_t count[N];	// primitive count for leaf children, 0 for interior children and empty slots
+
+	void set_child(int i, const aabb& box, uint32_t child_, uint32_t count_)
+	{
+		min_x[i] = box.min_point.x; min_y[i] = box.min_point.y; min_z[i] = box.min_point.z;
+		max_x[i] = box.max_point.x; max_y[i] = box.max_point.y; max_z[i] = box.max_point.z;
+		child[i] = child_;
+		count[i] = count_;
+	}
+};
+
+// Per-ray values shared by every node test
+struct wide_ray
+{
+	wide_ray(const ray& r)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			origin[i] = r.origin[i];
+			inv_dir[i] = r.inv_dir[i];
+			// Picking near/far planes by the sign of the inverse direction (rather than taking
+			// min/max of the two) keeps empty slots, whose boxes are inverted, from ever being hit
+			neg[i] = r.sign[i];
+		}
+	}
+
+	float origin[3];
+	float inv_dir[3];
+	int neg[3];
+};
+
+// Tests a ray against every child box of a node. Returns a bitmask of the children hit and writes
+// each child's entry distance to dist.
+template<int N>
+int intersect_children(const wide_bvh_node<N>& node, const wide_ray& wr, float t_min, float t_max, float* dist)
+{
+	const float* mins[3] = { node.min_x, node.min_y, node.min_z };
+	const float* maxs[3] = { node.max_x, node.max_y, node.max_z };
+
+	int mask = 0;
+	for (int i = 0; i < N; i++)
+	{
+		float t_near = t_min;
+		float t_far = t_max;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float near_plane = wr.neg[axis] ? maxs[axis][i] : mins[axis][i];
+			const float far_plane = wr.neg[axis] ? mins[axis][i] : maxs[axis][i];
+			t_near = max(t_near, (near_plane - wr.origin[axis]) * wr.inv_dir[axis]);
+			t_far = min(t_far, (far_plane - wr.origin[axis]) * wr.inv_dir[axis]);
+		}
+		dist[i] = t_near;
+		mask |= (t_near <= t_far) << i;
+	}
+	return mask;
+}
+
+#if RT_SSE
+// Slab test against four consecutive children starting at offset
+template<int N>
+int intersect_children4(const wide_bvh_node<N>& node, const wide_ray& wr, float t_min, float t_max, float* dist, int offset)
+{
+	const float* mins[3] = { node.min_x + offset, node.min_y + offset, node.min_z + offset };
+	const float* maxs[3] = { node.max_x + offset, node.max_y + offset, node.max_z + offset };
+
+	__m128 t_near = _mm_set1_ps(t_min);
+	__m128 t_far = _mm_set1_ps(t_max);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const __m128 origin = _mm_set1_ps(wr.origin[axis]);
+		const __m128 inv_dir = _mm_set1_ps(wr.inv_dir[axis]);
+		const __m128 near_plane = _mm_loadu_ps(wr.neg[axis] ? maxs[axis] : mins[axis]);
+		const __m128 far_plane = _mm_loadu_ps(wr.neg[axis] ? mins[axis] : maxs[axis]);
+		// max/min return their second operand when the first is NaN (0 * inf), which keeps the test conservative
+		t_near = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, origin), inv_dir), t_near);
+		t_far = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, origin), inv_dir), t_far);
+	}
+	_mm_storeu_ps(dist + offset, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) << offset;
+}
+
+int intersect_children(const wide_bvh_node<4>& node, const wide_ray& wr, float t_min, float t_max, float* dist)
+{
+	return intersect_children4(node, wr, t_min, t_max, dist, 0);
+}
+
+int intersect_children(const wide_bvh_node<8>& node, const wide_ray& wr, float t_min, float t_max, float* dist)
+{
+#if RT_AVX
+	const float* mins[3] = { node.min_x, node.min_y, node.min_z };
+	const float* maxs[3] = { node.max_x, node.max_y, node.max_z };
+
+	__m256 t_near = _mm256_set1_ps(t_min);
+	__m256 t_far = _mm256_set1_ps(t_max);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const __m256 origin = _mm256_set1_ps(wr.origin[axis]);
+		const __m256 inv_dir = _mm256_set1_ps(wr.inv_dir[axis]);
+		const __m256 near_plane = _mm256_loadu_ps(wr.neg[axis] ? maxs[axis] : mins[axis]);
+		const __m256 far_plane = _mm256_loadu_ps(wr.neg[axis] ? mins[axis] : maxs[axis]);
+		t_near = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, origin), inv_dir), t_near);
+		t_far = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, origin), inv_dir), t_far);
+	}
+	_mm256_storeu_ps(dist, t_near);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+#else
+	return intersect_children4(node, wr, t_min, t_max, dist, 0)
+		| intersect_children4(node, wr, t_min, t_max, dist, 4);
+#endif
+}
+#endif
+
+// Picks up to N descendants of a build node to become the children of one wide node, pulling
+// grandchildren up by always opening the interior child with the largest surface area until all
+// N slots are used or only leaves remain. Returns the number of children.
+template<int N>
+int gather_wide_children(const bvh_builder& builder, uint32_t build_index, uint32_t* children)
+{
+	int num_children = 0;
+	const bvh_build_node& build_node = builder.nodes[build_index];
+	if (build_node.is_leaf())
+	{
+		children[num_children++] = build_index;
+	}
+	else
+	{
+		children[num_children++] = build_node.left;
+		children[num_children++] = build_node.right;
+	}
+
+	while (num_children < N)
+	{
+		int best = -1;
+		float best_area = -1;
+		for (int i = 0; i < num_children; i++)
+		{
+			const bvh_build_node& child = builder.nodes[children[i]];
+			if (!child.is_leaf() && child.box.surface_area() > best_area)
+			{
+				best = i;
+				best_area = child.box.surface_area();
+			}
+		}
+		if (best < 0)
+			break;
+
+		const bvh_build_node& opened = builder.nodes[children[best]];
+		children[best] = opened.left;
+		children[num_children++] = opened.right;
+	}
+	return num_children;
+}
+
+// BVH with N children per node (N = 4 for QBVH, 8 for OBVH), made by collapsing the binary tree
+// from bvh_builder. Children are visited nearest-first and skipped once the closest hit is nearer
+// than their entry point.
+template<int N>
+class wide_bvh : public hittable
+{
+public:
+	// A wide tree is no deeper than the binary one it collapses, and every level defers at most N - 1 children
+	static const int max_stack_depth = bvh_max_depth * (N - 1);
+
+	wide_bvh() {}
+	wide_bvh(const hittable_list& list, float time0, float time1, const bvh_build_settings& settings = bvh_build_settings());
+
+	virtual bool intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const override;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const override;
+	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+
+	std::vector<wide_bvh_node<N>> nodes;
+	std::vector<shared_ptr<hittable>> primitives;
+	aabb box;
+	bvh_build_stats build_stats;
+
+private:
+	uint32_t collapse(const bvh_builder& builder, uint32_t build_index, int depth);
+};
+
+using qbvh = wide_bvh<4>;
+using obvh = wide_bvh<8>;
+
+template<int N>
+wide_bvh<N>::wide_bvh(const hittable_list& list, float time0, float time1, const bvh_build_settings& settings)
+{
+	const bvh_builder builder(gather_bounding_boxes(list.objects, time0, time1, settings.report), settings);
+	build_stats = builder.stats;
+	if (builder.nodes.empty())
+		return;
+
+	box = builder.nodes[0].box;
+	nodes.reserve(builder.nodes.size() / (N - 1) + 1);
+	collapse(builder, 0, 0);
+	if (settings.report)
+		settings.report->memory_bytes = nodes.size() * sizeof(wide_bvh_node<N>);
+
+	primitives.reserve(builder.primitive_indices.size());
+	for (const uint32_t index : builder.primitive_indices)
+	{
+		primitives.push_back(list.objects[index]);
+	}
+}
+
+template<int N>
+uint32_t wide_bvh<N>::collapse(const bvh_builder& builder, uint32_t build_index, int depth)
+{
+	assert(depth <= bvh_max_depth);
+
+	uint32_t children[N];
+	const int num_children = gather_wide_children<N>(builder, build_index, children);
+
+	const auto node_index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+	for (int i = 0; i < N; i++)
+	{
+		if (i >= num_children)
+		{
+			nodes[node_index].set_child(i, aabb::empty(), 0, 0);
+			continue;
+		}
+
+		const bvh_build_node& child = builder.nodes[children[i]];
+		if (child.is_leaf())
+		{
+			nodes[node_index].set_child(i, child.box, child.first, child.count);
+		}
+		else
+		{
+			const uint32_t child_index = collapse(builder, children[i], depth + 1);
+			nodes[node_index].set_child(i, child.box, child_index, 0);
+		}
+	}
+	return node_index;
+}
+
+template<int N>
+bool wide_bvh<N>::intersect(const ray& r, float t_min, float t_max, primitive_hit& hit) const
+{
+	if (nodes.empty())
+		return false;
+
+	struct stack_entry
+	{
+		uint32_t index;	// node index, or first primitive for leaves
+		uint32_t count;	// primitive count for leaves, 0 for nodes
+		float t;		// distance at which the ray enters the box
+	};
+
+	const wide_ray wr(r);
+	stack_entry stack[max_stack_depth];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, t_min };
+	bool hit_anything = false;
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+		if (entry.t > t_max)
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.count; i++)
+			{
+				if (primitives[i]->intersect(r, t_min, t_max, hit))
+				{
+					hit_anything = true;
+					t_max = hit.t;
+				}
+			}
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = nodes[entry.index];
+		float dist[N];
+		const int mask = intersect_children(node, wr, t_min, t_max, dist);
+		if (mask == 0)
+			continue;
+
+		// Push hit children farthest first so the nearest is popped next
+		stack_entry hits[N];
+		int num_hits = 0;
+		for (int i = 0; i < N; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			const stack_entry child = { node.child[i], node.count[i], dist[i] };
+			int j = num_hits++;
+			while (j > 0 && hits[j - 1].t < child.t)
+			{
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = child;
+		}
+
+		assert(stack_size + num_hits <= max_stack_depth);
+		for (int i = 0; i < num_hits; i++)
+		{
+			stack[stack_size++] = hits[i];
+		}
+	}
+
+	return hit_anything;
+}
+
+template<int N>
+bool wide_bvh<N>::occluded(const ray& r, float t_min, float t_max) const
+{
+	if (nodes.empty())
+		return false;
+
+	struct stack_entry
+	{
+		uint32_t index;	// node index, or first primitive for leaves
+		uint32_t count;	// primitive count for leaves, 0 for nodes
+	};
+
+	// Any hit will do, so children are pushed as they come, without sorting by distance
+	const wide_ray wr(r);
+	stack_entry stack[max_stack_depth];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0 };
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+		if (entry.count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.count; i++)
+			{
+				if (primitives[i]->occluded(r, t_min, t_max))
+					return true;
+			}
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = nodes[entry.index];
+		float dist[N];
+		const int mask = intersect_children(node, wr, t_min, t_max, dist);
+		assert(stack_size + N <= max_stack_depth);
+		for (int i = 0; i < N; i++)
+		{
+			if (mask & (1 << i))
+				stack[stack_size++] = { node.child[i], node.count[i] };
+		}
+	}
+
+	return false;
+}
+
+template<int N>
+bool wide_bvh<N>::bounding_box(float time0, float time1, aabb& output_box) const
+{
+	if (nodes.empty())
+		return false;
+
+	output_box = box;
+	return true;
+}
\ No newline at end of file